@@ -0,0 +1,320 @@
+// Standalone driver for the miloR NB-GLMM engine
+//
+// Fits the same NB-GLMM to every row of a count matrix, as testNhoods does for a GLMM without a kinship matrix, but
+// without R - e.g. to run the engine multi-threaded under perf or a debugger. See the Makefile for building.
+//
+// usage:
+//   milor_glmm --counts Y.bin --fixed X.bin --random Z.bin --re-sizes q1[,q2,...] [options]
+//
+// Y is the nhood X sample matrix of counts, X the sample X m fixed effect design matrix and Z the sample X stot
+// random effect design matrix, with the columns of each random effect in contiguous blocks of q1, q2, ... columns.
+// Matrices are read with armadillo's auto-detection, so these can be armadillo binary, CSV or plain whitespace
+// delimited text. From R, an armadillo binary file can be written with:
+//
+//   writeArmaBinary <- function(x, file){
+//       con <- file(file, "wb")
+//       on.exit(close(con))
+//       writeChar(sprintf("ARMA_MAT_BIN_FN008\n%d %d\n", nrow(x), ncol(x)), con, eos=NULL)
+//       writeBin(as.double(x), con, size=8, endian="little")
+//   }
+//
+// options:
+//   --offsets FILE         length n vector of model offsets (default: 0)
+//   --disp FILE|VALUE      initial NB dispersion, 1 per nhood or a single value for all (default: 1)
+//   --solver NAME          HE, HE-NNLS, Fisher or Fisher-Hutchinson (default: Fisher)
+//   --reml                 use REML for the variance components
+//   --random-intercept     the last random effect is the residual variance
+//   --maxit N              maximum number of iterations (default: 100)
+//   --tol X                convergence tolerance (default: 1e-6)
+//   --probes N             Rademacher probes for Fisher-Hutchinson (default: 30)
+//   --accelerate           Anderson acceleration of the outer iterations
+//   --precision NAME       double or mixed (default: double)
+//   --threads N            nhood models fit concurrently (default: 1)
+//   --fit-threads N        BLAS threads within each fit, 0 to leave unchanged (default: 0)
+//   --timings              add the per-phase timings to the output
+//   --contrasts FILE       m X k matrix of fixed effect contrasts, 1 per column, to test in each nhood
+//   --seed N               seed for the initial random effects (default: 42)
+//   --out FILE             tab-delimited results, 1 row per nhood (default: stdout)
+
+#include "milorArma.h"
+#include "fitPLGlmmBatch.h"
+#include "glmmTimer.h"
+#include "mixedPrecision.h"
+#include "utils.h"
+#include<algorithm>
+#include<chrono>
+#include<fstream>
+#include<iostream>
+#include<sstream>
+
+namespace {
+struct DriverOptions {
+    std::string counts;
+    std::string fixed;
+    std::string random;
+    std::string offsets;
+    std::string contrasts;
+    std::string disp = "1";
+    std::string solver = "Fisher";
+    std::string precision = "double";
+    std::string out;
+    std::vector<arma::uword> re_sizes;
+    bool REML = false;
+    bool resid_var = false;
+    bool accelerate = false;
+    bool timings = false;
+    int maxit = 100;
+    double tol = 1e-6;
+    int nprobes = 30;
+    int threads = 1;
+    int fit_threads = 0;
+    int seed = 42;
+};
+
+
+void usage(std::ostream& os){
+    os << "usage: milor_glmm --counts Y --fixed X --random Z --re-sizes q1[,q2,...] [--offsets FILE] "
+       << "[--disp FILE|VALUE] [--solver NAME] [--reml] [--random-intercept] [--maxit N] [--tol X] [--probes N] "
+       << "[--accelerate] [--precision NAME] [--threads N] [--fit-threads N] [--timings] [--contrasts FILE] [--seed N] "
+       << "[--out FILE]"
+       << std::endl;
+}
+
+
+DriverOptions parseArgs(int argc, char** argv){
+    DriverOptions opts;
+
+    for(int i=1; i < argc; i++){
+        const std::string arg(argv[i]);
+
+        // flags
+        if(arg == "--reml"){
+            opts.REML = true;
+            continue;
+        } else if(arg == "--random-intercept"){
+            opts.resid_var = true;
+            continue;
+        } else if(arg == "--accelerate"){
+            opts.accelerate = true;
+            continue;
+        } else if(arg == "--timings"){
+            opts.timings = true;
+            continue;
+        }
+
+        if(i + 1 >= argc){
+            throw std::runtime_error("Missing value for " + arg);
+        }
+        const std::string val(argv[++i]);
+
+        if(arg == "--counts"){
+            opts.counts = val;
+        } else if(arg == "--fixed"){
+            opts.fixed = val;
+        } else if(arg == "--random"){
+            opts.random = val;
+        } else if(arg == "--offsets"){
+            opts.offsets = val;
+        } else if(arg == "--contrasts"){
+            opts.contrasts = val;
+        } else if(arg == "--disp"){
+            opts.disp = val;
+        } else if(arg == "--solver"){
+            opts.solver = val;
+        } else if(arg == "--precision"){
+            opts.precision = val;
+        } else if(arg == "--out"){
+            opts.out = val;
+        } else if(arg == "--re-sizes"){
+            std::stringstream _ss(val);
+            std::string _q;
+            while(std::getline(_ss, _q, ',')){
+                opts.re_sizes.push_back(std::stoul(_q));
+            }
+        } else if(arg == "--maxit"){
+            opts.maxit = std::stoi(val);
+        } else if(arg == "--tol"){
+            opts.tol = std::stod(val);
+        } else if(arg == "--probes"){
+            opts.nprobes = std::stoi(val);
+        } else if(arg == "--threads"){
+            opts.threads = std::stoi(val);
+        } else if(arg == "--fit-threads"){
+            opts.fit_threads = std::stoi(val);
+        } else if(arg == "--seed"){
+            opts.seed = std::stoi(val);
+        } else{
+            throw std::runtime_error("Unrecognised argument " + arg);
+        }
+    }
+
+    if(opts.counts.empty() || opts.fixed.empty() || opts.random.empty() || opts.re_sizes.empty()){
+        throw std::runtime_error("--counts, --fixed, --random and --re-sizes are required");
+    }
+
+    return opts;
+}
+
+
+arma::mat loadMatrix(const std::string& path, const std::string& what){
+    arma::mat A;
+    if(!A.load(path)){
+        throw std::runtime_error("Could not read the " + what + " from " + path);
+    }
+
+    return A;
+}
+
+
+void writeResults(std::ostream& os, const PLGlmmBatchFit& fit, bool timings){
+    const int N = fit.fe.n_rows;
+    const int m = fit.fe.n_cols;
+    const int c = fit.sigma.n_cols;
+    const int k = fit.contrast_est.n_cols;
+
+    os << "nhood\tconverged\titers\taccel.steps\tdispersion\tloglihood";
+    const char* blocks[] = {"FE", "SE", "t", "DF", "PVALS"};
+    for(const char* b : blocks){
+        for(int j=0; j < m; j++){
+            os << '\t' << b << '.' << j + 1;
+        }
+    }
+
+    for(int j=0; j < c; j++){
+        os << "\tSigma." << j + 1;
+    }
+
+    const char* con_blocks[] = {"Contrast", "Contrast.SE", "Contrast.t", "Contrast.DF", "Contrast.PVALS"};
+    for(const char* b : con_blocks){
+        for(int j=0; j < k; j++){
+            os << '\t' << b << '.' << j + 1;
+        }
+    }
+
+    if(timings){
+        for(const std::string& p : GlmmTimer::names()){
+            os << '\t' << p;
+        }
+    }
+    os << "\terror\n";
+
+    os.precision(10);
+    for(int i=0; i < N; i++){
+        // failed nhoods have NA counts
+        const bool _failed = fit.iters[i] == glmmNAInt();
+        os << i + 1 << '\t' << fit.converged[i] << '\t' << (_failed ? "NA" : std::to_string(fit.iters[i])) << '\t'
+           << (_failed ? "NA" : std::to_string(fit.accel_steps[i])) << '\t' << fit.disp[i] << '\t' << fit.loglihood[i];
+
+        const arma::mat* mats[] = {&fit.fe, &fit.se, &fit.t, &fit.df, &fit.pvals};
+        for(const arma::mat* M : mats){
+            for(int j=0; j < m; j++){
+                os << '\t' << (*M)(i, j);
+            }
+        }
+
+        for(int j=0; j < c; j++){
+            os << '\t' << fit.sigma(i, j);
+        }
+
+        const arma::mat* con_mats[] = {&fit.contrast_est, &fit.contrast_se, &fit.contrast_t, &fit.contrast_df, &fit.contrast_pvals};
+        for(const arma::mat* M : con_mats){
+            for(int j=0; j < k; j++){
+                os << '\t' << (*M)(i, j);
+            }
+        }
+
+        if(timings){
+            for(unsigned int j=0; j < fit.timings.n_cols; j++){
+                os << '\t' << fit.timings(i, j);
+            }
+        }
+
+        os << '\t' << (fit.errors[i].empty() ? "NA" : fit.errors[i]) << '\n';
+    }
+}
+}
+
+
+int main(int argc, char** argv){
+    if(argc < 2 || std::string(argv[1]) == "--help"){
+        usage(argc < 2 ? std::cerr : std::cout);
+        return argc < 2 ? 1 : 0;
+    }
+
+    try{
+        const DriverOptions opts = parseArgs(argc, argv);
+        const bool mixed = useMixedPrecision(opts.precision);
+
+        arma::mat Y = loadMatrix(opts.counts, "counts");
+        arma::mat X = loadMatrix(opts.fixed, "fixed effect design matrix");
+        arma::sp_mat Z(loadMatrix(opts.random, "random effect design matrix"));
+        const arma::uword N = Y.n_rows;
+        const arma::uword n = X.n_rows;
+
+        arma::vec offsets(n, arma::fill::zeros);
+        if(!opts.offsets.empty()){
+            offsets = arma::vectorise(loadMatrix(opts.offsets, "offsets"));
+        }
+
+        // a single dispersion value, or a file with 1 per nhood
+        arma::vec disp;
+        std::ifstream _disp_file(opts.disp);
+        if(_disp_file.good()){
+            disp = arma::vectorise(loadMatrix(opts.disp, "dispersions"));
+        } else{
+            disp = arma::vec(N);
+            disp.fill(std::stod(opts.disp));
+        }
+
+        // contiguous, 1-based Z column indices for each random effect
+        std::vector<arma::uvec> u_indices;
+        arma::uword _start = 1;
+        for(arma::uword q : opts.re_sizes){
+            u_indices.push_back(arma::regspace<arma::uvec>(_start, _start + q - 1));
+            _start += q;
+        }
+
+        if(_start - 1 != Z.n_cols){
+            throw std::runtime_error("--re-sizes must sum to the " + std::to_string(Z.n_cols) + " columns of Z");
+        }
+
+        arma::mat contrasts;
+        if(!opts.contrasts.empty()){
+            contrasts = loadMatrix(opts.contrasts, "contrasts");
+        }
+
+        // as .fitGLMMBatch - the initial random effects are uniform on [0, 1]
+        arma::arma_rng::set_seed(opts.seed);
+        arma::mat init_u(Z.n_cols, N, arma::fill::randu);
+
+        auto _t0 = std::chrono::steady_clock::now();
+        PLGlmmBatchFit fit = fitPLGlmmBatchCore(Y, X, Z, offsets, disp, u_indices, init_u, opts.tol, opts.REML,
+                                                opts.maxit, opts.solver, opts.resid_var, opts.threads, opts.nprobes,
+                                                arma::ivec(), opts.accelerate, mixed, opts.timings, opts.fit_threads,
+                                                contrasts);
+        double _elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - _t0).count();
+
+        for(const auto& w : fit.warnings){
+            std::cerr << "Warning: " << w.first << " (" << w.second << " nhoods)" << std::endl;
+        }
+
+        if(opts.out.empty()){
+            writeResults(std::cout, fit, opts.timings);
+        } else{
+            std::ofstream _out(opts.out);
+            if(!_out){
+                throw std::runtime_error("Could not write to " + opts.out);
+            }
+            writeResults(_out, fit, opts.timings);
+        }
+
+        const int n_conv = std::count(fit.converged.begin(), fit.converged.end(), 1);
+        std::cerr << "Fit " << N << " nhood models in " << _elapsed << "s, " << n_conv << " converged" << std::endl;
+    } catch(std::exception& e){
+        std::cerr << "Error: " << e.what() << std::endl;
+        usage(std::cerr);
+        return 1;
+    }
+
+    return 0;
+}
@@ -13,12 +13,12 @@ Rcpp::Rostream<false>& Rcpp::Rcerr = Rcpp::Rcpp_cerr_get();
 #endif
 
 // fitGeneticPLGlmm
-List fitGeneticPLGlmm(const arma::mat& Z, const arma::mat& X, const arma::mat& K, arma::vec muvec, arma::vec offsets, arma::vec curr_beta, arma::vec curr_theta, arma::vec curr_u, arma::vec curr_sigma, arma::mat curr_G, const arma::vec& y, List u_indices, double theta_conv, const List& rlevels, double curr_disp, const bool& REML, const int& maxit, std::string solver, std::string vardist);
-RcppExport SEXP _miloR_fitGeneticPLGlmm(SEXP ZSEXP, SEXP XSEXP, SEXP KSEXP, SEXP muvecSEXP, SEXP offsetsSEXP, SEXP curr_betaSEXP, SEXP curr_thetaSEXP, SEXP curr_uSEXP, SEXP curr_sigmaSEXP, SEXP curr_GSEXP, SEXP ySEXP, SEXP u_indicesSEXP, SEXP theta_convSEXP, SEXP rlevelsSEXP, SEXP curr_dispSEXP, SEXP REMLSEXP, SEXP maxitSEXP, SEXP solverSEXP, SEXP vardistSEXP) {
+List fitGeneticPLGlmm(const arma::sp_mat& Z, const arma::mat& X, const arma::mat& K, arma::vec muvec, arma::vec offsets, arma::vec curr_beta, arma::vec curr_theta, arma::vec curr_u, arma::vec curr_sigma, arma::mat curr_G, const arma::vec& y, List u_indices, double theta_conv, const List& rlevels, double curr_disp, const bool& REML, const int& maxit, std::string solver, std::string vardist, const int& nprobes, const arma::mat& Kvectors, const arma::vec& Kvalues, const bool& accelerate, std::string return_level, std::string precision, const bool& timings, const int& threads, const arma::mat& contrasts, const arma::mat& genotypes, const int& scan_calibrate);
+RcppExport SEXP _miloR_fitGeneticPLGlmm(SEXP ZSEXP, SEXP XSEXP, SEXP KSEXP, SEXP muvecSEXP, SEXP offsetsSEXP, SEXP curr_betaSEXP, SEXP curr_thetaSEXP, SEXP curr_uSEXP, SEXP curr_sigmaSEXP, SEXP curr_GSEXP, SEXP ySEXP, SEXP u_indicesSEXP, SEXP theta_convSEXP, SEXP rlevelsSEXP, SEXP curr_dispSEXP, SEXP REMLSEXP, SEXP maxitSEXP, SEXP solverSEXP, SEXP vardistSEXP, SEXP nprobesSEXP, SEXP KvectorsSEXP, SEXP KvaluesSEXP, SEXP accelerateSEXP, SEXP return_levelSEXP, SEXP precisionSEXP, SEXP timingsSEXP, SEXP threadsSEXP, SEXP contrastsSEXP, SEXP genotypesSEXP, SEXP scan_calibrateSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< const arma::mat& >::type Z(ZSEXP);
+    Rcpp::traits::input_parameter< const arma::sp_mat& >::type Z(ZSEXP);
     Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
     Rcpp::traits::input_parameter< const arma::mat& >::type K(KSEXP);
     Rcpp::traits::input_parameter< arma::vec >::type muvec(muvecSEXP);
@@ -37,17 +37,28 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< const int& >::type maxit(maxitSEXP);
     Rcpp::traits::input_parameter< std::string >::type solver(solverSEXP);
     Rcpp::traits::input_parameter< std::string >::type vardist(vardistSEXP);
-    rcpp_result_gen = Rcpp::wrap(fitGeneticPLGlmm(Z, X, K, muvec, offsets, curr_beta, curr_theta, curr_u, curr_sigma, curr_G, y, u_indices, theta_conv, rlevels, curr_disp, REML, maxit, solver, vardist));
+    Rcpp::traits::input_parameter< const int& >::type nprobes(nprobesSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type Kvectors(KvectorsSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type Kvalues(KvaluesSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type accelerate(accelerateSEXP);
+    Rcpp::traits::input_parameter< std::string >::type return_level(return_levelSEXP);
+    Rcpp::traits::input_parameter< std::string >::type precision(precisionSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type timings(timingsSEXP);
+    Rcpp::traits::input_parameter< const int& >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type contrasts(contrastsSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type genotypes(genotypesSEXP);
+    Rcpp::traits::input_parameter< const int& >::type scan_calibrate(scan_calibrateSEXP);
+    rcpp_result_gen = Rcpp::wrap(fitGeneticPLGlmm(Z, X, K, muvec, offsets, curr_beta, curr_theta, curr_u, curr_sigma, curr_G, y, u_indices, theta_conv, rlevels, curr_disp, REML, maxit, solver, vardist, nprobes, Kvectors, Kvalues, accelerate, return_level, precision, timings, threads, contrasts, genotypes, scan_calibrate));
     return rcpp_result_gen;
 END_RCPP
 }
 // fitPLGlmm
-List fitPLGlmm(const arma::mat& Z, const arma::mat& X, arma::vec muvec, arma::vec offsets, arma::vec curr_beta, arma::vec curr_theta, arma::vec curr_u, arma::vec curr_sigma, arma::mat curr_G, const arma::vec& y, List u_indices, double theta_conv, const List& rlevels, double curr_disp, const bool& REML, const int& maxit, std::string solver, std::string vardist);
-RcppExport SEXP _miloR_fitPLGlmm(SEXP ZSEXP, SEXP XSEXP, SEXP muvecSEXP, SEXP offsetsSEXP, SEXP curr_betaSEXP, SEXP curr_thetaSEXP, SEXP curr_uSEXP, SEXP curr_sigmaSEXP, SEXP curr_GSEXP, SEXP ySEXP, SEXP u_indicesSEXP, SEXP theta_convSEXP, SEXP rlevelsSEXP, SEXP curr_dispSEXP, SEXP REMLSEXP, SEXP maxitSEXP, SEXP solverSEXP, SEXP vardistSEXP) {
+List fitPLGlmm(const arma::sp_mat& Z, const arma::mat& X, arma::vec muvec, arma::vec offsets, arma::vec curr_beta, arma::vec curr_theta, arma::vec curr_u, arma::vec curr_sigma, arma::mat curr_G, const arma::vec& y, List u_indices, double theta_conv, const List& rlevels, double curr_disp, const bool& REML, const int& maxit, std::string solver, std::string vardist, const int& nprobes, const bool& accelerate, std::string return_level, std::string precision, const bool& timings, const int& threads, const arma::mat& contrasts, const arma::mat& genotypes, const int& scan_calibrate);
+RcppExport SEXP _miloR_fitPLGlmm(SEXP ZSEXP, SEXP XSEXP, SEXP muvecSEXP, SEXP offsetsSEXP, SEXP curr_betaSEXP, SEXP curr_thetaSEXP, SEXP curr_uSEXP, SEXP curr_sigmaSEXP, SEXP curr_GSEXP, SEXP ySEXP, SEXP u_indicesSEXP, SEXP theta_convSEXP, SEXP rlevelsSEXP, SEXP curr_dispSEXP, SEXP REMLSEXP, SEXP maxitSEXP, SEXP solverSEXP, SEXP vardistSEXP, SEXP nprobesSEXP, SEXP accelerateSEXP, SEXP return_levelSEXP, SEXP precisionSEXP, SEXP timingsSEXP, SEXP threadsSEXP, SEXP contrastsSEXP, SEXP genotypesSEXP, SEXP scan_calibrateSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< const arma::mat& >::type Z(ZSEXP);
+    Rcpp::traits::input_parameter< const arma::sp_mat& >::type Z(ZSEXP);
     Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
     Rcpp::traits::input_parameter< arma::vec >::type muvec(muvecSEXP);
     Rcpp::traits::input_parameter< arma::vec >::type offsets(offsetsSEXP);
@@ -65,14 +76,99 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< const int& >::type maxit(maxitSEXP);
     Rcpp::traits::input_parameter< std::string >::type solver(solverSEXP);
     Rcpp::traits::input_parameter< std::string >::type vardist(vardistSEXP);
-    rcpp_result_gen = Rcpp::wrap(fitPLGlmm(Z, X, muvec, offsets, curr_beta, curr_theta, curr_u, curr_sigma, curr_G, y, u_indices, theta_conv, rlevels, curr_disp, REML, maxit, solver, vardist));
+    Rcpp::traits::input_parameter< const int& >::type nprobes(nprobesSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type accelerate(accelerateSEXP);
+    Rcpp::traits::input_parameter< std::string >::type return_level(return_levelSEXP);
+    Rcpp::traits::input_parameter< std::string >::type precision(precisionSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type timings(timingsSEXP);
+    Rcpp::traits::input_parameter< const int& >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type contrasts(contrastsSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type genotypes(genotypesSEXP);
+    Rcpp::traits::input_parameter< const int& >::type scan_calibrate(scan_calibrateSEXP);
+    rcpp_result_gen = Rcpp::wrap(fitPLGlmm(Z, X, muvec, offsets, curr_beta, curr_theta, curr_u, curr_sigma, curr_G, y, u_indices, theta_conv, rlevels, curr_disp, REML, maxit, solver, vardist, nprobes, accelerate, return_level, precision, timings, threads, contrasts, genotypes, scan_calibrate));
+    return rcpp_result_gen;
+END_RCPP
+}
+// fitPLGlmmBatch
+List fitPLGlmmBatch(const arma::mat& Y, const arma::mat& X, const arma::sp_mat& Z, const arma::vec& offsets, const arma::vec& disp, List u_indices, const arma::mat& init_u, double theta_conv, const bool& REML, const int& maxit, std::string solver, const bool& resid_var, const int& nthreads, const int& nprobes, const arma::ivec& warm_parent, const bool& accelerate, std::string precision, const bool& timings, const int& fit_threads, const arma::mat& contrasts);
+RcppExport SEXP _miloR_fitPLGlmmBatch(SEXP YSEXP, SEXP XSEXP, SEXP ZSEXP, SEXP offsetsSEXP, SEXP dispSEXP, SEXP u_indicesSEXP, SEXP init_uSEXP, SEXP theta_convSEXP, SEXP REMLSEXP, SEXP maxitSEXP, SEXP solverSEXP, SEXP resid_varSEXP, SEXP nthreadsSEXP, SEXP nprobesSEXP, SEXP warm_parentSEXP, SEXP accelerateSEXP, SEXP precisionSEXP, SEXP timingsSEXP, SEXP fit_threadsSEXP, SEXP contrastsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type Y(YSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
+    Rcpp::traits::input_parameter< const arma::sp_mat& >::type Z(ZSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type offsets(offsetsSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type disp(dispSEXP);
+    Rcpp::traits::input_parameter< List >::type u_indices(u_indicesSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type init_u(init_uSEXP);
+    Rcpp::traits::input_parameter< double >::type theta_conv(theta_convSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type REML(REMLSEXP);
+    Rcpp::traits::input_parameter< const int& >::type maxit(maxitSEXP);
+    Rcpp::traits::input_parameter< std::string >::type solver(solverSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type resid_var(resid_varSEXP);
+    Rcpp::traits::input_parameter< const int& >::type nthreads(nthreadsSEXP);
+    Rcpp::traits::input_parameter< const int& >::type nprobes(nprobesSEXP);
+    Rcpp::traits::input_parameter< const arma::ivec& >::type warm_parent(warm_parentSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type accelerate(accelerateSEXP);
+    Rcpp::traits::input_parameter< std::string >::type precision(precisionSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type timings(timingsSEXP);
+    Rcpp::traits::input_parameter< const int& >::type fit_threads(fit_threadsSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type contrasts(contrastsSEXP);
+    rcpp_result_gen = Rcpp::wrap(fitPLGlmmBatch(Y, X, Z, offsets, disp, u_indices, init_u, theta_conv, REML, maxit, solver, resid_var, nthreads, nprobes, warm_parent, accelerate, precision, timings, fit_threads, contrasts));
+    return rcpp_result_gen;
+END_RCPP
+}
+// resamplePLGlmm
+List resamplePLGlmm(const arma::mat& X, const arma::sp_mat& Z, const arma::vec& y, const arma::vec& offsets, List u_indices, const arma::vec& beta, const arma::vec& u, const arma::vec& sigma, double disp, const int& test_coef, std::string method, const arma::ivec& strata, const int& B, double time_limit, const int& seed, double theta_conv, const bool& REML, const int& maxit, std::string solver, const int& nthreads, const int& nprobes, const bool& accelerate, std::string precision);
+RcppExport SEXP _miloR_resamplePLGlmm(SEXP XSEXP, SEXP ZSEXP, SEXP ySEXP, SEXP offsetsSEXP, SEXP u_indicesSEXP, SEXP betaSEXP, SEXP uSEXP, SEXP sigmaSEXP, SEXP dispSEXP, SEXP test_coefSEXP, SEXP methodSEXP, SEXP strataSEXP, SEXP BSEXP, SEXP time_limitSEXP, SEXP seedSEXP, SEXP theta_convSEXP, SEXP REMLSEXP, SEXP maxitSEXP, SEXP solverSEXP, SEXP nthreadsSEXP, SEXP nprobesSEXP, SEXP accelerateSEXP, SEXP precisionSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
+    Rcpp::traits::input_parameter< const arma::sp_mat& >::type Z(ZSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type y(ySEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type offsets(offsetsSEXP);
+    Rcpp::traits::input_parameter< List >::type u_indices(u_indicesSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type beta(betaSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type u(uSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type sigma(sigmaSEXP);
+    Rcpp::traits::input_parameter< double >::type disp(dispSEXP);
+    Rcpp::traits::input_parameter< const int& >::type test_coef(test_coefSEXP);
+    Rcpp::traits::input_parameter< std::string >::type method(methodSEXP);
+    Rcpp::traits::input_parameter< const arma::ivec& >::type strata(strataSEXP);
+    Rcpp::traits::input_parameter< const int& >::type B(BSEXP);
+    Rcpp::traits::input_parameter< double >::type time_limit(time_limitSEXP);
+    Rcpp::traits::input_parameter< const int& >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< double >::type theta_conv(theta_convSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type REML(REMLSEXP);
+    Rcpp::traits::input_parameter< const int& >::type maxit(maxitSEXP);
+    Rcpp::traits::input_parameter< std::string >::type solver(solverSEXP);
+    Rcpp::traits::input_parameter< const int& >::type nthreads(nthreadsSEXP);
+    Rcpp::traits::input_parameter< const int& >::type nprobes(nprobesSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type accelerate(accelerateSEXP);
+    Rcpp::traits::input_parameter< std::string >::type precision(precisionSEXP);
+    rcpp_result_gen = Rcpp::wrap(resamplePLGlmm(X, Z, y, offsets, u_indices, beta, u, sigma, disp, test_coef, method, strata, B, time_limit, seed, theta_conv, REML, maxit, solver, nthreads, nprobes, accelerate, precision));
+    return rcpp_result_gen;
+END_RCPP
+}
+// mixedPrecisionAvailable
+bool mixedPrecisionAvailable();
+RcppExport SEXP _miloR_mixedPrecisionAvailable() {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    rcpp_result_gen = Rcpp::wrap(mixedPrecisionAvailable());
     return rcpp_result_gen;
 END_RCPP
 }
 
 static const R_CallMethodDef CallEntries[] = {
-    {"_miloR_fitGeneticPLGlmm", (DL_FUNC) &_miloR_fitGeneticPLGlmm, 19},
-    {"_miloR_fitPLGlmm", (DL_FUNC) &_miloR_fitPLGlmm, 18},
+    {"_miloR_fitGeneticPLGlmm", (DL_FUNC) &_miloR_fitGeneticPLGlmm, 30},
+    {"_miloR_fitPLGlmm", (DL_FUNC) &_miloR_fitPLGlmm, 27},
+    {"_miloR_fitPLGlmmBatch", (DL_FUNC) &_miloR_fitPLGlmmBatch, 20},
+    {"_miloR_resamplePLGlmm", (DL_FUNC) &_miloR_resamplePLGlmm, 23},
+    {"_miloR_mixedPrecisionAvailable", (DL_FUNC) &_miloR_mixedPrecisionAvailable, 0},
     {NULL, NULL, 0}
 };
 
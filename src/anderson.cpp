@@ -0,0 +1,63 @@
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+#include "anderson.h"
+
+AndersonAccelerator::AndersonAccelerator(int depth) : depth(depth), accepted(0){
+}
+
+
+bool AndersonAccelerator::extrapolate(const arma::vec& x, const arma::vec& fx, arma::vec& x_acc){
+    arma::vec f = fx - x;
+
+    if(!f_prev.is_empty()){
+        dF.push_back(f - f_prev);
+        dFx.push_back(fx - fx_prev);
+        if(static_cast<int>(dF.size()) > depth){
+            dF.erase(dF.begin());
+            dFx.erase(dFx.begin());
+        }
+    }
+
+    f_prev = f;
+    fx_prev = fx;
+
+    const int k = dF.size();
+    if(k == 0){
+        return false;
+    }
+
+    arma::mat _dF(f.n_elem, k);
+    arma::mat _dFx(f.n_elem, k);
+    for(int i=0; i < k; i++){
+        _dF.col(i) = dF[i];
+        _dFx.col(i) = dFx[i];
+    }
+
+    // gamma minimises || f - dF * gamma ||, which is rank-deficient once the iteration stalls
+    arma::vec gamma;
+    bool _solved = arma::solve(gamma, _dF, f);
+    if(!_solved || !gamma.is_finite()){
+        restart();
+        return false;
+    }
+
+    x_acc = fx - _dFx * gamma;
+    return x_acc.is_finite();
+}
+
+
+void AndersonAccelerator::accept(){
+    accepted++;
+}
+
+
+void AndersonAccelerator::restart(){
+    // the last residual is kept, as the next iterate is the plain update F(x) it was computed from
+    dF.clear();
+    dFx.clear();
+}
+
+
+int AndersonAccelerator::n_accepted() const{
+    return accepted;
+}
@@ -0,0 +1,27 @@
+#ifndef ANDERSON_H
+#define ANDERSON_H
+
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+
+// type-II Anderson mixing for a fixed point iteration x -> F(x), keeping the last `depth` differences of the
+// residuals f = F(x) - x and of the map values F(x). The caller decides whether to accept each extrapolated point
+class AndersonAccelerator {
+public:
+    explicit AndersonAccelerator(int depth);
+    // record one evaluation of the map, and if there is any history return the extrapolated point in x_acc
+    bool extrapolate(const arma::vec& x, const arma::vec& fx, arma::vec& x_acc);
+    void accept();
+    void restart(); // drop the difference history, e.g. after a rejected step
+    int n_accepted() const;
+
+private:
+    int depth;
+    int accepted;
+    arma::vec f_prev;
+    arma::vec fx_prev;
+    std::vector<arma::vec> dF; // differences of successive residuals
+    std::vector<arma::vec> dFx; // differences of successive map values
+};
+
+#endif
@@ -1,357 +1,68 @@
 #include "computeMatrices.h"
-#include<RcppArmadillo.h>
-#include<Rcpp.h>
+#include "milorArma.h"
 #include "utils.h"
 // [[Rcpp::depends(RcppArmadillo)]]
 // [[Rcpp::plugins(openmp)]]
-using namespace Rcpp;
 
-arma::vec computeYStar(arma::mat X, arma::vec curr_beta, arma::mat Z, arma::mat Dinv, arma::vec curr_u, arma::vec y,
-                       arma::vec offsets){
+void computeYStar(const arma::mat& X, const arma::vec& curr_beta, const arma::sp_mat& Z, const arma::vec& Dinv,
+                  const arma::vec& curr_u, const arma::vec& y, const arma::vec& offsets, arma::vec& eta, arma::vec& ystar){
     // compute pseudovariable
-    int n = X.n_rows;
-    arma::vec ystar(n);
-    ystar = (offsets + (X * curr_beta) + (Z * curr_u)) + Dinv * (y - exp(offsets + (X * curr_beta) + (Z * curr_u)));
-    return ystar;
+    // D^-1 is diagonal so we only need the element-wise product with the residuals
+    // eta and ystar are written in place so that the buffers can be re-used across iterations
+    eta = X * curr_beta;
+    eta += Z * curr_u;
+    eta += offsets;
+    ystar = eta + (Dinv % (y - arma::exp(eta)));
 }
 
 
-arma::mat computeVmu(arma::vec mu, double r, std::string vardist){
-    int n = mu.size();
-    arma::mat Vmu(n, n);
-
+void computeVmu(const arma::vec& mu, double r, const std::string& vardist, arma::vec& Vmu){
+    // Vmu is diagonal - only the diagonal elements are stored
     if(vardist == "NB"){
-        Vmu = computeVmuNB(mu, r);
+        computeVmuNB(mu, r, Vmu);
     } else if(vardist == "P"){
-        Vmu = computeVmuPoisson(mu);
+        computeVmuPoisson(mu, Vmu);
     }
-
-    return Vmu;
 }
 
 
-arma::mat computeVmuNB(arma::vec mu, double r){
-    int n = mu.size();
-    arma::mat Vmu(n, n);
-
-    Vmu.diag() = (pow(mu, 2)/r) + mu;
-
-    return Vmu;
+void computeVmuNB(const arma::vec& mu, double r, arma::vec& Vmu){
+    Vmu = (arma::square(mu)/r) + mu;
 }
 
-arma::mat computeVmuPoisson(arma::vec mu){
-    int n = mu.size();
-    arma::mat Vmu(n, n);
-
-    Vmu.diag() = mu;
-
-    return Vmu;
+void computeVmuPoisson(const arma::vec& mu, arma::vec& Vmu){
+    Vmu = mu;
 }
 
-arma::mat computeW(double disp, arma::mat Dinv, std::string vardist){
-    int n = Dinv.n_cols;
-    arma::mat W(n, n);
-
+void computeW(double disp, const arma::vec& Dinv, const std::string& vardist, arma::vec& W){
+    // W is diagonal - only the diagonal elements are stored
     if(vardist == "NB"){
-        W = computeWNB(disp, Dinv);
+        computeWNB(disp, Dinv, W);
     } else if(vardist == "P"){
-        W = computeWPoisson(Dinv);
+        computeWPoisson(Dinv, W);
     }
-
-    return W;
 }
 
 
-arma::mat computeWNB(double disp, arma::mat Dinv){
-    int n = Dinv.n_cols;
-    arma::mat W(n, n);
-
-    // this should be trivial as it is a diagonal matrix
+void computeWNB(double disp, const arma::vec& Dinv, arma::vec& W){
     // D^-1 * V_mu * D^-1 simplifies to a diagonal matrix
-    // of disp + 1/mu_i which is (phi * I) + Dinv <- we don't need any multiplication!!
-    arma::fmat idisp = arma::eye<arma::fmat>(n, n);
-    idisp = (1/disp) * idisp;
-    W = idisp + Dinv;
-    return W;
+    // of 1/disp + 1/mu_i which is (1/phi * I) + Dinv <- we don't need any multiplication!!
+    W = (1/disp) + Dinv;
 }
 
 
-arma::mat computeWPoisson(arma::mat Dinv){
-    int n = Dinv.n_cols;
-    arma::mat W(n, n);
-
-    // this should be trivial as it is a diagonal matrix
+void computeWPoisson(const arma::vec& Dinv, arma::vec& W){
     // in the Poisson case this simplifies to 1/mu
     W = Dinv;
-    return W;
-}
-
-
-arma::mat computeVStar(arma::mat Z, arma::mat G, arma::mat W){
-    int n = Z.n_rows;
-    arma::mat vstar(n, n);
-    // Z.brief_print("Z\n");
-    vstar = (Z * G * Z.t()) + W;
-
-    return vstar;
-}
-
-
-arma::mat computePREML (const arma::mat& Vsinv, const arma::mat& X){
-    int n = Vsinv.n_cols;
-
-    arma::mat P(n, n);
-    arma::mat XtVsinv = X.t() * Vsinv;
-    arma::mat sinternal = XtVsinv * X;
-    arma::mat _sintP = arma::inv(sinternal);
-
-    P = Vsinv - (Vsinv * X * _sintP * XtVsinv); // dense matrix version is faster than sparse here ¯\_(ツ)_/¯
-
-    return P;
 }
 
 
-arma::mat computeBupdate(const arma::mat& Gdiff, const arma::mat& Z, const arma::mat& Wdiff){
-    // compute the update matrix B used for the rank-one updates of the pseudo-covariance
-    // B = Z * G_diff * Z^T + W_diff
-    // G_diff = G_i-1 - G_i
-    // W_diff = W_i-1 - W_i
-
-    return ((Z * Gdiff) * Z.t()) + Wdiff;
-    }
-
-
-arma::mat initialiseG (List u_indices, arma::vec sigmas){
-    // construct the correct size of G given the random effects and variance components
-    // the independent sigmas go on the diagonal and the off-diagonal are the crossed/interactions
-    // this doesn't actually handle the off-diagonal interactions yet
-    int c = u_indices.size();
-    int stot = 0;
-
-    // sum total number of levels
-    for(int i=0; i < c; i++){
-        StringVector _ir = u_indices(i);
-        stot += _ir.size();
-    }
-
-    arma::mat G(stot, stot);
-    G = G.zeros();
-
-    // this only fills the diagonal elements of G
-    unsigned long i = 0;
-    unsigned long j = 0;
-
-    for(unsigned long k=0; k < stot; k++){
-        i = k;
-        j = k;
-        for(int x = 0; x < c; x++){
-            arma::uvec _r = u_indices(x);
-            unsigned long q = _r.size();
-            double _s = sigmas(x);
-
-            for(int l=0; l < q; l++){
-                unsigned long _lu = _r(l);
-
-                if(k == _lu - 1){
-                    G(i, j) = _s;
-                }
-            }
-        }
+void scaledTranspose(const arma::mat& X, const arma::vec& w, arma::mat& XtW){
+    // X^T * diag(w), a row at a time so that no n X m temporary is formed
+    XtW.set_size(X.n_cols, X.n_rows);
+    for(unsigned int j=0; j < X.n_cols; j++){
+        XtW.row(j) = (X.col(j) % w).t();
     }
-
-    return G;
-}
-
-
-arma::mat subMatG (double sigma, arma::mat broadcast){
-    // construct the submatrix for the input variance component
-    int nrow = broadcast.n_rows;
-    int ncol = broadcast.n_cols;
-
-    arma::mat subG(nrow, ncol);
-    subG = sigma * broadcast;
-
-    return subG;
-}
-
-
-
-arma::mat initialiseG_G (List u_indices, arma::vec sigmas, arma::mat Kin){
-    // construct the correct size of G given the random effects and variance components
-    // the independent sigmas go on the diagonal and the off-diagonal are the crossed/interactions
-    // this doesn't actually handle the off-diagonal interactions yet
-    // for the arbitrary covariance case multiply by Kin
-    // is the "genetic" sigma always last?
-    int c = u_indices.size();
-    Rcpp::List Glist(1); // to store the first G
-
-    for(int x = 0; x < c; x++){
-        // create the broadcast matrix
-        arma::uvec _r = u_indices(x); // the vector of indices of Z that map to the RE
-        unsigned long q = _r.size(); // the number of levels for the RE
-        double _s = sigmas(x); // the sigma of the RE
-
-        arma::mat sG(q, q);
-
-        if(x == c - 1){
-            unsigned long n = Kin.n_cols;
-            if(q != n){
-                stop("RE indices and dimensions of covariance do not match");
-            } else{
-                sG = subMatG(_s, Kin);
-                // sG.brief_print("sG\n");
-            }
-        } else{
-            // create the rxr identity matrix
-            arma::mat rEye(q, q, arma::fill::eye);
-            sG = subMatG(_s, rEye);
-        }
-
-        // grow G at each iteration here
-        if(x == 0){
-            Glist(0) = sG;
-        } else{
-            unsigned long sg_cols = sG.n_cols;
-            unsigned long sg_rows = sG.n_rows;
-
-            arma::mat G = Glist(0);
-
-            unsigned long g_cols = G.n_cols;
-            unsigned long g_rows = G.n_rows;
-
-            arma::mat gright(g_rows, sg_cols);
-            arma::mat gleft(sg_rows, g_cols);
-
-            arma::mat top(g_rows, g_cols + sg_cols);
-            arma::mat bottom(sg_rows, sg_cols + g_cols);
-
-            top = arma::join_rows(G, gright);
-            bottom = arma::join_rows(gleft, sG);
-
-            arma::mat _G(sg_rows + g_rows, sg_cols + g_cols);
-            _G = arma::join_cols(top, bottom);
-            Glist(0) = _G;
-        }
-    }
-
-    arma::mat G = Glist(0);
-    return G;
-}
-
-
-arma::mat invGmat_G (List u_indices, arma::vec sigmas, arma::mat Kin){
-    // first construct the correct sized G, i.e. c x c, then broadcast this to all RE levels
-    // make little G inverse
-    int c = u_indices.size();
-    int stot = 0;
-
-    // sum total number of levels
-    for(int i=0; i < c; i++){
-        StringVector _ir = u_indices(i);
-        stot += _ir.size();
-    }
-
-    // arma::uvec _Gindex(c); // G is always square
-    Rcpp::List Glist(1); // to store the first G
-
-    for(int x = 0; x < c; x++){
-        // create the broadcast matrix
-        arma::uvec _r = u_indices(x); // the vector of indices of Z that map to the RE
-        unsigned long q = _r.size(); // the number of levels for the RE
-        double _s = sigmas(x); // the sigma of the RE
-        double _sinv = 1/_s;
-
-        arma::mat sG(q, q);
-
-        if(x == c - 1){
-            unsigned long n = Kin.n_cols;
-            if(q != n){
-                stop("RE indices and dimensions of covariance do not match");
-            } else{
-                sG = subMatG(_sinv, Kin); // this needs to be Kin^-1
-            }
-        } else{
-            // create the rxr identity matrix
-            arma::mat rEye(q, q, arma::fill::eye);
-            sG = subMatG(_sinv, rEye);
-        }
-
-        // grow G at each iteration here
-        if(x == 0){
-            Glist(0) = sG;
-        } else{
-            unsigned long sg_cols = sG.n_cols;
-            unsigned long sg_rows = sG.n_rows;
-
-            arma::mat G = Glist(0);
-
-            unsigned long g_cols = G.n_cols;
-            unsigned long g_rows = G.n_rows;
-
-            arma::mat gright(g_rows, sg_cols);
-            arma::mat gleft(sg_rows, g_cols);
-
-            arma::mat top(g_rows, g_cols + sg_cols);
-            arma::mat bottom(sg_rows, sg_cols + g_cols);
-
-            top = arma::join_rows(G, gright);
-            bottom = arma::join_rows(gleft, sG);
-
-            arma::mat _G(sg_rows + g_rows, sg_cols + g_cols);
-            _G = arma::join_cols(top, bottom);
-            Glist(0) = _G;
-        }
-    }
-
-    arma::mat G = Glist(0);
-    return G;
-}
-
-
-
-arma::mat invGmat (List u_indices, arma::vec sigmas){
-    // first construct the correct sized G, i.e. c x c, then brodcast this to all RE levels
-    // make little G inverse
-    int c = u_indices.size();
-    int stot = 0;
-    arma::vec lsigma(c);
-
-    for(int k = 0; k < c; k++){
-        lsigma(k) = 1/sigmas(k); // doesn't handle 0's
-    }
-
-    // sum total number of levels
-    for(int i=0; i < c; i++){
-        StringVector _ir = u_indices(i);
-        stot += _ir.size();
-    }
-
-    arma::mat G(stot, stot);
-    G = G.zeros();
-
-    // this only fills the diagonal elements of G
-    unsigned long i = 0;
-    unsigned long j = 0;
-
-    for(unsigned long k=0; k < stot; k++){
-        i = k;
-        j = k;
-        for(int x = 0; x < c; x++){
-            arma::uvec _r = u_indices(x);
-            unsigned long q = _r.size();
-            double _s = lsigma(x);
-
-            for(int l=0; l < q; l++){
-                unsigned long _lu = _r(l);
-
-                if(k == _lu - 1){
-                    G(i, j) = _s;
-                }
-            }
-        }
-    }
-
-    return G;
 }
 
 
@@ -438,7 +149,7 @@ arma::mat broadcastInverseMatrix(arma::mat matrix, const unsigned int& n){
     is_singular = _rcond < 1e-9;
 
     if(is_singular){
-        Rcpp::stop("Kinship sub-matrix is singular");
+        throw std::runtime_error("Kinship sub-matrix is singular");
     }
 
     arma::mat Ainv(n, n);
@@ -455,3 +166,47 @@ arma::mat broadcastInverseMatrix(arma::mat matrix, const unsigned int& n){
     return kinverse;
 }
 
+
+
+arma::sp_mat subsetSpCols(const arma::sp_mat& Z, const arma::uvec& cols){
+    // gather the (0-based) columns of a sparse Z into a new CSC matrix
+    // only the stored non-zero elements are touched, so this is O(nnz) rather than O(n * q)
+    unsigned long q = cols.n_elem;
+    unsigned long nnz = 0;
+
+    for(unsigned long j=0; j < q; j++){
+        for(arma::sp_mat::const_iterator it = Z.begin_col(cols(j)); it != Z.end_col(cols(j)); ++it){
+            nnz++;
+        }
+    }
+
+    arma::umat locations(2, nnz);
+    arma::vec values(nnz);
+    unsigned long k = 0;
+
+    for(unsigned long j=0; j < q; j++){
+        for(arma::sp_mat::const_iterator it = Z.begin_col(cols(j)); it != Z.end_col(cols(j)); ++it){
+            locations(0, k) = it.row();
+            locations(1, k) = j;
+            values(k) = (*it);
+            k++;
+        }
+    }
+
+    arma::sp_mat subZ(locations, values, Z.n_rows, q);
+    return subZ;
+}
+
+
+arma::sp_mat scaleSpRows(const arma::sp_mat& Z, const arma::vec& w){
+    // compute diag(w) * Z without forming the n x n diagonal matrix
+    // each stored element is scaled by the weight for its row
+    arma::sp_mat wZ(Z);
+
+    for(arma::sp_mat::iterator it = wZ.begin(); it != wZ.end(); ++it){
+        double _zval = (*it);
+        (*it) = _zval * w(it.row());
+    }
+
+    return wZ;
+}
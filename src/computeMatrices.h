@@ -1,26 +1,22 @@
 #ifndef COMPUTEMATRICES_H
 #define COMPUTEMATRICES_H
 
-#include<RcppArmadillo.h>
+#include "milorArma.h"
 // [[Rcpp::depends(RcppArmadillo)]]
 
-arma::vec computeYStar (arma::mat X, arma::vec curr_beta, arma::mat Z, arma::mat Dinv,
-                        arma::vec curr_u, arma::vec y, arma::vec offsets);
-arma::mat computeVmu (arma::vec mu, double r, std::string vardist);
-arma::mat computeVmuPoisson(arma::vec mu);
-arma::mat computeVmuNB(arma::vec mu, double r);
-arma::mat computeW (double disp, arma::mat Dinv, std::string vardist);
-arma::mat computeWNB(double disp, arma::mat Dinv);
-arma::mat computeWPoisson(arma::mat Dinv);
-arma::mat computeVStar (arma::mat Z, arma::mat G, arma::mat W);
-arma::mat computeBupdate(const arma::mat& Gdiff, const arma::mat& Z, const arma::mat& Wdiff);
-arma::mat computePREML (const arma::mat& Vsinv, const arma::mat& X);
-arma::mat initialiseG (Rcpp::List rlevels, arma::vec sigmas);
-arma::mat initialiseG_G (Rcpp::List u_indices, arma::vec sigmas, arma::mat Kin);
-arma::mat invGmat (Rcpp::List rlevels, arma::vec sigmas);
-arma::mat invGmat_G (Rcpp::List u_indices, arma::vec sigmas, arma::mat Kin);
-arma::mat subMatG (arma::vec u_index, double sigma, arma::mat broadcast);
+// these write into their last argument, such that per-fit buffers (see GlmmWorkspace) are re-used
+void computeYStar(const arma::mat& X, const arma::vec& curr_beta, const arma::sp_mat& Z, const arma::vec& Dinv,
+                  const arma::vec& curr_u, const arma::vec& y, const arma::vec& offsets, arma::vec& eta, arma::vec& ystar);
+void computeVmu(const arma::vec& mu, double r, const std::string& vardist, arma::vec& Vmu);
+void computeVmuPoisson(const arma::vec& mu, arma::vec& Vmu);
+void computeVmuNB(const arma::vec& mu, double r, arma::vec& Vmu);
+void computeW(double disp, const arma::vec& Dinv, const std::string& vardist, arma::vec& W);
+void computeWNB(double disp, const arma::vec& Dinv, arma::vec& W);
+void computeWPoisson(const arma::vec& Dinv, arma::vec& W);
+void scaledTranspose(const arma::mat& X, const arma::vec& w, arma::mat& XtW);
 // arma::mat makePCGFill(const Rcpp::List& u_indices, const arma::mat& Kinv);
 arma::mat broadcastInverseMatrix(arma::mat matrix, const unsigned int& n);
+arma::sp_mat subsetSpCols(const arma::sp_mat& Z, const arma::uvec& cols);
+arma::sp_mat scaleSpRows(const arma::sp_mat& Z, const arma::vec& w);
 
 #endif
@@ -1,13 +1,23 @@
-#include<RcppArmadillo.h>
-#include<string>
+#include "milorArma.h"
 // [[Rcpp::depends(RcppArmadillo)]]
+#include<string>
+#include<memory>
 #include "paramEst.h"
 #include "computeMatrices.h"
 #include "invertPseudoVar.h"
+#include "structuredG.h"
 #include "pseudovarPartial.h"
-#include "multiP.h"
 #include "inference.h"
 #include "utils.h"
+#include "anderson.h"
+#include "mixedPrecision.h"
+#include "glmmTimer.h"
+#include "threadBudget.h"
+#include "glmmWorkspace.h"
+#include "glmmScan.h"
+#include "fitGeneticPLGlmm.h"
+// the Rcpp export is a thin shim that converts to and from R - the standalone build only has fitGeneticPLGlmmCore
+#ifndef MILOR_STANDALONE
 using namespace Rcpp;
 
 
@@ -18,7 +28,7 @@ using namespace Rcpp;
 //' approximation to a Normal loglihood. This function incorporates a user-defined
 //' covariance matrix, e.g. a kinship matrix for genetic analyses.
 //'
-//' @param Z mat - sparse matrix that maps random effect variable levels to
+//' @param Z sp_mat - sparse matrix (dgCMatrix) that maps random effect variable levels to
 //' observations
 //' @param X mat - sparse matrix that maps fixed effect variables to
 //' observations
@@ -41,8 +51,23 @@ using namespace Rcpp;
 //' @param curr_disp double Dispersion parameter estimate
 //' @param REML bool - use REML for variance component estimation
 //' @param maxit int maximum number of iterations if theta_conv is FALSE
-//' @param solver string which solver to use - either HE (Haseman-Elston regression) or Fisher scoring
+//' @param solver string which solver to use - either HE (Haseman-Elston regression), HE-NNLS, Fisher scoring
+//' or Fisher-Hutchinson (Fisher scoring with stochastic trace estimates)
 //' @param vardist string which variance form to use NB = negative binomial, P=Poisson [not yet implemented]/
+//' @param nprobes int number of Rademacher probe vectors used to estimate the traces when \code{solver="Fisher-Hutchinson"}
+//' @param Kvectors mat - eigenvectors of \emph{K}, or an empty matrix. Only for kinship-only models, i.e. \emph{Z} is the
+//' identity matrix
+//' @param Kvalues vec - eigenvalues of \emph{K}, or an empty vector
+//' @param accelerate bool - use Anderson acceleration of the outer pseudo-likelihood iterations
+//' @param return_level string which outputs to return - one of summary, standard or full (see details)
+//' @param precision string - double or mixed (see details)
+//' @param timings bool - return the time spent in each phase of the fit as \code{TIMINGS}
+//' @param threads int number of OpenMP and BLAS threads to use within the fit, or 0 to leave these unchanged. The BLAS
+//' thread count can only be set when R is linked against OpenBLAS or MKL
+//' @param contrasts mat - m X k matrix of fixed effect contrasts, 1 per column, as in \code{fitPLGlmm}
+//' @param genotypes mat - n X v matrix of variants to score against the fitted model as the null, as in \code{fitPLGlmm}
+//' @param scan_calibrate int number of variants from which to estimate the GRAMMAR-gamma variance ratio, or 0 for
+//' the exact score variances
 //'
 //' @details Fit a NB-GLMM to the counts provided in \emph{y}. The model uses an iterative approach that
 //' switches between the joint fixed and random effect parameter inference, and the variance component
@@ -51,7 +76,30 @@ using namespace Rcpp;
 //' Hendersons mixed model equations, and the variance component parameters are then estimated with
 //' the specified solver, i.e. Fisher scoring, Haseman-Elston or constrained Haseman-Elston regression. As
 //' the domain of the variance components is [0, +\code{Inf}], any negative variance component estimates will
-//' trigger the switch to the HE-NNLS solver until the model converges.
+//' trigger the switch to the HE-NNLS solver until the model converges. The Fisher-Hutchinson solver replaces the
+//' exact traces in the score and information with Hutchinson estimates over a fixed set of \emph{nprobes}
+//' Rademacher vectors, which avoids forming the n X n products with the kinship matrix on each iteration.
+//'
+//' When the eigendecomposition of \emph{K} is supplied, e.g. computed once and shared across nhoods, it replaces the
+//' inversion of \emph{K}. With the Fisher-Hutchinson solver the pseudovariance inverse is then applied by
+//' conjugate gradients preconditioned in the eigenbasis of \emph{K}, and the fixed and random effects are updated from
+//' the closed form of Henderson's solutions, so no n X n system is factorised within the iterations.
+//'
+//' With \emph{accelerate} an Anderson extrapolation of the stacked fixed effects, random effects, variance components
+//' and dispersion is proposed after each iteration, and kept only if it improves on the log-likelihood of the plain
+//' update with positive variance components and dispersion, as in \code{fitPLGlmm}.
+//'
+//' \emph{return_level} controls how much of the fit is returned, and hence stored. \emph{summary} only returns the
+//' parameter estimates and their inference, including the Satterthwaite degrees of freedom and p-values; \emph{standard}
+//' adds \code{COEFF}, \code{Ginv}, \code{Winv}, \code{VCOV} and \code{CONVLIST}, but no n X n matrices; and \emph{full}
+//' adds \code{P}, \code{Vpartial} and \code{Vsinv}.
+//'
+//' With \emph{precision="mixed"} the Cholesky factorisations of the mixed model equations and the pseudovariance
+//' component system, the products with the n X n kinship and, for a kinship-only model, the conjugate gradient
+//' iterations in the eigenbasis of K are computed in single precision. Every solve is iteratively refined against
+//' the double precision system. The estimates agree with double precision to a relative tolerance of 1e-5.
+//' This needs miloR to be compiled with \code{-DMILOR_MIXED_PRECISION} against a BLAS/LAPACK with single precision
+//' routines, e.g. OpenBLAS or MKL, as R's reference BLAS only has the double precision routines.
 //'
 //' @return A \code{list} containing the following elements (note: return types are dictated by Rcpp, so the R
 //' types are described here):
@@ -69,16 +117,27 @@ using namespace Rcpp;
 //' \item{\code{t:}}{\code{numeric} vector containing the compute t-score for each fixed effect variable.}
 //' \item{\code{COEFF:}}{\code{matrix} containing the coefficient matrix from the mixed model equations.}
 //' \item{\code{P:}}{\code{matrix} containing the elements of the REML projection matrix.}
-//' \item{\code{Vpartial:}}{\code{list} containing the partial derivatives of the (pseudo)variance matrix with respect to each variance
-//' component.}
+//' \item{\code{Vpartial:}}{\code{list} containing, for each variance component, the n X q left factor P*Z(j)*K of the projected partial
+//' derivative of the (pseudo)variance matrix, P*Z(j)*K*Z(j)^T. Empty with the Fisher-Hutchinson solver.}
 //' \item{\code{Ginv:}}{\code{matrix} of the inverse variance components broadcast to the full Z matrix.}
 //' \item{\code{Vsinv:}}{\code{matrix} of the inverse pseudovariance.}
-//' \item{\code{Winv:}}{\code{matrix} of the inverse elements of W = D^-1 V D^-1}
+//' \item{\code{Winv:}}{\code{numeric} vector of the diagonal elements of the inverse of W = D^-1 V D^-1}
 //' \item{\code{VCOV:}}{\code{matrix} of the variance-covariance for all model fixed and random effect variable parameter estimates.
 //' This is required to compute the degrees of freedom for the fixed effect parameter inference.}
 //' \item{\code{CONVLIST:}}{\code{list} of \code{list} containing the parameter estimates and differences between current and previous
 //' iteration estimates at each model iteration. These are included for each fixed effect, random effect and variance component parameter.
 //' The list elements for each iteration are: \emph{ThetaDiff}, \emph{SigmaDiff}, \emph{beta}, \emph{u}, \emph{sigma}.}
+//' \item{\code{AccelSteps:}}{\code{integer} scalar of the number of accepted Anderson acceleration steps.}
+//' \item{\code{DF:}}{\code{numeric} vector of the Satterthwaite degrees of freedom. The Jacobian of the fixed effect covariance
+//' with respect to the variance components is computed analytically from the final coefficient matrix factorisation.}
+//' \item{\code{PVALS:}}{\code{numeric} vector of the 2-sided t-test p-values using \code{DF}.}
+//' \item{\code{TIMINGS:}}{only if \code{timings=TRUE}, a named \code{numeric} vector of the per-phase seconds and counts,
+//' as for \code{\link{fitPLGlmm}}.}
+//' \item{\code{CONTRASTS:}}{only if \code{contrasts} has at least 1 column, a \code{list} of the contrast estimates,
+//' standard errors, t-scores, Satterthwaite degrees of freedom and p-values, as for \code{\link{fitPLGlmm}}.}
+//' \item{\code{SCAN:}}{only if \code{genotypes} has at least 1 column, a \code{list} of the score test of each
+//' variant against the fitted null model, as for \code{\link{fitPLGlmm}}. With \code{Kvectors} the null
+//' pseudovariance is solved in the eigenbasis of \code{K}, otherwise it is factorised once for all variants.}
 //' }
 //'
 //' @author Mike Morgan
@@ -89,25 +148,109 @@ using namespace Rcpp;
 //' @name fitGeneticPLGlmm
 //'
 // [[Rcpp::export]]
-List fitGeneticPLGlmm(const arma::mat& Z, const arma::mat& X, const arma::mat& K,
+List fitGeneticPLGlmm(const arma::sp_mat& Z, const arma::mat& X, const arma::mat& K,
                       arma::vec muvec, arma::vec offsets, arma::vec curr_beta,
                       arma::vec curr_theta, arma::vec curr_u, arma::vec curr_sigma,
                       arma::mat curr_G, const arma::vec& y, List u_indices,
                       double theta_conv,
                       const List& rlevels, double curr_disp, const bool& REML, const int& maxit,
                       std::string solver,
-                      std::string vardist){
+                      std::string vardist, const int& nprobes,
+                      const arma::mat& Kvectors, const arma::vec& Kvalues, const bool& accelerate,
+                      std::string return_level, std::string precision, const bool& timings, const int& threads,
+                      const arma::mat& contrasts, const arma::mat& genotypes, const int& scan_calibrate){
+
+    if(return_level != "summary" && return_level != "standard" && return_level != "full"){
+        stop("return_level must be one of summary, standard or full");
+    }
+
+    bool mixed;
+    try{
+        mixed = useMixedPrecision(precision);
+    } catch(std::exception& e){
+        stop(e.what());
+    }
+
+    // the previous thread counts are restored when this goes out of scope, including on errors
+    ThreadBudget budget(threads, threads);
+
+    // the fitting itself doesn't touch any R objects, as for fitPLGlmm
+    std::vector<arma::uvec> _u_indices = uvecListFromR(u_indices);
+    PLGlmmFit fit = fitGeneticPLGlmmCore(Z, X, K, muvec, offsets, curr_beta, curr_theta, curr_u, curr_sigma,
+                                         y, _u_indices, theta_conv, curr_disp, REML, maxit,
+                                         solver, vardist, nprobes, Kvectors, Kvalues, accelerate, return_level, mixed,
+                                         timings, contrasts, genotypes, scan_calibrate);
+
+    List outlist = List::create(_["FE"]=fit.beta, _["RE"]=fit.u, _["Sigma"]=fit.sigma,
+                                _["converged"]=fit.converged, _["Iters"]=fit.iters, _["Dispersion"]=fit.disp,
+                                _["Hessian"]=fit.info_sigma, _["SE"]=fit.se, _["t"]=fit.tscores, _["PSVAR"]=fit.psvar,
+                                _["LOGLIHOOD"]=fit.loglihood, _["AccelSteps"]=fit.accel_steps,
+                                _["DF"]=fit.df, _["PVALS"]=computePvalues(fit.tscores, fit.df));
+
+    if(return_level != "summary"){
+        List conv_list(maxit+1);
+        for(unsigned int i=0; i < fit.conv.size(); i++){
+            const PLGlmmIteration& _it = fit.conv[i];
+            conv_list(i) = List::create(_["ThetaDiff"]=_it.theta_diff, _["SigmaDiff"]=_it.sigma_diff, _["beta"]=_it.beta,
+                                        _["u"]=_it.u, _["sigma"]=_it.sigma, _["disp"]=_it.disp, _["PhiDiff"]=_it.disp_diff,
+                                        _["LOGLIHOOD"]=_it.loglihood);
+        }
+
+        outlist.push_back(fit.coeff, "COEFF");
+        outlist.push_back(fit.Ginv, "Ginv");
+        outlist.push_back(fit.Winv, "Winv");
+        outlist.push_back(fit.vcov, "VCOV");
+        outlist.push_back(conv_list, "CONVLIST");
+    }
+
+    if(return_level == "full"){
+        outlist.push_back(fit.P, "P");
+        outlist.push_back(matListToR(fit.vpartial), "Vpartial");
+        outlist.push_back(fit.Vsinv, "Vsinv");
+    }
+
+    if(timings){
+        outlist.push_back(namedVector(fit.timings, GlmmTimer::names()), "TIMINGS");
+    }
+
+    if(contrasts.n_cols > 0){
+        const ContrastTests& _ct = fit.contrasts;
+        outlist.push_back(List::create(_["Estimate"]=_ct.estimate, _["SE"]=_ct.se, _["t"]=_ct.t, _["DF"]=_ct.df,
+                                       _["PVALS"]=computePvalues(_ct.t, _ct.df)), "CONTRASTS");
+    }
+
+    if(genotypes.n_cols > 0){
+        outlist.push_back(scanToR(fit.scan), "SCAN");
+    }
+
+    return outlist;
+}
+#endif
+
+
+PLGlmmFit fitGeneticPLGlmmCore(const arma::sp_mat& Z, const arma::mat& X, const arma::mat& K,
+                               arma::vec muvec, const arma::vec& offsets, arma::vec curr_beta,
+                               arma::vec curr_theta, arma::vec curr_u, arma::vec curr_sigma,
+                               const arma::vec& y, const std::vector<arma::uvec>& _u_indices,
+                               double theta_conv, double curr_disp, bool REML, int maxit,
+                               std::string solver, const std::string& vardist, int nprobes,
+                               const arma::mat& Kvectors, const arma::vec& Kvalues, bool accelerate,
+                               const std::string& return_level, bool mixed, bool timings,
+                               const arma::mat& contrasts, const arma::mat& genotypes, int scan_calibrate){
+    // this must not call into R - errors are thrown as std::runtime_error and warnings go through glmmWarning
+    const bool keep_conv = return_level != "summary";
+    const bool keep_full = return_level == "full";
+    GlmmTimer timer(timings);
 
     // no guarantee that Pi exists before C++ 20(?!?!?!)
     constexpr double pi = 3.14159265358979323846;
 
     // declare all variables
-    List outlist(14);
     int iters=0;
     int stot = Z.n_cols;
-    const int& c = curr_sigma.size();
-    const int& m = X.n_cols;
-    const int& n = X.n_rows;
+    const int c = curr_sigma.size();
+    const int m = X.n_cols;
+    const int n = X.n_rows;
     bool meet_cond = false;
     double constval = 1e-8; // value at which to constrain values
     double _intercept = constval; // intercept for HE regression
@@ -116,30 +259,26 @@ List fitGeneticPLGlmm(const arma::mat& Z, const arma::mat& X, const arma::mat& K
     double update_disp = 0.0;
     double disp_diff = 0.0;
 
-    // setup matrices
-    arma::mat D(n, n);
-    D.zeros();
-    arma::mat Dinv(n, n);
-    Dinv.zeros();
-
-    arma::vec y_star(n);
-
-    arma::mat Vmu(n, n);
-    arma::mat W(n, n);
-    arma::mat Winv(n, n);
-
-    arma::mat V_star(n, n);
-    arma::mat V_star_inv(n, n);
-    arma::mat P(n, n);
-
-    arma::mat coeff_mat(m+c, m+c);
-    List V_partial(c);
-    V_partial = pseudovarPartial_G(Z, K, u_indices);
-    // compute outside the loop
-    List VP_partial(c);
-    List precomp_list(2);
-    List pzzp_list(c); // P * Z(j) * Z(j)^T * P^T
-    List VS_partial(c);
+    // setup matrices - the per-iteration buffers are sized once and written in place, see GlmmWorkspace
+    GlmmWorkspace ws;
+    ws.prepare(X, Z, _u_indices);
+
+    // D, Vmu and W are all diagonal so we only store the diagonal elements
+    arma::vec& Dinv = ws.Dinv;
+    arma::vec& y_star = ws.y_star;
+    arma::vec& Vmu = ws.Vmu;
+    arma::vec& W = ws.W;
+    arma::vec& Winv = ws.Winv;
+    arma::mat& xTwinv = ws.xTwinv;
+
+    arma::mat& coeff_mat = ws.coeff_mat;
+    SymmetricFactor coeff_factor; // factorised once per iteration, re-used for the SEs
+    SymmetricFactor vstar_factor; // the last factor of G^-1 + Z^T W^-1 Z
+    std::vector<arma::mat>& precomp_list = ws.precomp_list;
+    arma::mat& PZ = ws.PZ;
+    arma::mat& VstarZ = ws.VstarZ;
+    arma::mat& ZtPZ = ws.ZtPZ; // the kinship columns are right multiplied by K
+    arma::mat& ZtVZ = ws.ZtVZ;
 
     arma::vec score_sigma(c);
     arma::mat information_sigma(c, c);
@@ -148,20 +287,19 @@ List fitGeneticPLGlmm(const arma::mat& Z, const arma::mat& X, const arma::mat& K
     arma::vec sigma_diff(sigma_update.size());
     sigma_diff.zeros();
 
-    arma::mat G_inv(stot, stot);
-    arma::mat Zstar(n, stot);
-    arma::mat Gfill(stot, stot);
+    // the same probes are used for every component and iteration so the Fisher updates don't jitter
+    arma::mat probes;
+    if(solver == "Fisher-Hutchinson"){
+        probes = rademacherProbes(n, nprobes, 42);
+    }
 
     arma::vec theta_update(m+stot);
     arma::vec theta_diff(theta_update.size());
     theta_diff.zeros();
 
-    List conv_list(maxit+1);
-
-    // create a uvec of sigma indices
-    arma::uvec _sigma_index(c);
-    for(int i=0; i < c; i++){
-        _sigma_index[i] = i+1;
+    std::vector<PLGlmmIteration> conv_list;
+    if(keep_conv){
+        conv_list.reserve(maxit+1);
     }
 
     // setup vectors to index the theta updates
@@ -176,91 +314,144 @@ List fitGeneticPLGlmm(const arma::mat& Z, const arma::mat& X, const arma::mat& K
         u_ix[px] = m + px;
     }
 
+    // a cached eigendecomposition of K only applies when the kinship is the sole random effect
+    const bool spectral = !Kvectors.is_empty();
+    if(spectral && (c != 1 || stot != n || Kvalues.n_elem != K.n_cols)){
+        throw std::runtime_error("Kinship eigendecomposition can only be used for a kinship-only model");
+    }
+
     // we only need to invert the Kinship once
     unsigned long _kn = K.n_cols;
     arma::mat Kinv(_kn, _kn);
 
-    // check this isn't singular first - it could be due to a block structure
-    double _rcond = arma::rcond(K);
-    bool is_singular;
-    is_singular = _rcond < 1e-9;
-
-    // check for singular condition
-    if(is_singular){
-        // first try to invert the top block which should be N/2 x N/2
-        Rcpp::warning("Kinship is singular - attempting broad cast inverse");
-        double nhalfloat = (double)n/2;
-        unsigned int nhalf = nhalfloat;
-        Kinv = broadcastInverseMatrix(K, nhalf);
+    if(spectral){
+        // the pseudoinverse from the shared eigendecomposition, rather than a fresh inversion per nhood
+        Kinv = spectralInverse(Kvectors, Kvalues);
     } else{
-        Kinv = arma::inv(K); // this could be very slow
+        // check this isn't singular first - it could be due to a block structure
+        double _rcond = arma::rcond(K);
+        bool is_singular;
+        is_singular = _rcond < 1e-9;
+
+        // check for singular condition
+        if(is_singular){
+            // first try to invert the top block which should be N/2 x N/2
+            glmmWarning("Kinship is singular - attempting broad cast inverse");
+            double nhalfloat = (double)n/2;
+            unsigned int nhalf = nhalfloat;
+            Kinv = broadcastInverseMatrix(K, nhalf);
+        } else{
+            Kinv = arma::inv(K); // this could be very slow
+        }
+    }
+
+    // G is only held as its per-level variances and a reference to the kinship
+    StructuredG G(_u_indices, curr_sigma, K, Kinv);
+
+    // single precision copies of the n X n kinship products for the mixed precision mode
+    arma::fmat Kf;
+    arma::fmat Kvectors_f;
+    if(mixed){
+        Kf = toSingle(K);
+        if(spectral){
+            Kvectors_f = toSingle(Kvectors);
+        }
     }
+    const arma::fmat* _kvectors_single = mixed && spectral ? &Kvectors_f : nullptr;
 
     bool converged = false;
-    bool _phi_est = true; // control if we re-estimate phi or not
+    // the y-only term of the NB log-likelihood is fixed for the whole fit
+    const double lgamma_y1 = arma::accu(arma::lgamma(y + 1));
 
     // initial optimisation of dispersion
-    // switch this to a golden-section search?
-    update_disp = phiGoldenSearch(curr_disp, delta_lo, delta_up, c,
-                                  muvec, G_inv, pi,
-                                  curr_u, curr_sigma, y);
-    disp_diff = abs(curr_disp - update_disp);
+    // safeguarded Newton steps on the NB score within [delta_lo, delta_up]
+    timer.start(GlmmTimer::DISPERSION);
+    update_disp = phiNewton(curr_disp, delta_lo, delta_up, muvec, y);
+    timer.stop(GlmmTimer::DISPERSION);
+    disp_diff = std::abs(curr_disp - update_disp);
     // curr_disp = update_disp;
     // make the upper and lower bounds based on the current value,
     // but 0 < lo < up < 1.0
     delta_lo = std::max(1e-2, update_disp - (update_disp*0.5));
     delta_up = std::max(1e-2, update_disp);
 
+    StructuredG vstar_G(G); // the G that V*^-1 was last computed with
+    bool spectral_mme = false; // whether the last theta update skipped the coefficient matrix
+    AndersonAccelerator anderson(5);
+
     while(!meet_cond){
         curr_disp = update_disp;
-        D.diag() = muvec; // data space
-        Dinv = D.i();
-        y_star = computeYStar(X, curr_beta, Z, Dinv, curr_u, y, offsets); // data space
-
-        Vmu = computeVmu(muvec, curr_disp, vardist);
-        W = computeW(curr_disp, Dinv, vardist);
-        Winv = W.i();
-        // pre-compute matrics: X^T * W^-1, Z^T * W^-1
-        arma::mat xTwinv = X.t() * Winv;
-        arma::mat zTwin = Z.t() * Winv;
-
-        V_star = computeVStar(Z, curr_G, W); // K is implicitly included in curr_G
-        V_star_inv = invertPseudoVar(Winv, curr_G, Z, zTwin);
-
-        if(REML){
-            P = computePREML(V_star_inv, X);
-            // take the partial derivative outside the while loop, just keep the P*\dVar\dSigma
+        // the stacked (beta, u, sigma, phi) that this iteration maps from
+        arma::vec _x_start;
+        if(accelerate){
+            _x_start = arma::join_cols(curr_theta, curr_sigma, arma::vec({curr_disp}));
+        }
+        timer.start(GlmmTimer::WD);
+        Dinv = 1/muvec; // data space - D is diagonal
+        computeYStar(X, curr_beta, Z, Dinv, curr_u, y, offsets, ws.eta, y_star); // data space
+
+        computeVmu(muvec, curr_disp, vardist, Vmu);
+        computeW(curr_disp, Dinv, vardist, W);
+        Winv = 1/W;
+        // pre-compute matrics: X^T * W^-1, Z^T * W^-1 - W^-1 is diagonal so these are column scalings
+        scaledTranspose(X, Winv, xTwinv);
+        arma::sp_mat zTwin = scaleSpRows(Z, Winv).t(); // stays sparse
+        timer.stop(GlmmTimer::WD);
+
+        // V*^-1 and P are only applied to thin matrices - neither is formed in full
+        // the stochastic traces only need V*^-1 applied to the probes, so CG in the eigenbasis of K avoids any factorisation
+        vstar_G = G; // K is implicitly included in G
+        const bool use_spectral = spectral && solver == "Fisher-Hutchinson";
+        std::unique_ptr<VstarInverse> _vsinv;
+        VstarInvOperator* _woodbury = nullptr;
+        timer.start(GlmmTimer::VSTARINV);
+        if(use_spectral){
+            _vsinv.reset(new SpectralVstarInvOperator(Winv, curr_sigma[0], Kvectors, Kvalues, _kvectors_single));
         } else{
-            P = arma::eye(n, n);
-        };
-
-        // pre-compute matrics: P*Z
-        arma::mat PZ = P * Z;
-
-        // pre-compute P*Z(j) * Z(j)^T
-        precomp_list = computePZList_G(u_indices, PZ, P, Z, solver, K);
+            // the last iteration's factors are re-used where sigma and W have changed little
+            _woodbury = new VstarInvOperator(Winv, G, Z, zTwin, mixed, &vstar_factor);
+            _vsinv.reset(_woodbury);
+        }
+        timer.stop(GlmmTimer::VSTARINV);
+        const VstarInverse& V_star_inv = *_vsinv;
+        timer.start(GlmmTimer::PREML);
+        POperator P(V_star_inv, X, REML);
+        timer.stop(GlmmTimer::PREML);
+
+        // pre-compute matrics: P*Z and the single Z^T*P*Z(j)*K product of the iteration - the stochastic traces
+        // don't need these
+        bool have_pz = false;
+        timer.start(GlmmTimer::PZLIST);
+        if(solver != "Fisher-Hutchinson"){
+            P.applyTo(ws.Zdense, PZ);
+            ZtPZ = Z.t() * PZ;
+            kinshipBlock(_u_indices[c-1], K, Kf, ZtPZ);
+            have_pz = true;
+        }
+        timer.stop(GlmmTimer::PZLIST);
 
         // choose between HE regression and Fisher scoring for variance components
         // sigma_update is always 1 element longer than the others with HE, but we need to keep track of this
+        timer.start(GlmmTimer::SIGMA);
         if(solver == "HE"){
             // try Haseman-Elston regression instead of Fisher scoring
-            sigma_update = estHasemanElstonGenetic(Z, P, PZ, u_indices, y_star, K);
+            sigma_update = estHasemanElstonGenetic(PZ, _u_indices, P.apply(y_star), K);
         } else if (solver == "HE-NNLS"){
             // for the first iteration use the current non-zero estimate
             arma::dvec _curr_sigma(c+1, arma::fill::zeros);
 
             if(REML){
-                _sigma_update = estHasemanElstonConstrainedGenetic(Z, P, PZ, u_indices, y_star, K, _curr_sigma, iters);
+                _sigma_update = estHasemanElstonConstrainedGenetic(PZ, _u_indices, P.apply(y_star), K, _curr_sigma, iters);
                 _intercept = _sigma_update[0];
                 sigma_update = _sigma_update.tail(c);
             } else{
-                _sigma_update = estHasemanElstonConstrainedGeneticML(Z, u_indices, y_star, K, _curr_sigma, iters);
+                _sigma_update = estHasemanElstonConstrainedGeneticML(Z, _u_indices, y_star, K, _curr_sigma, iters);
                 _intercept = _sigma_update[0];
                 sigma_update = _sigma_update.tail(c);
             }
 
             // set 0 values to minval to prevent 0 denominators later
-            if(any(sigma_update == 0.0)){
+            if(arma::any(sigma_update == 0.0)){
                 for(int i=0; i<c; i++){
                     if(sigma_update[i] <= 0.0){
                         sigma_update[i] = constval;
@@ -269,42 +460,73 @@ List fitGeneticPLGlmm(const arma::mat& Z, const arma::mat& X, const arma::mat& K
             }
 
         }else if(solver == "Fisher"){
+            // the quadratic forms pair Z^T V*^-1 r with the left factors of the partials applied to r, where the
+            // kinship component is right multiplied by K
+            arma::vec resid = y_star - X * curr_beta;
+            arma::vec ZtVsy = Z.t() * V_star_inv.apply(resid);
+            const arma::uvec _k_idx = _u_indices[c-1] - 1;
+
             if(REML){
-                arma::mat VstarZ = V_star_inv * Z;
-                VP_partial = precomp_list["PZZt"];
-                VS_partial = pseudovarPartial_VG(u_indices, Z,  VstarZ, K);
-
-                score_sigma = sigmaScoreREML_arma(VP_partial, y_star, P,
-                                                  curr_beta, X, V_star_inv,
-                                                  VP_partial);
-                information_sigma = sigmaInfoREML_arma(VP_partial, P);
+                arma::vec Btr = PZ.t() * resid;
+                Btr.elem(_k_idx) = K * Btr.elem(_k_idx);
+                score_sigma = sigmaScoreREML_arma(ZtPZ, Btr, ZtVsy, _u_indices);
+                information_sigma = sigmaInfoREML_arma(ZtPZ, _u_indices);
             } else{
-                List VP_partial = V_partial;
-                score_sigma = sigmaScore(y_star, curr_beta, X, VP_partial, V_star_inv);
-                information_sigma = sigmaInformation(V_star_inv, VP_partial);
+                V_star_inv.applyTo(ws.Zdense, VstarZ);
+                ZtVZ = Z.t() * VstarZ;
+                kinshipBlock(_u_indices[c-1], K, Kf, ZtVZ);
+                arma::vec Btr(ZtVsy);
+                Btr.elem(_k_idx) = K * Btr.elem(_k_idx);
+                score_sigma = sigmaScore(ZtVZ, Btr, ZtVsy, _u_indices);
+                information_sigma = sigmaInformation(ZtVZ, _u_indices);
             }
             sigma_update = fisherScore(information_sigma, score_sigma, curr_sigma);
+        } else if(solver == "Fisher-Hutchinson"){
+            // V*^-1 and P are only applied to the n X k probes - ML uses V*^-1 in place of P
+            arma::mat PW = REML ? P.apply(probes) : V_star_inv.apply(probes);
+            std::vector<arma::mat> dV_W = pseudovarPartialApply_G(Z, _u_indices, probes, K);
+            std::vector<arma::mat> PdV_W(c);
+            for(int i=0; i < c; i++){
+                PdV_W[i] = REML ? P.apply(dV_W[i]) : V_star_inv.apply(dV_W[i]);
+            }
+            std::vector<arma::mat> dVP_W = pseudovarPartialApply_G(Z, _u_indices, PW, K);
+
+            arma::vec Vsy = V_star_inv.apply(y_star - X * curr_beta);
+            std::vector<arma::mat> dV_Vsy = pseudovarPartialApply_G(Z, _u_indices, Vsy, K);
+
+            score_sigma = sigmaScoreHutchinson(probes, PdV_W, Vsy, dV_Vsy);
+            information_sigma = sigmaInfoHutchinson(PdV_W, dVP_W);
+            sigma_update = fisherScore(information_sigma, score_sigma, curr_sigma);
         }
 
         // if we have negative sigmas then we need to switch solver
-        if(any(sigma_update < 0.0)){
-            warning("Negative variance components - re-running with NNLS");
+        if(arma::any(sigma_update < 0.0)){
+            glmmWarning("Negative variance components - re-running with NNLS");
+            if(solver != "HE-NNLS"){
+                timer.count(GlmmTimer::SOLVER_SWITCHES);
+            }
             solver = "HE-NNLS";
             // for the first iteration use the current non-zero estimate
             arma::dvec _curr_sigma(c+1, arma::fill::zeros);
 
+            if(!have_pz){
+                P.applyTo(ws.Zdense, PZ);
+                ZtPZ = Z.t() * PZ;
+                kinshipBlock(_u_indices[c-1], K, Kf, ZtPZ);
+            }
+
             if(REML){
-                _sigma_update = estHasemanElstonConstrainedGenetic(Z, P, PZ, u_indices, y_star, K, _curr_sigma, iters);
+                _sigma_update = estHasemanElstonConstrainedGenetic(PZ, _u_indices, P.apply(y_star), K, _curr_sigma, iters);
                 _intercept = _sigma_update[0];
                 sigma_update = _sigma_update.tail(c);
             } else{
-                _sigma_update = estHasemanElstonConstrainedGeneticML(Z, u_indices, y_star, K, _curr_sigma, iters);
+                _sigma_update = estHasemanElstonConstrainedGeneticML(Z, _u_indices, y_star, K, _curr_sigma, iters);
                 _intercept = _sigma_update[0];
                 sigma_update = _sigma_update.tail(c);
             }
 
             // set 0 values to minval to prevent 0 denominators later
-            if(any(sigma_update == 0.0)){
+            if(arma::any(sigma_update == 0.0)){
                 for(int i=0; i<c; i++){
                     if(sigma_update[i] <= 0.0){
                         sigma_update[i] = constval;
@@ -312,22 +534,28 @@ List fitGeneticPLGlmm(const arma::mat& Z, const arma::mat& X, const arma::mat& K
                 }
             }
         }
+        timer.stop(GlmmTimer::SIGMA);
 
-        sigma_diff = abs(sigma_update - curr_sigma); // needs to be an unsigned real value
+        // kept after the solves of this iteration, which may have replaced a re-used factor with a fresh one
+        if(_woodbury != nullptr){
+            vstar_factor = _woodbury->factor();
+            timer.countFactor(vstar_factor);
+        }
 
-        // update sigma, G, and G_inv
+        sigma_diff = arma::abs(sigma_update - curr_sigma); // needs to be an unsigned real value
+
+        // update sigma and G
         curr_sigma = sigma_update;
-        curr_G = initialiseG_G(u_indices, curr_sigma, K);
-        G_inv = invGmat_G(u_indices, curr_sigma, Kinv);
+        G = StructuredG(_u_indices, curr_sigma, K, Kinv);
 
         // Update the dispersion with the new variances
         // only update if diff is > 1e-2
         if(disp_diff > 1e-2){
-            update_disp = phiGoldenSearch(curr_disp, delta_lo, delta_up, c,
-                                          muvec, G_inv, pi,
-                                          curr_u, curr_sigma, y);
+            timer.start(GlmmTimer::DISPERSION);
+            update_disp = phiNewton(curr_disp, delta_lo, delta_up, muvec, y);
+            timer.stop(GlmmTimer::DISPERSION);
 
-            disp_diff = abs(curr_disp - update_disp);
+            disp_diff = std::abs(curr_disp - update_disp);
             // curr_disp = update_disp;
             // make the upper and lower bounds based on the current value,
             // but 0 < lo < up < ??
@@ -335,54 +563,71 @@ List fitGeneticPLGlmm(const arma::mat& Z, const arma::mat& X, const arma::mat& K
             delta_up = std::max(1e-2, update_disp);
         }
 
-        // update_disp = phiMME(y_star, curr_sigma);
-        disp_diff = abs(curr_disp - update_disp);
+        disp_diff = std::abs(curr_disp - update_disp);
 
         // Next, solve pseudo-likelihood GLMM equations to compute solutions for beta and u
         // compute the coefficient matrix
-        coeff_mat = coeffMatrix(X, xTwinv, zTwin, Z, G_inv); //model space
-        theta_update = solveEquations(stot, m, zTwin, xTwinv, coeff_mat, curr_beta, curr_u, y_star); //model space
-
-        LogicalVector _check_theta = check_na_arma_numeric(theta_update);
-        bool _any_ystar_na = any(_check_theta).is_true(); // .is_true required for proper type casting to bool
-
-        if(_any_ystar_na){
-            List this_conv(5);
-            this_conv = List::create(_["ThetaDiff"]=theta_diff, _["SigmaDiff"]=sigma_diff, _["beta"]=curr_beta,
-                                     _["u"]=curr_u, _["sigma"]=curr_sigma);
-            conv_list(iters-1) = this_conv;
-            warning("NaN in theta update");
+        spectral_mme = use_spectral;
+        timer.start(GlmmTimer::MME);
+        if(spectral_mme){
+            // Henderson's solutions without the (m + n) X (m + n) coefficient matrix:
+            // beta = (X^T V*^-1 X)^-1 X^T V*^-1 y*, u = G Z^T V*^-1 (y* - X beta), with V* for the updated sigma
+            SpectralVstarInvOperator _vsinv_up(Winv, curr_sigma[0], Kvectors, Kvalues, _kvectors_single);
+            arma::mat _vinv_xy = _vsinv_up.apply(arma::mat(arma::join_rows(X, y_star)));
+            arma::mat VinvX = _vinv_xy.head_cols(m);
+            arma::vec Vinvy = _vinv_xy.col(m);
+            arma::vec _beta_up = arma::solve(X.t() * VinvX, X.t() * Vinvy);
+            arma::vec _u_up = G.apply(arma::mat(Z.t() * (Vinvy - VinvX * _beta_up)));
+            theta_update = arma::join_cols(_beta_up, _u_up);
+        } else{
+            coeffMatrix(X, xTwinv, zTwin, Z, G, coeff_mat); //model space
+            coeff_factor = SymmetricFactor(coeff_mat, coeff_factor, factor_reuse_tol, mixed);
+            theta_update = solveEquations(stot, m, zTwin, xTwinv, coeff_factor, curr_beta, curr_u, y_star); //model space
+            timer.countFactor(coeff_factor);
+        }
+        timer.stop(GlmmTimer::MME);
+
+        if(theta_update.has_nan()){
+            // the last complete estimates are returned as they are
+            if(keep_conv){
+                PLGlmmIteration this_conv;
+                this_conv.theta_diff = theta_diff;
+                this_conv.sigma_diff = sigma_diff;
+                this_conv.beta = curr_beta;
+                this_conv.u = curr_u;
+                this_conv.sigma = curr_sigma;
+                this_conv.disp = curr_disp;
+                this_conv.disp_diff = disp_diff;
+                this_conv.loglihood = glmmNAReal();
+                conv_list.push_back(this_conv);
+            }
+            glmmWarning("NaN in theta update");
             break;
         }
 
-        theta_diff = abs(theta_update - curr_theta);
+        theta_diff = arma::abs(theta_update - curr_theta);
 
         curr_theta = theta_update; //model space
         curr_beta = curr_theta.elem(beta_ix); //model space
         curr_u = curr_theta.elem(u_ix); //model space
 
-        muvec = exp(offsets + (X * curr_beta) + (Z * curr_u)); // data space
-        LogicalVector _check_mu = check_na_arma_numeric(muvec);
-        bool _any_na = any(_check_mu).is_true(); // .is_true required for proper type casting to bool
+        muvec = arma::exp(offsets + (X * curr_beta) + (Z * curr_u)); // data space
 
-        LogicalVector _check_inf = check_inf_arma_numeric(muvec);
-        bool _any_inf = any(_check_inf).is_true();
-
-        if(_any_na){
-            stop("NA estimates in linear predictor - consider an alternative model");
+        if(muvec.has_nan()){
+            throw std::runtime_error("NA estimates in linear predictor - consider an alternative model");
         }
 
-        if(_any_inf){
-            stop("Infinite parameter estimates - consider an alternative model");
+        if(!muvec.is_finite()){
+            throw std::runtime_error("Infinite parameter estimates - consider an alternative model");
         }
 
         iters++;
 
         bool _thconv = false;
-        _thconv = all(theta_diff < theta_conv);
+        _thconv = arma::all(theta_diff < theta_conv);
 
         bool _siconv = false;
-        _siconv = all(sigma_diff < theta_conv);
+        _siconv = arma::all(sigma_diff < theta_conv);
 
         bool _ithit = false;
         _ithit = iters > maxit;
@@ -390,53 +635,138 @@ List fitGeneticPLGlmm(const arma::mat& Z, const arma::mat& X, const arma::mat& K
         meet_cond = ((_thconv && _siconv) || _ithit);
         converged = _thconv && _siconv;
 
-        // compute final loglihood
-        // make non-broadcast G matrix
-        arma::mat littleG(c, c, arma::fill::zeros);
+        if(accelerate && !meet_cond){
+            // Anderson mixing over the stacked parameters - the extrapolated point is only kept if the variances
+            // and dispersion stay positive and the PL log-likelihood is no worse than after the plain update
+            arma::vec _x_plain = arma::join_cols(curr_theta, curr_sigma, arma::vec({update_disp}));
+            arma::vec _x_acc;
+            if(anderson.extrapolate(_x_start, _x_plain, _x_acc)){
+                arma::vec _beta_acc = _x_acc.head(m);
+                arma::vec _u_acc = _x_acc.subvec(m, m + stot - 1);
+                arma::vec _sigma_acc = _x_acc.subvec(m + stot, m + stot + c - 1);
+                double _disp_acc = _x_acc[m + stot + c];
+                bool _accept = arma::all(_sigma_acc > 0.0) && _disp_acc > 0.0;
+
+                if(_accept){
+                    StructuredG _G_acc(_u_indices, _sigma_acc, K, Kinv);
+                    arma::vec _mu_acc = arma::exp(offsets + (X * _beta_acc) + (Z * _u_acc));
+                    double _ll_acc = nbLogLik(_mu_acc, _disp_acc, y, lgamma_y1) - normLogLik(c, _G_acc, _sigma_acc, _u_acc, pi);
+                    double _ll_plain = nbLogLik(muvec, update_disp, y, lgamma_y1) - normLogLik(c, G, curr_sigma, curr_u, pi);
+                    _accept = _mu_acc.is_finite() && std::isfinite(_ll_acc) && _ll_acc >= _ll_plain;
+
+                    if(_accept){
+                        curr_theta = _x_acc.head(m + stot);
+                        curr_beta = _beta_acc;
+                        curr_u = _u_acc;
+                        curr_sigma = _sigma_acc;
+                        G = _G_acc;
+                        muvec = _mu_acc;
+                        update_disp = _disp_acc;
+                        delta_lo = std::max(1e-2, update_disp - (update_disp*0.5));
+                        delta_up = std::max(1e-2, update_disp);
+                        anderson.accept();
+                    }
+                }
 
-        for(int i=0; i<c; i++){
-            littleG(i, i) = curr_sigma(i);
+                if(!_accept){
+                    anderson.restart();
+                }
+            }
         }
-        double loglihood = nbLogLik(muvec, curr_disp, y) - normLogLik(c, G_inv, littleG, curr_u, pi);
 
-        List this_conv(8);
-        this_conv = List::create(_["ThetaDiff"]=theta_diff, _["SigmaDiff"]=sigma_diff, _["beta"]=curr_beta,
-                                 _["u"]=curr_u, _["sigma"]=curr_sigma, _["disp"]=curr_disp, _["PhiDiff"]=disp_diff,
-                                 _["LOGLIHOOD"]=loglihood);
-        conv_list(iters-1) = this_conv;
+        if(keep_conv){
+            timer.start(GlmmTimer::LOGLIHOOD);
+            double loglihood = nbLogLik(muvec, curr_disp, y, lgamma_y1) - normLogLik(c, G, curr_sigma, curr_u, pi);
+            timer.stop(GlmmTimer::LOGLIHOOD);
+
+            PLGlmmIteration this_conv;
+            this_conv.theta_diff = theta_diff;
+            this_conv.sigma_diff = sigma_diff;
+            this_conv.beta = curr_beta;
+            this_conv.u = curr_u;
+            this_conv.sigma = curr_sigma;
+            this_conv.disp = curr_disp;
+            this_conv.disp_diff = disp_diff;
+            this_conv.loglihood = loglihood;
+            conv_list.push_back(this_conv);
+        }
     }
 
     // inference
-    arma::vec se(computeSE(m, stot, coeff_mat));
-    arma::vec tscores(computeTScore(curr_beta, se));
-
-    // VP_partial is empty for HE/HE-NNLS so needs to be populated
-    if(solver != "Fisher"){
-        VP_partial = precomp_list["PZZt"];
+    PLGlmmFit fit;
+    timer.start(GlmmTimer::INFERENCE);
+    if(spectral_mme){
+        // the coefficient matrix is only formed once, for the SEs and the returned output
+        scaledTranspose(X, Winv, xTwinv);
+        coeffMatrix(X, xTwinv, scaleSpRows(Z, Winv).t(), Z, G, coeff_mat);
+        coeff_factor = SymmetricFactor(coeff_mat, mixed);
     }
+    fit.se = computeSE(m, stot, coeff_factor);
+    fit.tscores = computeTScore(curr_beta, fit.se);
 
-    arma::mat vcov(varCovar(VP_partial, c)); // DF calculation is done in R, but needs this
+    if(solver == "Fisher-Hutchinson"){
+        // the information is 0.5 * the (estimated) traces
+        fit.vcov = varCovarTraces(2 * information_sigma);
+    } else{
+        fit.vcov = varCovar(ZtPZ, _u_indices, c);
+    }
+    fit.df = computeSatterthwaiteDF(curr_sigma, coeff_factor, m, fit.se, fit.vcov, G, _u_indices);
+    fit.contrasts = computeContrasts(contrasts, curr_beta, curr_sigma, coeff_factor, fit.vcov, G, _u_indices);
+
+    // the converged model is the null for every variant, so V*^-1 is only set up once for the whole scan
+    if(genotypes.n_cols > 0){
+        arma::vec _ystar;
+        arma::vec _winv;
+        nullWorkingModel(X, Z, curr_beta, curr_u, y, offsets, curr_disp, vardist, _ystar, _winv);
+        std::unique_ptr<VstarInverse> _null_vsinv;
+        if(spectral){
+            _null_vsinv.reset(new SpectralVstarInvOperator(_winv, curr_sigma[0], Kvectors, Kvalues, _kvectors_single));
+        } else{
+            _null_vsinv.reset(new VstarInvOperator(_winv, G, Z, scaleSpRows(Z, _winv).t(), mixed));
+        }
+        fit.scan = scoreScan(*_null_vsinv, X, _ystar, genotypes, scan_calibrate);
+    }
+    timer.stop(GlmmTimer::INFERENCE);
 
     // compute the variance of the pseudovariable
-    double pseduo_var = arma::var(y_star);
+    fit.psvar = arma::var(y_star);
 
     // compute final loglihood
-    // make non-broadcast G matrix
-    arma::mat littleG(c, c, arma::fill::zeros);
-
-    for(int i=0; i<c; i++){
-        littleG(i, i) = curr_sigma(i);
+    timer.start(GlmmTimer::LOGLIHOOD);
+    fit.loglihood = nbLogLik(muvec, curr_disp, y, lgamma_y1) - normLogLik(c, G, curr_sigma, curr_u, pi);
+    timer.stop(GlmmTimer::LOGLIHOOD);
+
+    fit.beta = curr_beta;
+    fit.u = curr_u;
+    fit.sigma = curr_sigma;
+    fit.converged = converged;
+    fit.iters = iters;
+    fit.accel_steps = anderson.n_accepted();
+    fit.disp = curr_disp;
+    fit.info_sigma = information_sigma;
+    fit.coeff = coeff_mat;
+    // G refers to this fit's K^-1, so only its dense inverse outlives the fit
+    if(keep_conv){
+        fit.Ginv = G.denseInverse();
     }
-    double loglihood = nbLogLik(muvec, curr_disp, y) - normLogLik(c, G_inv, littleG, curr_u, pi);
 
-    outlist = List::create(_["FE"]=curr_beta, _["RE"]=curr_u, _["Sigma"]=curr_sigma,
-                           _["converged"]=converged, _["Iters"]=iters, _["Dispersion"]=curr_disp,
-                           _["Hessian"]=information_sigma, _["SE"]=se, _["t"]=tscores, _["PSVAR"]=pseduo_var,
-                           _["COEFF"]=coeff_mat, _["P"]=P, _["Vpartial"]=VP_partial, _["Ginv"]=G_inv,
-                           _["Vsinv"]=V_star_inv, _["Winv"]=Winv, _["VCOV"]=vcov, _["LOGLIHOOD"]=loglihood,
-                            _["CONVLIST"]=conv_list);
+    if(keep_full){
+        // the full n X n V*^-1 and P are only formed once, for the returned output
+        VstarInvOperator final_vstar_inv(Winv, vstar_G, Z, scaleSpRows(Z, Winv).t());
+        POperator final_P(final_vstar_inv, X, REML);
+        fit.P = final_P.materialise();
+        if(solver != "Fisher-Hutchinson"){
+            computePZList_G(_u_indices, PZ, K, Kf, precomp_list);
+        }
+        fit.vpartial = precomp_list;
+        fit.Vsinv = final_vstar_inv.materialise();
+    }
+    fit.Winv = Winv;
+    fit.conv = conv_list;
+    fit.solver = solver;
+    if(timings){
+        fit.timings = timer.totals();
+    }
 
-    return outlist;
+    return fit;
 }
-
-
@@ -0,0 +1,18 @@
+#ifndef FITGENETICPLGLMM_H
+#define FITGENETICPLGLMM_H
+
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+#include "fitPLGlmm.h"
+
+// as fitPLGlmmCore, with the final random effect covariance sigma_c * K - P is only populated for the full return level
+PLGlmmFit fitGeneticPLGlmmCore(const arma::sp_mat& Z, const arma::mat& X, const arma::mat& K,
+                               arma::vec muvec, const arma::vec& offsets, arma::vec curr_beta,
+                               arma::vec curr_theta, arma::vec curr_u, arma::vec curr_sigma,
+                               const arma::vec& y, const std::vector<arma::uvec>& u_indices,
+                               double theta_conv, double curr_disp, bool REML, int maxit,
+                               std::string solver, const std::string& vardist, int nprobes,
+                               const arma::mat& Kvectors, const arma::vec& Kvalues, // K = U S U^T, or empty
+                               bool accelerate, const std::string& return_level, bool mixed, bool timings,
+                               const arma::mat& contrasts, const arma::mat& genotypes, int scan_calibrate);
+#endif
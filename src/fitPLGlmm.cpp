@@ -1,13 +1,20 @@
-#include<RcppArmadillo.h>
-#include<Rcpp.h>
+#include "milorArma.h"
 // [[Rcpp::depends(RcppArmadillo)]]
 #include "paramEst.h"
 #include "computeMatrices.h"
 #include "invertPseudoVar.h"
+#include "structuredG.h"
 #include "pseudovarPartial.h"
-#include "multiP.h"
 #include "inference.h"
 #include "utils.h"
+#include "anderson.h"
+#include "mixedPrecision.h"
+#include "glmmTimer.h"
+#include "threadBudget.h"
+#include "glmmWorkspace.h"
+#include "fitPLGlmm.h"
+// the Rcpp export is a thin shim that converts to and from R - the standalone build only has fitPLGlmmCore
+#ifndef MILOR_STANDALONE
 using namespace Rcpp;
 
 //' GLMM parameter estimation using pseudo-likelihood
@@ -16,7 +23,7 @@ using namespace Rcpp;
 //' component parameters using Fisher scoring based on the Pseudo-likelihood
 //' approximation to a Normal loglihood.
 //'
-//' @param Z mat - sparse matrix that maps random effect variable levels to
+//' @param Z sp_mat - sparse matrix (dgCMatrix) that maps random effect variable levels to
 //' observations
 //' @param X mat - sparse matrix that maps fixed effect variables to
 //' observations
@@ -36,8 +43,22 @@ using namespace Rcpp;
 //' @param curr_disp double Dispersion parameter estimate
 //' @param REML bool - use REML for variance component estimation
 //' @param maxit int maximum number of iterations if theta_conv is FALSE
-//' @param solver string which solver to use - either HE (Haseman-Elston regression) or Fisher scoring
+//' @param solver string which solver to use - either HE (Haseman-Elston regression), HE-NNLS, Fisher scoring
+//' or Fisher-Hutchinson (Fisher scoring with stochastic trace estimates)
 //' @param vardist string which variance form to use NB = negative binomial, P=Poisson [not yet implemented.]
+//' @param nprobes int number of Rademacher probe vectors used to estimate the traces when \code{solver="Fisher-Hutchinson"}
+//' @param accelerate bool - use Anderson acceleration of the outer pseudo-likelihood iterations
+//' @param return_level string which outputs to return - one of summary, standard or full (see details)
+//' @param precision string - double or mixed (see details)
+//' @param timings bool - return the time spent in each phase of the fit as \code{TIMINGS}
+//' @param threads int number of OpenMP and BLAS threads to use within the fit, or 0 to leave these unchanged. The BLAS
+//' thread count can only be set when R is linked against OpenBLAS or MKL
+//' @param contrasts mat - m X k matrix of fixed effect contrasts, 1 per column, e.g. from \code{limma::makeContrasts}.
+//' A matrix with 0 columns skips the contrast tests
+//' @param genotypes mat - n X v matrix of variants, e.g. genotype dosages, to score against the fitted model as the
+//' null. A matrix with 0 columns skips the scan
+//' @param scan_calibrate int number of variants from which to estimate the GRAMMAR-gamma variance ratio, or 0 to
+//' compute the exact score variance of every variant
 //'
 //' @details Fit a NB-GLMM to the counts provided in \emph{y}. The model uses an iterative approach that
 //' switches between the joint fixed and random effect parameter inference, and the variance component
@@ -46,7 +67,24 @@ using namespace Rcpp;
 //' Hendersons mixed model equations, and the variance component parameters are then estimated with
 //' the specified solver, i.e. Fisher scoring, Haseman-Elston or constrained Haseman-Elston regression. As
 //' the domain of the variance components is [0, +\code{Inf}], any negative variance component estimates will
-//' trigger the switch to the HE-NNLS solver until the model converges.
+//' trigger the switch to the HE-NNLS solver until the model converges. The Fisher-Hutchinson solver replaces the
+//' exact traces in the score and information with Hutchinson estimates over a fixed set of \emph{nprobes}
+//' Rademacher vectors, which only requires products of the pseudovariance inverse with n X \emph{nprobes} matrices.
+//' With \emph{accelerate} each iteration is treated as a fixed point map of the stacked fixed effects, random effects,
+//' variance components and dispersion, and Anderson mixing over the last 5 iterations proposes an extrapolated point.
+//' This is only accepted if the variance components and dispersion are positive, and the log-likelihood is no lower
+//' than after the plain update; otherwise the plain update is kept and the mixing history is discarded.
+//'
+//' \emph{return_level} controls how much of the fit is returned, and hence stored. \emph{summary} only returns the
+//' parameter estimates and their inference, including the Satterthwaite degrees of freedom and p-values; \emph{standard}
+//' adds \code{COEFF}, \code{Ginv}, \code{Winv}, \code{VCOV} and \code{CONVLIST}, but no n X n matrices; and \emph{full}
+//' adds \code{Vpartial} and \code{Vsinv}.
+//'
+//' With \emph{precision="mixed"} the Cholesky factorisations of the mixed model equations and the pseudovariance
+//' component system are computed in single precision, and every solve is iteratively refined against the double
+//' precision system. The estimates agree with double precision to a relative tolerance of 1e-5.
+//' This needs miloR to be compiled with \code{-DMILOR_MIXED_PRECISION} against a BLAS/LAPACK with single precision
+//' routines, e.g. OpenBLAS or MKL, as R's reference BLAS only has the double precision routines.
 //'
 //' @return A \code{list} containing the following elements (note: return types are dictated by Rcpp, so the R
 //' types are described here):
@@ -63,16 +101,35 @@ using namespace Rcpp;
 //' \item{\code{t:}}{\code{numeric} vector containing the compute t-score for each fixed effect variable.}
 //' \item{\code{COEFF:}}{\code{matrix} containing the coefficient matrix from the mixed model equations.}
 //' \item{\code{P:}}{\code{matrix} containing the elements of the REML projection matrix.}
-//' \item{\code{Vpartial:}}{\code{list} containing the partial derivatives of the (pseudo)variance matrix with respect to each variance
-//' component.}
+//' \item{\code{Vpartial:}}{\code{list} containing, for each variance component, the n X q left factor P*Z(j) of the projected partial
+//' derivative of the (pseudo)variance matrix, P*Z(j)*Z(j)^T. Empty with the Fisher-Hutchinson solver.}
 //' \item{\code{Ginv:}}{\code{matrix} of the inverse variance components broadcast to the full Z matrix.}
 //' \item{\code{Vsinv:}}{\code{matrix} of the inverse pseudovariance.}
-//' \item{\code{Winv:}}{\code{matrix} of the inverse elements of W = D^-1 V D^-1}
+//' \item{\code{Winv:}}{\code{numeric} vector of the diagonal elements of the inverse of W = D^-1 V D^-1}
 //' \item{\code{VCOV:}}{\code{matrix} of the variance-covariance for all model fixed and random effect variable parameter estimates.
 //' This is required to compute the degrees of freedom for the fixed effect parameter inference.}
 //' \item{\code{CONVLIST:}}{\code{list} of \code{list} containing the parameter estimates and differences between current and previous
 //' iteration estimates at each model iteration. These are included for each fixed effect, random effect and variance component parameter.
 //' The list elements for each iteration are: \emph{ThetaDiff}, \emph{SigmaDiff}, \emph{beta}, \emph{u}, \emph{sigma}.}
+//' \item{\code{AccelSteps:}}{\code{integer} scalar of the number of accepted Anderson acceleration steps.}
+//' \item{\code{DF:}}{\code{numeric} vector of the Satterthwaite degrees of freedom. The Jacobian of the fixed effect covariance
+//' with respect to the variance components is computed analytically from the final coefficient matrix factorisation.}
+//' \item{\code{PVALS:}}{\code{numeric} vector of the 2-sided t-test p-values using \code{DF}.}
+//' \item{\code{TIMINGS:}}{only if \code{timings=TRUE}, a named \code{numeric} vector of the seconds spent constructing
+//' W and D (\code{WD}), V*^-1 (\code{VstarInv}), the REML projection (\code{PREML}), P*Z(j) (\code{PZList}), in the
+//' variance component solve (\code{SigmaSolve}), the dispersion (\code{Dispersion}), the mixed model equations
+//' (\code{MME}), the log-likelihood (\code{Loglihood}) and the final inference (\code{Inference}). These are followed
+//' by the number of variance component solver switches (\code{SolverSwitches}), pivoted Cholesky fallbacks
+//' for singular systems (\code{PivotedFallbacks}) and re-used factorisations (\code{FactorReuses}).}
+//' \item{\code{CONTRASTS:}}{only if \code{contrasts} has at least 1 column, a \code{list} of \code{numeric} vectors
+//' with the estimate (\code{Estimate}), standard error (\code{SE}), t-score (\code{t}), Satterthwaite degrees of
+//' freedom (\code{DF}) and p-value (\code{PVALS}) of each contrast, computed from the same final factorisation as
+//' the fixed effect tests.}
+//' \item{\code{SCAN:}}{only if \code{genotypes} has at least 1 column, a \code{list} of the score test of each
+//' variant against the fitted null model: the score (\code{Score}), its variance (\code{Variance}), the 1-step
+//' approximate effect size (\code{Beta}) and standard error (\code{SE}), the 1 degree of freedom chi-squared
+//' statistic (\code{Chisq}) and p-value (\code{PVALS}), and the variance ratio used (\code{Gamma}, \code{NA} for
+//' the exact variances).}
 //' }
 //'
 //' @author Mike Morgan
@@ -82,25 +139,108 @@ using namespace Rcpp;
 //'
 //' @name fitPLGlmm
 // [[Rcpp::export]]
-List fitPLGlmm(const arma::mat& Z, const arma::mat& X, arma::vec muvec,
+List fitPLGlmm(const arma::sp_mat& Z, const arma::mat& X, arma::vec muvec,
                arma::vec offsets, arma::vec curr_beta,
                arma::vec curr_theta, arma::vec curr_u, arma::vec curr_sigma,
                arma::mat curr_G, const arma::vec& y, List u_indices,
                double theta_conv,
                const List& rlevels, double curr_disp, const bool& REML, const int& maxit,
                std::string solver,
-               std::string vardist){
+               std::string vardist, const int& nprobes, const bool& accelerate,
+               std::string return_level, std::string precision, const bool& timings, const int& threads,
+               const arma::mat& contrasts, const arma::mat& genotypes, const int& scan_calibrate){
+
+    if(return_level != "summary" && return_level != "standard" && return_level != "full"){
+        stop("return_level must be one of summary, standard or full");
+    }
+
+    bool mixed;
+    try{
+        mixed = useMixedPrecision(precision);
+    } catch(std::exception& e){
+        stop(e.what());
+    }
+
+    // the previous thread counts are restored when this goes out of scope, including on errors
+    ThreadBudget budget(threads, threads);
+
+    // the fitting itself doesn't touch any R objects, so it can be shared with the batched nhood fitter
+    std::vector<arma::uvec> _u_indices = uvecListFromR(u_indices);
+    PLGlmmFit fit = fitPLGlmmCore(Z, X, muvec, offsets, curr_beta, curr_theta, curr_u, curr_sigma,
+                                  y, _u_indices, theta_conv, curr_disp, REML, maxit,
+                                  solver, vardist, nprobes, accelerate, return_level, mixed, timings, contrasts,
+                                  genotypes, scan_calibrate);
+
+    List outlist = List::create(_["FE"]=fit.beta, _["RE"]=fit.u, _["Sigma"]=fit.sigma,
+                                _["converged"]=fit.converged, _["Iters"]=fit.iters, _["Dispersion"]=fit.disp,
+                                _["Hessian"]=fit.info_sigma, _["SE"]=fit.se, _["t"]=fit.tscores, _["PSVAR"]=fit.psvar,
+                                _["LOGLIHOOD"]=fit.loglihood, _["solver"]=fit.solver, _["AccelSteps"]=fit.accel_steps,
+                                _["DF"]=fit.df, _["PVALS"]=computePvalues(fit.tscores, fit.df));
+
+    if(return_level != "summary"){
+        List conv_list(maxit+1);
+        for(unsigned int i=0; i < fit.conv.size(); i++){
+            const PLGlmmIteration& _it = fit.conv[i];
+            conv_list(i) = List::create(_["ThetaDiff"]=_it.theta_diff, _["SigmaDiff"]=_it.sigma_diff, _["beta"]=_it.beta,
+                                        _["u"]=_it.u, _["sigma"]=_it.sigma, _["disp"]=_it.disp, _["PhiDiff"]=_it.disp_diff,
+                                        _["LOGLIHOOD"]=_it.loglihood);
+        }
+
+        outlist.push_back(fit.coeff, "COEFF");
+        outlist.push_back(fit.Ginv, "Ginv");
+        outlist.push_back(fit.Winv, "Winv");
+        outlist.push_back(fit.vcov, "VCOV");
+        outlist.push_back(conv_list, "CONVLIST");
+    }
+
+    if(return_level == "full"){
+        outlist.push_back(matListToR(fit.vpartial), "Vpartial");
+        outlist.push_back(fit.Vsinv, "Vsinv");
+    }
+
+    if(timings){
+        outlist.push_back(namedVector(fit.timings, GlmmTimer::names()), "TIMINGS");
+    }
+
+    if(contrasts.n_cols > 0){
+        const ContrastTests& _ct = fit.contrasts;
+        outlist.push_back(List::create(_["Estimate"]=_ct.estimate, _["SE"]=_ct.se, _["t"]=_ct.t, _["DF"]=_ct.df,
+                                       _["PVALS"]=computePvalues(_ct.t, _ct.df)), "CONTRASTS");
+    }
+
+    if(genotypes.n_cols > 0){
+        outlist.push_back(scanToR(fit.scan), "SCAN");
+    }
+
+    return outlist;
+}
+#endif
+
+
+PLGlmmFit fitPLGlmmCore(const arma::sp_mat& Z, const arma::mat& X, arma::vec muvec,
+                        const arma::vec& offsets, arma::vec curr_beta,
+                        arma::vec curr_theta, arma::vec curr_u, arma::vec curr_sigma,
+                        const arma::vec& y, const std::vector<arma::uvec>& u_indices,
+                        double theta_conv, double curr_disp, bool REML, int maxit,
+                        std::string solver, const std::string& vardist, int nprobes, bool accelerate,
+                        const std::string& return_level, bool mixed, bool timings,
+                        const arma::mat& contrasts, const arma::mat& genotypes, int scan_calibrate,
+                        GlmmWorkspace* workspace){
+    // this must not call into R - errors are thrown as std::runtime_error and warnings go through glmmWarning
+    // return_level is one of summary, standard or full - anything not needed at that level is never stored
+    const bool keep_conv = return_level != "summary";
+    const bool keep_full = return_level == "full";
+    GlmmTimer timer(timings);
 
     // no guarantee that Pi exists before C++ 20(?!?!?!)
     constexpr double pi = 3.14159265358979323846;
 
     // declare all variables
-    List outlist(12);
     int iters=0;
     int stot = Z.n_cols;
-    const int& c = curr_sigma.size();
-    const int& m = X.n_cols;
-    const int& n = X.n_rows;
+    const int c = curr_sigma.size();
+    const int m = X.n_cols;
+    const int n = X.n_rows;
     bool meet_cond = false;
     double constval = 1e-8; // value at which to constrain values
     double _intercept = constval; // intercept for HE regression?? need a better estimate.
@@ -111,28 +251,29 @@ List fitPLGlmm(const arma::mat& Z, const arma::mat& X, arma::vec muvec,
 
 
     std::string user_solver = solver;
-    // setup matrices
-    arma::mat D(n, n, arma::fill::zeros);
-    arma::mat Dinv(n, n, arma::fill::zeros);
-
-    arma::vec y_star(n);
-
-    arma::mat Vmu(n, n, arma::fill::zeros);
-    arma::mat W(n, n, arma::fill::zeros);
-    arma::mat Winv(n, n, arma::fill::zeros);
-
-    arma::mat V_star(n, n, arma::fill::zeros);
-    arma::mat V_star_inv(n, n, arma::fill::zeros);
-    arma::mat P(n, n, arma::fill::zeros);
-
-    arma::mat coeff_mat(m+c, m+c, arma::fill::zeros);
-    List V_partial(c);
-    V_partial = pseudovarPartial_C(Z, u_indices);
-    // compute outside the loop
-    List VP_partial(c); // P * Z(j) * Z(j)^T
-    List VS_partial(c); // Vstar * Z(j) * Z(j)^T
-    List precomp_list(2);
-    List pzzp_list(c); // P * Z(j) * Z(j)^T * P^T
+    // setup matrices - the per-iteration buffers are sized once, in the caller's workspace if there is one
+    GlmmWorkspace _local_ws;
+    GlmmWorkspace& ws = workspace != nullptr ? *workspace : _local_ws;
+    ws.prepare(X, Z, u_indices);
+
+    // D, Vmu and W are all diagonal so we only store the diagonal elements
+    arma::vec& Dinv = ws.Dinv;
+    arma::vec& y_star = ws.y_star;
+    arma::vec& Vmu = ws.Vmu;
+    arma::vec& W = ws.W;
+    arma::vec& Winv = ws.Winv;
+    arma::mat& xTwinv = ws.xTwinv;
+
+    arma::mat& coeff_mat = ws.coeff_mat;
+    SymmetricFactor coeff_factor; // factorised once per iteration, re-used for the SEs
+    SymmetricFactor vstar_factor; // the last factor of G^-1 + Z^T W^-1 Z
+    // the traces and quadratic forms only need the stot X stot Z^T P Z (or Z^T V*^-1 Z), as each
+    // dV/dsigma_j = Z(j) * Z(j)^T has rank q_j
+    std::vector<arma::mat>& precomp_list = ws.precomp_list; // P * Z(j), for the returned output
+    arma::mat& PZ = ws.PZ;
+    arma::mat& VstarZ = ws.VstarZ;
+    arma::mat& ZtPZ = ws.ZtPZ;
+    arma::mat& ZtVZ = ws.ZtVZ;
 
     arma::vec score_sigma(c);
     arma::mat information_sigma(c, c);
@@ -142,18 +283,22 @@ List fitPLGlmm(const arma::mat& Z, const arma::mat& X, arma::vec muvec,
     arma::vec sigma_diff(sigma_update.size());
     sigma_diff.zeros();
 
-    arma::mat G_inv(stot, stot, arma::fill::zeros);
+    // G is only held as its per-level variances
+    StructuredG G(u_indices, curr_sigma);
+
+    // the same probes are used for every component and iteration so the Fisher updates don't jitter
+    arma::mat probes;
+    if(solver == "Fisher-Hutchinson"){
+        probes = rademacherProbes(n, nprobes, 42);
+    }
 
     arma::vec theta_update(m+stot);
     arma::vec theta_diff(theta_update.size());
     theta_diff.zeros();
 
-    List conv_list(maxit+1);
-
-    // create a uvec of sigma indices
-    arma::uvec _sigma_index(c);
-    for(int i=0; i < c; i++){
-        _sigma_index[i] = i+1;
+    std::vector<PLGlmmIteration> conv_list;
+    if(keep_conv){
+        conv_list.reserve(maxit+1);
     }
 
     // setup vectors to index the theta updates
@@ -169,67 +314,80 @@ List fitPLGlmm(const arma::mat& Z, const arma::mat& X, arma::vec muvec,
     }
 
     bool converged = false;
-    bool _phi_est = true; // control if we re-estimate phi or not
+    // the y-only term of the NB log-likelihood is fixed for the whole fit
+    const double lgamma_y1 = arma::accu(arma::lgamma(y + 1));
 
     // // initial optimisation of dispersion
-    update_disp = phiGoldenSearch(curr_disp, delta_lo, delta_up, c,
-                                  muvec, G_inv, pi,
-                                  curr_u, curr_sigma, y);
+    timer.start(GlmmTimer::DISPERSION);
+    update_disp = phiNewton(curr_disp, delta_lo, delta_up, muvec, y);
+    timer.stop(GlmmTimer::DISPERSION);
 
-    disp_diff = abs(curr_disp - update_disp);
+    disp_diff = std::abs(curr_disp - update_disp);
     // curr_disp = update_disp;
     // make the upper and lower bounds based on the current value,
     // but 0 < lo < up < ??
     delta_lo = std::max(1e-2, curr_disp - (curr_disp*0.5));
     delta_up = std::max(1e-2, curr_disp);
 
+    StructuredG vstar_G(G); // the G that V*^-1 was last computed with
+    AndersonAccelerator anderson(5);
+
     while(!meet_cond){
         curr_disp = update_disp;
-        D.diag() = muvec;
-
-        // check for all zero eigen values
-        arma::cx_vec d_eigenval = arma::eig_gen(D); // this needs to handle complex values
-        LogicalVector _check_zero = check_zero_arma_complex(d_eigenval);
-        bool _all_zero = any(_check_zero).is_true();
-
-        if(_all_zero){
-            stop("Zero eigenvalues in D - do you have collinear variables?");
+        // the stacked (beta, u, sigma, phi) that this iteration maps from
+        arma::vec _x_start;
+        if(accelerate){
+            _x_start = arma::join_cols(curr_theta, curr_sigma, arma::vec({curr_disp}));
+        }
+        // D is diagonal so the eigenvalues are just the elements of muvec
+        if(arma::any(muvec == 0.0)){
+            throw std::runtime_error("Zero eigenvalues in D - do you have collinear variables?");
         }
 
-        Dinv = D.i();
-        y_star = computeYStar(X, curr_beta, Z, Dinv, curr_u, y, offsets);
-        Vmu = computeVmu(muvec, curr_disp, vardist);
-
-        W = computeW(curr_disp, Dinv, vardist);
-        Winv = W.i();
-        // pre-compute matrics: X^T * W^-1, Z^T * W^-1
-        arma::mat xTwinv = X.t() * Winv;
-        arma::mat zTwinv = Z.t() * Winv;
-
-        V_star = computeVStar(Z, curr_G, W);
-        V_star_inv = invertPseudoVar(Winv, curr_G, Z, zTwinv);
-
-        if(REML){
-            P = computePREML(V_star_inv, X);
-            // take the partial derivative outside the while loop, just keep the P*\dVar\dSigma
-        } else{
-            P = arma::eye(n, n);
-        };
-
-        // pre-compute matrics: P*Z and Vstar * Z
-        arma::mat PZ = P * Z;
-
-        // pre-compute P*Z(j) * Z(j)^T
-        precomp_list = computePZList(u_indices, PZ, P, Z, solver);
+        timer.start(GlmmTimer::WD);
+        Dinv = 1/muvec;
+        computeYStar(X, curr_beta, Z, Dinv, curr_u, y, offsets, ws.eta, y_star);
+        computeVmu(muvec, curr_disp, vardist, Vmu);
+
+        computeW(curr_disp, Dinv, vardist, W);
+        Winv = 1/W;
+        // pre-compute matrics: X^T * W^-1, Z^T * W^-1 - W^-1 is diagonal so these are column scalings
+        scaledTranspose(X, Winv, xTwinv);
+        arma::sp_mat zTwinv = scaleSpRows(Z, Winv).t(); // stays sparse
+        timer.stop(GlmmTimer::WD);
+
+        // V*^-1 and P are only applied to thin matrices - neither is formed in full
+        vstar_G = G;
+        // late in the fit sigma and W barely change, so the last iteration's factors are re-used where they
+        // are close enough, and the solves refined against the current matrices
+        timer.start(GlmmTimer::VSTARINV);
+        VstarInvOperator V_star_inv(Winv, G, Z, zTwinv, mixed, &vstar_factor);
+        timer.stop(GlmmTimer::VSTARINV);
+
+        timer.start(GlmmTimer::PREML);
+        POperator P(V_star_inv, X, REML);
+        timer.stop(GlmmTimer::PREML);
+
+        // pre-compute matrics: P*Z and the single Z^T*P*Z product of the iteration - the stochastic traces don't
+        // need these
+        timer.start(GlmmTimer::PZLIST);
+        bool have_pz = false;
+        if(solver != "Fisher-Hutchinson"){
+            P.applyTo(ws.Zdense, PZ);
+            ZtPZ = Z.t() * PZ;
+            have_pz = true;
+        }
+        timer.stop(GlmmTimer::PZLIST);
 
         // choose between HE regression and Fisher scoring for variance components
         // would a hybrid approach work here? If any HE estimates are zero switch
         // to NNLS using these as the initial estimates?
 
+        timer.start(GlmmTimer::SIGMA);
         if(solver == "HE"){
             // try Haseman-Elston regression instead of Fisher scoring
             if(REML){
-                sigma_update = estHasemanElston(Z, P, u_indices, y_star, PZ);
+                sigma_update = estHasemanElston(u_indices, P.apply(y_star), PZ);
             } else{
                 sigma_update = estHasemanElstonML(Z, u_indices, y_star);
             }
@@ -238,7 +396,7 @@ List fitPLGlmm(const arma::mat& Z, const arma::mat& X, arma::vec muvec,
             arma::dvec _curr_sigma(c+1, arma::fill::zeros);
 
             if(REML){
-                _sigma_update = estHasemanElstonConstrained(Z, P, u_indices, y_star, _curr_sigma, iters, PZ);
+                _sigma_update = estHasemanElstonConstrained(u_indices, P.apply(y_star), _curr_sigma, iters, PZ);
                 _intercept = _sigma_update[0];
                 sigma_update = _sigma_update.tail(c);
 
@@ -249,7 +407,7 @@ List fitPLGlmm(const arma::mat& Z, const arma::mat& X, arma::vec muvec,
             }
 
             // set 0 values to minval to prevent 0 denominators later
-            if(any(sigma_update == 0.0)){
+            if(arma::any(sigma_update == 0.0)){
                 for(int i=0; i<c; i++){
                     if(sigma_update[i] <= 0.0){
                         sigma_update[i] = constval;
@@ -258,36 +416,54 @@ List fitPLGlmm(const arma::mat& Z, const arma::mat& X, arma::vec muvec,
             }
 
         }else if(solver == "Fisher"){
+            // the quadratic forms are r^T V*^-1 dV_j V*^-1 r = ||Z(j)^T V*^-1 r||^2
+            arma::vec ZtVsy = Z.t() * V_star_inv.apply(y_star - X * curr_beta);
+
             if(REML){
-                arma::mat VstarZ = V_star_inv * Z;
-                VP_partial = precomp_list["PZZt"];
-                VS_partial = pseudovarPartial_V(u_indices, Z, VstarZ);
-
-                score_sigma = sigmaScoreREML_arma(VS_partial, y_star, P,
-                                                  curr_beta, X, V_star_inv,
-                                                  VP_partial);
-                information_sigma = sigmaInfoREML_arma(VP_partial, P);
+                score_sigma = sigmaScoreREML_arma(ZtPZ, ZtVsy, ZtVsy, u_indices);
+                information_sigma = sigmaInfoREML_arma(ZtPZ, u_indices);
             } else{
-                // theres a strange bug that means assigning V_partial to VP_partial
-                // doesn't copy over the contents of the list - perhaps it needs to
-                // be a pointer? Crude solve is to just to pre-multiply by I
-                // VP_partial = pseudovarPartial_P(V_partial, P);
-                VP_partial = precomp_list["PZZt"];
-                score_sigma = sigmaScore(y_star, curr_beta, X, VP_partial, V_star_inv);
-                information_sigma = sigmaInformation(V_star_inv, VP_partial);
+                V_star_inv.applyTo(ws.Zdense, VstarZ);
+                ZtVZ = Z.t() * VstarZ;
+                score_sigma = sigmaScore(ZtVZ, ZtVsy, ZtVsy, u_indices);
+                information_sigma = sigmaInformation(ZtVZ, u_indices);
             }
             sigma_update = fisherScore(information_sigma, score_sigma, curr_sigma);
+        } else if(solver == "Fisher-Hutchinson"){
+            // V*^-1 and P are only applied to the n X k probes - ML uses V*^-1 in place of P
+            arma::mat PW = REML ? P.apply(probes) : V_star_inv.apply(probes);
+            std::vector<arma::mat> dV_W = pseudovarPartialApply(Z, u_indices, probes);
+            std::vector<arma::mat> PdV_W(c);
+            for(int i=0; i < c; i++){
+                PdV_W[i] = REML ? P.apply(dV_W[i]) : V_star_inv.apply(dV_W[i]);
+            }
+            std::vector<arma::mat> dVP_W = pseudovarPartialApply(Z, u_indices, PW);
+
+            arma::vec Vsy = V_star_inv.apply(y_star - X * curr_beta);
+            std::vector<arma::mat> dV_Vsy = pseudovarPartialApply(Z, u_indices, Vsy);
+
+            score_sigma = sigmaScoreHutchinson(probes, PdV_W, Vsy, dV_Vsy);
+            information_sigma = sigmaInfoHutchinson(PdV_W, dVP_W);
+            sigma_update = fisherScore(information_sigma, score_sigma, curr_sigma);
         }
 
         // if we have negative sigmas then we need to switch solver
-        if(any(sigma_update < 0.0)){
-            warning("Negative variance components - re-running with NNLS");
+        if(arma::any(sigma_update < 0.0)){
+            glmmWarning("Negative variance components - re-running with NNLS");
+            if(solver != "HE-NNLS"){
+                timer.count(GlmmTimer::SOLVER_SWITCHES);
+            }
             solver = "HE-NNLS";
             // // for the first iteration use the current non-zero estimate
             arma::dvec _curr_sigma(c+1, arma::fill::zeros);
 
+            if(!have_pz){
+                P.applyTo(ws.Zdense, PZ);
+                ZtPZ = Z.t() * PZ;
+            }
+
             if(REML){
-                _sigma_update = estHasemanElstonConstrained(Z, P, u_indices, y_star, _curr_sigma, iters, PZ);
+                _sigma_update = estHasemanElstonConstrained(u_indices, P.apply(y_star), _curr_sigma, iters, PZ);
                 _intercept = _sigma_update[0];
                 sigma_update = _sigma_update.tail(c);
             } else{
@@ -297,7 +473,7 @@ List fitPLGlmm(const arma::mat& Z, const arma::mat& X, arma::vec muvec,
             }
 
             // set 0 values to minval to prevent 0 denominators later
-            if(any(sigma_update == 0.0)){
+            if(arma::any(sigma_update == 0.0)){
                 for(int i=0; i<c; i++){
                     if(sigma_update[i] <= 0.0){
                         sigma_update[i] = constval;
@@ -308,38 +484,46 @@ List fitPLGlmm(const arma::mat& Z, const arma::mat& X, arma::vec muvec,
             // switch back when positive var params
             solver = user_solver;
         }
+        timer.stop(GlmmTimer::SIGMA);
+
+        // kept after the solves of this iteration, which may have replaced a re-used factor with a fresh one
+        vstar_factor = V_star_inv.factor();
+        timer.countFactor(vstar_factor);
 
-        // update sigma, G, and G_inv
+        // update sigma and G
         // sigma update explodes for poorly conditioned system
 
         sigma_diff = sigma_update - curr_sigma;
         curr_sigma = sigma_update;
 
-        curr_G = initialiseG(u_indices, curr_sigma);
-        G_inv = invGmat(u_indices, curr_sigma);
+        G = StructuredG(u_indices, curr_sigma);
 
         // Update the dispersion with the new variances
         // only update if diff is > 1e-2
         if(disp_diff > 1e-2){
-            update_disp = phiGoldenSearch(curr_disp, delta_lo, delta_up, c,
-                                          muvec, G_inv, pi,
-                                          curr_u, curr_sigma, y);
+            timer.start(GlmmTimer::DISPERSION);
+            update_disp = phiNewton(curr_disp, delta_lo, delta_up, muvec, y);
+            timer.stop(GlmmTimer::DISPERSION);
 
-            disp_diff = abs(curr_disp - update_disp);
+            disp_diff = std::abs(curr_disp - update_disp);
             // curr_disp = update_disp;
             // make the upper and lower bounds based on the current value,
             // but 0 < lo < up < ??
             delta_lo = std::max(1e-2, update_disp - (update_disp*0.5));
             delta_up = std::max(1e-2, update_disp);
         }
-        disp_diff = abs(curr_disp - update_disp);
+        disp_diff = std::abs(curr_disp - update_disp);
 
         // Next, solve pseudo-likelihood GLMM equations to compute solutions for B and u
         // compute the coefficient matrix
-        coeff_mat = coeffMatrix(X, xTwinv, zTwinv, Z, G_inv);
+        timer.start(GlmmTimer::MME);
+        coeffMatrix(X, xTwinv, zTwinv, Z, G, coeff_mat);
+        coeff_factor = SymmetricFactor(coeff_mat, coeff_factor, factor_reuse_tol, mixed);
 
-        theta_update = solveEquations(stot, m, zTwinv, xTwinv, coeff_mat, curr_beta, curr_u, y_star);
-        theta_diff = abs(theta_update - curr_theta);
+        theta_update = solveEquations(stot, m, zTwinv, xTwinv, coeff_factor, curr_beta, curr_u, y_star);
+        timer.stop(GlmmTimer::MME);
+        timer.countFactor(coeff_factor);
+        theta_diff = arma::abs(theta_update - curr_theta);
 
         // inference
         curr_theta = theta_update;
@@ -349,27 +533,21 @@ List fitPLGlmm(const arma::mat& Z, const arma::mat& X, arma::vec muvec,
         // need to check for infinite and NA values here...
         muvec = exp(offsets + (X * curr_beta) + (Z * curr_u));
 
-        LogicalVector _check_mu = check_na_arma_numeric(muvec);
-        bool _any_na = any(_check_mu).is_true(); // .is_true required for proper type casting to bool
-
-        LogicalVector _check_inf = check_inf_arma_numeric(muvec);
-        bool _any_inf = any(_check_inf).is_true();
-
-        if(_any_na){
-            stop("NA estimates in linear predictor - consider an alternative model");
+        if(muvec.has_nan()){
+            throw std::runtime_error("NA estimates in linear predictor - consider an alternative model");
         }
 
-        if(_any_inf){
-            stop("Infinite parameter estimates - consider an alternative model");
+        if(!muvec.is_finite()){
+            throw std::runtime_error("Infinite parameter estimates - consider an alternative model");
         }
 
         iters++;
 
         bool _thconv = false;
-        _thconv = all(theta_diff < theta_conv);
+        _thconv = arma::all(theta_diff < theta_conv);
 
         bool _siconv = false;
-        _siconv = all(abs(sigma_diff) < theta_conv);
+        _siconv = arma::all(arma::abs(sigma_diff) < theta_conv);
 
         bool _ithit = false;
         _ithit = iters > maxit;
@@ -377,50 +555,122 @@ List fitPLGlmm(const arma::mat& Z, const arma::mat& X, arma::vec muvec,
         meet_cond = ((_thconv && _siconv) || _ithit);
         converged = _thconv && _siconv;
 
-        // compute final loglihood
-        // make non-broadcast G matrix
-        arma::mat littleG(c, c, arma::fill::zeros);
+        if(accelerate && !meet_cond){
+            // Anderson mixing over the stacked parameters - the extrapolated point is only kept if the variances
+            // and dispersion stay positive and the PL log-likelihood is no worse than after the plain update
+            arma::vec _x_plain = arma::join_cols(curr_theta, curr_sigma, arma::vec({update_disp}));
+            arma::vec _x_acc;
+            if(anderson.extrapolate(_x_start, _x_plain, _x_acc)){
+                arma::vec _beta_acc = _x_acc.head(m);
+                arma::vec _u_acc = _x_acc.subvec(m, m + stot - 1);
+                arma::vec _sigma_acc = _x_acc.subvec(m + stot, m + stot + c - 1);
+                double _disp_acc = _x_acc[m + stot + c];
+                bool _accept = arma::all(_sigma_acc > 0.0) && _disp_acc > 0.0;
+
+                if(_accept){
+                    StructuredG _G_acc(u_indices, _sigma_acc);
+                    arma::vec _mu_acc = arma::exp(offsets + (X * _beta_acc) + (Z * _u_acc));
+                    double _ll_acc = nbLogLik(_mu_acc, _disp_acc, y, lgamma_y1) - normLogLik(c, _G_acc, _sigma_acc, _u_acc, pi);
+                    double _ll_plain = nbLogLik(muvec, update_disp, y, lgamma_y1) - normLogLik(c, G, curr_sigma, curr_u, pi);
+                    _accept = _mu_acc.is_finite() && std::isfinite(_ll_acc) && _ll_acc >= _ll_plain;
+
+                    if(_accept){
+                        curr_theta = _x_acc.head(m + stot);
+                        curr_beta = _beta_acc;
+                        curr_u = _u_acc;
+                        curr_sigma = _sigma_acc;
+                        G = _G_acc;
+                        muvec = _mu_acc;
+                        update_disp = _disp_acc;
+                        delta_lo = std::max(1e-2, update_disp - (update_disp*0.5));
+                        delta_up = std::max(1e-2, update_disp);
+                        anderson.accept();
+                    }
+                }
 
-        for(int i=0; i<c; i++){
-            littleG(i, i) = curr_sigma(i);
+                if(!_accept){
+                    anderson.restart();
+                }
+            }
         }
-        double loglihood = nbLogLik(muvec, curr_disp, y) - normLogLik(c, G_inv, littleG, curr_u, pi);
 
-        List this_conv(7);
-        this_conv = List::create(_["ThetaDiff"]=theta_diff, _["SigmaDiff"]=abs(sigma_diff), _["beta"]=curr_beta,
-                                 _["u"]=curr_u, _["sigma"]=curr_sigma, _["disp"]=curr_disp, _["PhiDiff"]=disp_diff,
-                                 _["LOGLIHOOD"]=loglihood);
-        conv_list(iters-1) = this_conv;
+        if(keep_conv){
+            timer.start(GlmmTimer::LOGLIHOOD);
+            double loglihood = nbLogLik(muvec, curr_disp, y, lgamma_y1) - normLogLik(c, G, curr_sigma, curr_u, pi);
+            timer.stop(GlmmTimer::LOGLIHOOD);
+
+            PLGlmmIteration this_conv;
+            this_conv.theta_diff = theta_diff;
+            this_conv.sigma_diff = arma::abs(sigma_diff);
+            this_conv.beta = curr_beta;
+            this_conv.u = curr_u;
+            this_conv.sigma = curr_sigma;
+            this_conv.disp = curr_disp;
+            this_conv.disp_diff = disp_diff;
+            this_conv.loglihood = loglihood;
+            conv_list.push_back(this_conv);
+        }
     }
 
-    arma::vec se(computeSE(m, stot, coeff_mat));
-    arma::vec tscores(computeTScore(curr_beta, se));
+    PLGlmmFit fit;
+    timer.start(GlmmTimer::INFERENCE);
+    fit.se = computeSE(m, stot, coeff_factor);
+    fit.tscores = computeTScore(curr_beta, fit.se);
 
-    // VP_partial is empty for HE/HE-NNLS so needs to be populated
-    if(solver != "Fisher"){
-        VP_partial = precomp_list["PZZt"];
+    if(solver == "Fisher-Hutchinson"){
+        // the information is 0.5 * the (estimated) traces
+        fit.vcov = varCovarTraces(2 * information_sigma);
+    } else{
+        fit.vcov = varCovar(ZtPZ, u_indices, c);
     }
-
-    arma::mat vcov(varCovar(VP_partial, c)); // DF calculation is done in R, but needs this
+    fit.df = computeSatterthwaiteDF(curr_sigma, coeff_factor, m, fit.se, fit.vcov, G, u_indices);
+    fit.contrasts = computeContrasts(contrasts, curr_beta, curr_sigma, coeff_factor, fit.vcov, G, u_indices);
+    if(genotypes.n_cols > 0){
+        // the converged model is the null for every variant, so V*^-1 is only factorised once for the whole scan
+        arma::vec _ystar;
+        arma::vec _winv;
+        nullWorkingModel(X, Z, curr_beta, curr_u, y, offsets, curr_disp, vardist, _ystar, _winv);
+        VstarInvOperator null_vstar_inv(_winv, G, Z, scaleSpRows(Z, _winv).t(), mixed);
+        fit.scan = scoreScan(null_vstar_inv, X, _ystar, genotypes, scan_calibrate);
+    }
+    timer.stop(GlmmTimer::INFERENCE);
     // return the variance of the pseudo-variable - this is used to compute the proportion of
     // variance explained - is this on the correct scale though?
-    double pseduo_var = arma::var(y_star);
+    fit.psvar = arma::var(y_star);
 
     // compute final loglihood
-    // make non-broadcast G matrix
-    arma::mat littleG(c, c, arma::fill::zeros);
-
-    for(int i=0; i<c; i++){
-        littleG(i, i) = curr_sigma(i);
+    timer.start(GlmmTimer::LOGLIHOOD);
+    fit.loglihood = nbLogLik(muvec, curr_disp, y, lgamma_y1) - normLogLik(c, G, curr_sigma, curr_u, pi);
+    timer.stop(GlmmTimer::LOGLIHOOD);
+
+    fit.beta = curr_beta;
+    fit.u = curr_u;
+    fit.sigma = curr_sigma;
+    fit.converged = converged;
+    fit.iters = iters;
+    fit.accel_steps = anderson.n_accepted();
+    fit.disp = curr_disp;
+    fit.info_sigma = information_sigma;
+    fit.coeff = coeff_mat;
+    if(keep_conv){
+        fit.Ginv = G.denseInverse();
+    }
+    // the n X q partials and the full n X n inverse are only kept if the caller needs them
+    if(keep_full){
+        // the P * Z(j) blocks of the last iteration - the stochastic traces never form P * Z
+        if(solver != "Fisher-Hutchinson"){
+            computePZList(u_indices, PZ, precomp_list);
+        }
+        fit.vpartial = precomp_list;
+        VstarInvOperator final_vstar_inv(Winv, vstar_G, Z, scaleSpRows(Z, Winv).t());
+        fit.Vsinv = final_vstar_inv.materialise();
+    }
+    fit.Winv = Winv;
+    fit.conv = conv_list;
+    fit.solver = solver;
+    if(timings){
+        fit.timings = timer.totals();
     }
-    double loglihood = nbLogLik(muvec, curr_disp, y) - normLogLik(c, G_inv, littleG, curr_u, pi);
-
-    outlist = List::create(_["FE"]=curr_beta, _["RE"]=curr_u, _["Sigma"]=curr_sigma,
-                           _["converged"]=converged, _["Iters"]=iters, _["Dispersion"]=curr_disp,
-                           _["Hessian"]=information_sigma, _["SE"]=se, _["t"]=tscores, _["PSVAR"]=pseduo_var,
-                           _["COEFF"]=coeff_mat, _["Vpartial"]=VP_partial, _["Ginv"]=G_inv,
-                           _["Vsinv"]=V_star_inv, _["Winv"]=Winv, _["VCOV"]=vcov, _["LOGLIHOOD"]=loglihood,
-                           _["CONVLIST"]=conv_list, _["solver"]=solver);
 
-    return outlist;
+    return fit;
 }
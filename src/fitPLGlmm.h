@@ -0,0 +1,62 @@
+#ifndef FITPLGLMM_H
+#define FITPLGLMM_H
+
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+#include "structuredG.h"
+#include "glmmWorkspace.h"
+#include "inference.h"
+#include "glmmScan.h"
+
+// parameter estimates and differences at each iteration of the PL-GLMM
+struct PLGlmmIteration {
+    arma::vec theta_diff;
+    arma::vec sigma_diff;
+    arma::vec beta;
+    arma::vec u;
+    arma::vec sigma;
+    double disp;
+    double disp_diff;
+    double loglihood;
+};
+
+// everything that fitPLGlmm returns to R, held in plain armadillo/STL types
+struct PLGlmmFit {
+    arma::vec beta;
+    arma::vec u;
+    arma::vec sigma;
+    bool converged;
+    int iters;
+    int accel_steps;
+    double disp;
+    arma::mat info_sigma;
+    arma::vec se;
+    arma::vec tscores;
+    arma::vec df; // Satterthwaite DFs
+    double psvar;
+    arma::mat coeff;
+    std::vector<arma::mat> vpartial; // only populated when the full return level is requested
+    arma::mat Ginv; // dense G^-1, not populated for the summary return level
+    arma::mat Vsinv; // only populated when the full return level is requested
+    arma::mat P; // the kinship fitter only, when the full return level is requested
+    arma::vec Winv;
+    arma::mat vcov;
+    double loglihood;
+    std::vector<PLGlmmIteration> conv; // empty for the summary return level
+    std::string solver;
+    arma::vec timings; // per-phase times and counts, see GlmmTimer - empty unless requested
+    ContrastTests contrasts; // empty unless a contrast matrix is given
+    ScoreScan scan; // empty unless a genotype matrix is given
+};
+
+PLGlmmFit fitPLGlmmCore(const arma::sp_mat& Z, const arma::mat& X, arma::vec muvec,
+                        const arma::vec& offsets, arma::vec curr_beta,
+                        arma::vec curr_theta, arma::vec curr_u, arma::vec curr_sigma,
+                        const arma::vec& y, const std::vector<arma::uvec>& u_indices,
+                        double theta_conv, double curr_disp, bool REML, int maxit,
+                        std::string solver, const std::string& vardist, int nprobes, bool accelerate,
+                        const std::string& return_level, bool mixed, bool timings,
+                        const arma::mat& contrasts, // m X k, 1 contrast per column - 0 columns for none
+                        const arma::mat& genotypes, int scan_calibrate, // n X v variants to scan - 0 columns for none
+                        GlmmWorkspace* workspace=nullptr); // re-used between fits if given, e.g. one per thread
+#endif
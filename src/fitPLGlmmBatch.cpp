@@ -0,0 +1,428 @@
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+#include<map>
+#include<set>
+#ifdef _OPENMP
+#include<omp.h>
+#endif
+#include "computeMatrices.h"
+#include "inference.h"
+#include "utils.h"
+#include "fitPLGlmm.h"
+#include "glmmTimer.h"
+#include "threadBudget.h"
+#include "mixedPrecision.h"
+#include "symmetricFactor.h"
+#include "fitPLGlmmBatch.h"
+
+// the Rcpp export is a thin shim that converts to and from R - the standalone build only has fitPLGlmmBatchCore
+#ifndef MILOR_STANDALONE
+using namespace Rcpp;
+
+//' Batched GLMM parameter estimation across neighbourhoods
+//'
+//' Fit the same NB-GLMM to the counts of every nhood, sharing the design matrices,
+//' random effect indices and initialisation across nhoods. Each nhood fit is the same
+//' pseudo-likelihood procedure as \code{fitPLGlmm}, and nhoods are distributed across
+//' OpenMP threads.
+//'
+//' @param Y mat - nhood X sample matrix of counts
+//' @param X mat - matrix that maps fixed effect variables to observations
+//' @param Z sp_mat - sparse matrix (dgCMatrix) that maps random effect variable levels to
+//' observations
+//' @param offsets vec vector of model offsets
+//' @param disp vec vector of dispersion parameter estimates, 1 per nhood
+//' @param u_indices List a List, each element contains the indices of Z relevant
+//' to each RE and all its levels
+//' @param init_u mat - levels X nhood matrix of initial u estimates
+//' @param theta_conv double Convergence tolerance for paramter estimates
+//' @param REML bool - use REML for variance component estimation
+//' @param maxit int maximum number of iterations if theta_conv is FALSE
+//' @param solver string which solver to use - either HE (Haseman-Elston regression), HE-NNLS, Fisher scoring
+//' or Fisher-Hutchinson (Fisher scoring with stochastic trace estimates)
+//' @param resid_var bool - the last random effect is the residual variance, i.e. a random intercept model
+//' @param nthreads int number of OpenMP threads to use, i.e. the number of nhoods fit concurrently
+//' @param nprobes int number of Rademacher probe vectors used to estimate the traces when \code{solver="Fisher-Hutchinson"}
+//' @param warm_parent ivec - for each nhood the 1-based index of the nhood to warm start from, or 0 to start from
+//' scratch. An empty vector starts every nhood from scratch.
+//' @param accelerate bool - use Anderson acceleration of the outer pseudo-likelihood iterations, as in \code{fitPLGlmm}
+//' @param precision string - double or mixed, as in \code{fitPLGlmm}
+//' @param timings bool - return the time spent in each phase of each nhood fit as \code{TIMINGS}
+//' @param fit_threads int number of BLAS threads to use within each nhood fit, or 0 to leave this unchanged. The
+//' total number of threads in use is \code{nthreads * fit_threads}
+//' @param contrasts mat - m X k matrix of fixed effect contrasts, 1 per column, as in \code{fitPLGlmm}. A matrix with
+//' 0 columns skips the contrast tests
+//'
+//' @details The initial fixed effect parameters are the OLS estimates on log(y + 1), and the initial
+//' variance components follow Demidenko (2013), as in \code{fitGLMM}. With \code{warm_parent} each nhood is
+//' instead initialised from the fixed effects, random effects, variance components and dispersion of its parent
+//' nhood, provided the parent model converged. Nhoods are then fit in waves of equal depth in the parent forest,
+//' such that every parent has been fit before its children, with the nhoods of each wave fit in parallel.
+//' Errors in each nhood are caught and returned, such that a single failed nhood does not halt the others. Warnings raised whilst fitting are
+//' collected and re-issued once each after all nhoods have been fit, with the number of nhoods affected.
+//'
+//' @return A \code{list} containing the following elements (note: return types are dictated by Rcpp, so the R
+//' types are described here):
+//' \describe{
+//' \item{\code{FE}:}{\code{matrix} of fixed effect parameter estimates, 1 row per nhood.}
+//' \item{\code{SE:}}{\code{matrix} of standard error estimates, 1 row per nhood.}
+//' \item{\code{t:}}{\code{matrix} of t-scores for each fixed effect variable, 1 row per nhood.}
+//' \item{\code{DF:}}{\code{matrix} of Satterthwaite degrees of freedom, 1 row per nhood.}
+//' \item{\code{PVALS:}}{\code{matrix} of the 2-sided t-test p-values using \code{DF}, 1 row per nhood.}
+//' \item{\code{Sigma:}}{\code{matrix} of variance component estimates, 1 row per nhood.}
+//' \item{\code{converged:}}{\code{logical} vector of whether each nhood model has converged.}
+//' \item{\code{Iters:}}{\code{integer} vector with the number of iterations that each nhood model ran for.}
+//' \item{\code{AccelSteps:}}{\code{integer} vector with the number of accepted Anderson acceleration steps in each nhood model.}
+//' \item{\code{Dispersion:}}{\code{numeric} vector of the final dispersion estimates.}
+//' \item{\code{LOGLIHOOD:}}{\code{numeric} vector of the final log-likelihood of each nhood model.}
+//' \item{\code{ERROR:}}{\code{character} vector of the error message for each failed nhood, otherwise \code{NA}.}
+//' \item{\code{CAUGHT:}}{\code{logical} vector that is \code{FALSE} when the error arose outside of the model
+//' fitting, i.e. when \code{fitGLMM} would have stopped rather than returning an \code{NA} model.}
+//' \item{\code{TIMINGS:}}{only if \code{timings=TRUE}, a \code{matrix} of the per-phase seconds and counts, 1 row per
+//' nhood, with the columns described in \code{\link{fitPLGlmm}}.}
+//' \item{\code{CONTRASTS:}}{only if \code{contrasts} has at least 1 column, a \code{list} of \code{matrix} with the
+//' estimates (\code{Estimate}), standard errors (\code{SE}), t-scores (\code{t}), Satterthwaite degrees of freedom
+//' (\code{DF}) and p-values (\code{PVALS}) of each contrast, 1 row per nhood and 1 column per contrast.}
+//' }
+//' Failed nhoods have \code{NA} for all estimates.
+//'
+//' @author Mike Morgan
+//'
+//' @examples
+//' NULL
+//'
+//' @name fitPLGlmmBatch
+// [[Rcpp::export]]
+List fitPLGlmmBatch(const arma::mat& Y, const arma::mat& X, const arma::sp_mat& Z,
+                    const arma::vec& offsets, const arma::vec& disp, List u_indices,
+                    const arma::mat& init_u, double theta_conv, const bool& REML,
+                    const int& maxit, std::string solver, const bool& resid_var,
+                    const int& nthreads, const int& nprobes, const arma::ivec& warm_parent,
+                    const bool& accelerate, std::string precision, const bool& timings,
+                    const int& fit_threads, const arma::mat& contrasts){
+
+    PLGlmmBatchFit fit;
+    try{
+        bool mixed = useMixedPrecision(precision);
+        fit = fitPLGlmmBatchCore(Y, X, Z, offsets, disp, uvecListFromR(u_indices), init_u, theta_conv, REML, maxit,
+                                 solver, resid_var, nthreads, nprobes, warm_parent, accelerate, mixed, timings,
+                                 fit_threads, contrasts);
+    } catch(std::exception& e){
+        stop(e.what());
+    }
+
+    // re-issue the collected warnings on the main thread, once per unique message
+    for(const auto& w : fit.warnings){
+        Rcpp::warning(w.first + " (" + std::to_string(w.second) + " nhoods)");
+    }
+
+    const int N = Y.n_rows;
+    CharacterVector error_out(N);
+    for(int i=0; i < N; i++){
+        if(fit.errors[i].empty()){
+            error_out[i] = NA_STRING;
+        } else{
+            error_out[i] = fit.errors[i];
+        }
+    }
+
+    List outlist = List::create(_["FE"]=fit.fe, _["SE"]=fit.se, _["t"]=fit.t, _["DF"]=fit.df, _["PVALS"]=fit.pvals,
+                                _["Sigma"]=fit.sigma, _["converged"]=LogicalVector(fit.converged.begin(), fit.converged.end()),
+                                _["Iters"]=IntegerVector(fit.iters.begin(), fit.iters.end()),
+                                _["AccelSteps"]=IntegerVector(fit.accel_steps.begin(), fit.accel_steps.end()),
+                                _["Dispersion"]=fit.disp, _["LOGLIHOOD"]=fit.loglihood, _["ERROR"]=error_out,
+                                _["CAUGHT"]=LogicalVector(fit.caught.begin(), fit.caught.end()));
+
+    if(timings){
+        NumericMatrix timing_out = wrap(fit.timings);
+        colnames(timing_out) = wrap(GlmmTimer::names());
+        outlist.push_back(timing_out, "TIMINGS");
+    }
+
+    if(contrasts.n_cols > 0){
+        outlist.push_back(List::create(_["Estimate"]=fit.contrast_est, _["SE"]=fit.contrast_se, _["t"]=fit.contrast_t,
+                                       _["DF"]=fit.contrast_df, _["PVALS"]=fit.contrast_pvals), "CONTRASTS");
+    }
+
+    return outlist;
+}
+#endif
+
+
+PLGlmmBatchFit fitPLGlmmBatchCore(const arma::mat& Y, const arma::mat& X, const arma::sp_mat& Z,
+                                  const arma::vec& offsets, const arma::vec& disp,
+                                  const std::vector<arma::uvec>& _u_indices, const arma::mat& init_u,
+                                  double theta_conv, bool REML, int maxit, const std::string& solver,
+                                  bool resid_var, int nthreads, int nprobes, const arma::ivec& warm_parent,
+                                  bool accelerate, bool mixed, bool timings, int fit_threads,
+                                  const arma::mat& contrasts){
+    // this must not call into R, so that it can also be driven from outside of R
+    const int N = Y.n_rows;
+    const int n = X.n_rows;
+    const int m = X.n_cols;
+    const int stot = Z.n_cols;
+    const int c = _u_indices.size();
+    const int n_con = contrasts.n_cols;
+
+    if(Y.n_cols != X.n_rows || Z.n_rows != X.n_rows || offsets.n_elem != X.n_rows){
+        throw std::runtime_error("Dimensions of Y, X and Z are discordant");
+    }
+
+    if(static_cast<int>(disp.n_elem) != N){
+        throw std::runtime_error("Dispersion estimates must have length " + std::to_string(N));
+    }
+
+    if(static_cast<int>(init_u.n_rows) != stot || static_cast<int>(init_u.n_cols) != N){
+        throw std::runtime_error("Initial u estimates must be " + std::to_string(stot) + " X " + std::to_string(N));
+    }
+
+    if(n_con > 0 && static_cast<int>(contrasts.n_rows) != m){
+        throw std::runtime_error("Contrast matrix must have 1 row per fixed effect: " + std::to_string(contrasts.n_rows) +
+                                 " vs. " + std::to_string(m));
+    }
+
+    const bool warm_start = warm_parent.n_elem > 0;
+    if(warm_start && static_cast<int>(warm_parent.n_elem) != N){
+        throw std::runtime_error("Warm start parents must have length " + std::to_string(N));
+    }
+
+    // the depth of each nhood in the warm start forest - roots and cold starts are depth 0
+    std::vector<int> depth(N, warm_start ? -1 : 0);
+    int max_depth = 0;
+    for(int i=0; i < N; i++){
+        std::vector<int> _path;
+        int k = i;
+        while(depth[k] < 0){
+            if(warm_parent[k] < 0 || warm_parent[k] > N){
+                throw std::runtime_error("Warm start parent " + std::to_string(warm_parent[k]) + " is out of bounds");
+            }
+            if(static_cast<int>(_path.size()) > N){
+                throw std::runtime_error("Warm start parents must not contain cycles");
+            }
+            _path.push_back(k);
+            if(warm_parent[k] == 0){
+                depth[k] = 0;
+                _path.pop_back();
+                break;
+            }
+            k = warm_parent[k] - 1;
+        }
+
+        for(int j=static_cast<int>(_path.size()) - 1; j >= 0; j--){
+            depth[_path[j]] = depth[warm_parent[_path[j]] - 1] + 1;
+        }
+        max_depth = std::max(max_depth, depth[i]);
+    }
+
+    std::vector< std::vector<int> > waves(max_depth + 1);
+    for(int i=0; i < N; i++){
+        waves[depth[i]].push_back(i);
+    }
+
+    // shared across nhoods: OLS projection for the initial betas and Z^T Z for the initial sigmas
+    // a rank-deficient X gets a pivoted factor, which is an error for every nhood that needs the OLS start
+    SymmetricFactor XtX(X.t() * X);
+    bool _xok = !XtX.pivoted();
+    arma::mat XtXinvXt = _xok ? XtX.solve(X.t()) : arma::mat();
+    arma::sp_mat Zt(Z.t());
+    arma::vec ZtZ = arma::mat(arma::sum(Z % Z, 0)).t();
+    arma::mat Yt(Y.t()); // each nhood is then a contiguous column
+
+    // outputs are filled with NA and overwritten by successful fits
+    arma::mat fe_mat(N, m);
+    fe_mat.fill(glmmNAReal());
+    arma::mat se_mat(N, m);
+    se_mat.fill(glmmNAReal());
+    arma::mat t_mat(N, m);
+    t_mat.fill(glmmNAReal());
+    arma::mat df_mat(N, m);
+    df_mat.fill(glmmNAReal());
+    arma::mat sigma_mat(N, c);
+    sigma_mat.fill(glmmNAReal());
+    arma::vec disp_out(N);
+    disp_out.fill(glmmNAReal());
+    arma::vec loglihood_out(N);
+    loglihood_out.fill(glmmNAReal());
+    arma::mat timing_mat(timings ? N : 0, GlmmTimer::names().size());
+    timing_mat.fill(glmmNAReal());
+    arma::mat con_est(N, n_con);
+    con_est.fill(glmmNAReal());
+    arma::mat con_se(N, n_con);
+    con_se.fill(glmmNAReal());
+    arma::mat con_t(N, n_con);
+    con_t.fill(glmmNAReal());
+    arma::mat con_df(N, n_con);
+    con_df.fill(glmmNAReal());
+    arma::mat u_mat(stot, N); // only used to warm start other nhoods
+    std::vector<int> converged(N, 0);
+    std::vector<int> iters(N, glmmNAInt());
+    std::vector<int> accel_steps(N, glmmNAInt());
+    std::vector<std::string> errors(N);
+    std::vector<int> caught(N, 1);
+    std::vector< std::vector<std::string> > warnings(N);
+
+    // the BLAS thread count is process-wide, so it is set once for all of the concurrent nhood fits - this also caps
+    // any OpenMP regions nested within a fit
+    ThreadBudget budget(fit_threads, fit_threads);
+
+    // one set of per-iteration buffers per thread, re-used for every nhood that thread fits - num_threads must be
+    // positive, so anything less fits the nhoods serially
+    nthreads = std::max(nthreads, 1);
+    std::vector<GlmmWorkspace> workspaces(nthreads);
+
+    // the implicit barrier at the end of each wave means that parents are always complete
+    for(int w=0; w <= max_depth; w++){
+        const std::vector<int>& _wave = waves[w];
+        const int n_wave = _wave.size();
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+#endif
+        for(int j=0; j < n_wave; j++){
+            const int i = _wave[j];
+            // nothing in here may call into R
+            setGlmmWarningSink(&warnings[i]);
+#ifdef _OPENMP
+            GlmmWorkspace& _ws = workspaces[omp_get_thread_num()];
+#else
+            GlmmWorkspace& _ws = workspaces[0];
+#endif
+            // errors before and after the PL-GLMM loop are fatal in fitGLMM
+            bool in_fit = false;
+
+            try{
+                if(!_xok){
+                    throw std::runtime_error("Fixed effect design matrix is singular - cannot compute initial beta estimates");
+                }
+
+                arma::vec y(Yt.col(i));
+                arma::vec curr_beta(m);
+                arma::vec curr_u(stot);
+                arma::vec curr_sigma(c);
+                double curr_disp = disp[i];
+
+                const int parent = warm_start ? warm_parent[i] - 1 : -1;
+                if(parent >= 0 && converged[parent]){
+                    // neighbouring nhoods overlap, so the parent's estimates are a close starting point
+                    curr_beta = fe_mat.row(parent).t();
+                    curr_u = u_mat.col(parent);
+                    curr_sigma = sigma_mat.row(parent).t();
+                    curr_disp = disp_out[parent];
+                } else{
+                    arma::vec logy(arma::log(y + 1));
+                    curr_beta = XtXinvXt * logy;
+                    curr_u = init_u.col(i);
+
+                    // initial variance components based on Demidenko (2013)
+                    arma::vec e0(logy - X * curr_beta);
+                    double sig0 = arma::dot(e0, e0)/n;
+                    arma::vec Zte(Zt * e0);
+                    const int n_exp = resid_var ? c - 1 : c;
+
+                    for(int k=0; k < n_exp; k++){
+                        arma::uvec _idx = _u_indices[k] - 1;
+                        arma::vec _ztz = ZtZ.elem(_idx);
+                        arma::vec _zte = Zte.elem(_idx);
+                        double lhs = arma::accu(1/(_ztz % _ztz));
+                        double rhs = arma::accu((_zte % _zte)/sig0 - _ztz);
+                        curr_sigma[k] = lhs * rhs;
+                    }
+
+                    if(resid_var){
+                        curr_sigma[c-1] = std::abs(sig0 - arma::accu(curr_sigma.head(n_exp)));
+                    }
+                    curr_sigma = arma::abs(curr_sigma);
+                }
+
+                arma::vec curr_theta = arma::join_cols(curr_beta, curr_u);
+                arma::vec muvec = arma::exp(offsets + X * curr_beta + Z * curr_u);
+
+                if(muvec.has_inf()){
+                    throw std::runtime_error("Infinite values in initial estimates - reconsider model");
+                }
+
+                if(muvec.has_nan()){
+                    if(offsets.has_nan()){
+                        throw std::runtime_error("NA values in offsets - remove these samples before re-running model");
+                    } else{
+                        throw std::runtime_error("NAs values in initial estimates - remove these samples before re-running model");
+                    }
+                }
+
+                in_fit = true;
+                PLGlmmFit fit = fitPLGlmmCore(Z, X, muvec, offsets, curr_beta, curr_theta, curr_u,
+                                              curr_sigma, y, _u_indices, theta_conv, curr_disp,
+                                              REML, maxit, solver, "NB", nprobes, accelerate, "summary", mixed, timings, contrasts,
+                                              arma::mat(), 0, &_ws);
+                in_fit = false;
+
+                if(fit.sigma.has_inf() || fit.beta.has_inf() || fit.u.has_inf()){
+                    throw std::runtime_error("Infinite parameter estimates - reconsider model or increase sample size");
+                }
+
+                fe_mat.row(i) = fit.beta.t();
+                u_mat.col(i) = fit.u;
+                se_mat.row(i) = fit.se.t();
+                t_mat.row(i) = fit.tscores.t();
+                df_mat.row(i) = fit.df.t();
+                sigma_mat.row(i) = fit.sigma.t();
+                disp_out[i] = fit.disp;
+                loglihood_out[i] = fit.loglihood;
+                converged[i] = fit.converged;
+                iters[i] = fit.iters;
+                accel_steps[i] = fit.accel_steps;
+                if(timings){
+                    timing_mat.row(i) = fit.timings.t();
+                }
+                if(n_con > 0){
+                    con_est.row(i) = fit.contrasts.estimate.t();
+                    con_se.row(i) = fit.contrasts.se.t();
+                    con_t.row(i) = fit.contrasts.t.t();
+                    con_df.row(i) = fit.contrasts.df.t();
+                }
+            } catch(std::exception& e){
+                errors[i] = e.what();
+                caught[i] = in_fit;
+            } catch(...){
+                errors[i] = "Unknown error in nhood model fitting";
+                caught[i] = in_fit;
+            }
+
+            setGlmmWarningSink(nullptr);
+        }
+    }
+
+    // the warnings are counted once per nhood, and left for the caller to issue on the main thread
+    PLGlmmBatchFit out;
+    for(int i=0; i < N; i++){
+        std::set<std::string> _nhood_warn(warnings[i].begin(), warnings[i].end());
+        for(const std::string& w : _nhood_warn){
+            out.warnings[w]++;
+        }
+    }
+
+    out.fe = std::move(fe_mat);
+    out.se = std::move(se_mat);
+    out.t = std::move(t_mat);
+    out.df = std::move(df_mat);
+    out.sigma = std::move(sigma_mat);
+    out.disp = std::move(disp_out);
+    out.loglihood = std::move(loglihood_out);
+    out.converged = std::move(converged);
+    out.iters = std::move(iters);
+    out.accel_steps = std::move(accel_steps);
+    out.errors = std::move(errors);
+    out.caught = std::move(caught);
+    out.timings = std::move(timing_mat);
+    out.contrast_est = std::move(con_est);
+    out.contrast_se = std::move(con_se);
+    out.contrast_t = std::move(con_t);
+    out.contrast_df = std::move(con_df);
+
+    // outside of the parallel region, as the p-values come from R's distribution functions in the R build
+    out.pvals = arma::reshape(computePvalues(arma::vectorise(out.t), arma::vectorise(out.df)), N, m);
+    out.contrast_pvals = arma::reshape(computePvalues(arma::vectorise(out.contrast_t), arma::vectorise(out.contrast_df)),
+                                       out.contrast_t.n_rows, out.contrast_t.n_cols);
+
+    return out;
+}
@@ -0,0 +1,41 @@
+#ifndef FITPLGLMMBATCH_H
+#define FITPLGLMMBATCH_H
+
+#include "milorArma.h"
+#include<map>
+#include<string>
+#include<vector>
+
+// everything that fitPLGlmmBatch returns to R, held in plain armadillo/STL types. Failed nhoods have NA estimates
+struct PLGlmmBatchFit {
+    arma::mat fe; // nhood X m
+    arma::mat se;
+    arma::mat t;
+    arma::mat df; // Satterthwaite DFs
+    arma::mat pvals;
+    arma::mat sigma; // nhood X c
+    arma::vec disp;
+    arma::vec loglihood;
+    std::vector<int> converged;
+    std::vector<int> iters;
+    std::vector<int> accel_steps;
+    std::vector<std::string> errors; // empty for nhoods that fit without error
+    std::vector<int> caught; // 0 if the error arose outside of the PL-GLMM loop
+    arma::mat timings; // nhood X phases, see GlmmTimer - empty unless requested
+    arma::mat contrast_est; // nhood X k, empty without contrasts
+    arma::mat contrast_se;
+    arma::mat contrast_t;
+    arma::mat contrast_df;
+    arma::mat contrast_pvals;
+    std::map<std::string, int> warnings; // each unique warning and the number of nhoods that raised it
+};
+
+// errors in the arguments are thrown as std::runtime_error, errors in each nhood fit are caught and returned
+PLGlmmBatchFit fitPLGlmmBatchCore(const arma::mat& Y, const arma::mat& X, const arma::sp_mat& Z,
+                                  const arma::vec& offsets, const arma::vec& disp,
+                                  const std::vector<arma::uvec>& u_indices, const arma::mat& init_u,
+                                  double theta_conv, bool REML, int maxit, const std::string& solver,
+                                  bool resid_var, int nthreads, int nprobes, const arma::ivec& warm_parent,
+                                  bool accelerate, bool mixed, bool timings, int fit_threads,
+                                  const arma::mat& contrasts);
+#endif
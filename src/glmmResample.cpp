@@ -0,0 +1,313 @@
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+#include<algorithm>
+#include<chrono>
+#include<cmath>
+#include<random>
+#include<set>
+#ifdef _OPENMP
+#include<omp.h>
+#endif
+#include "fitPLGlmm.h"
+#include "glmmWorkspace.h"
+#include "threadBudget.h"
+#include "mixedPrecision.h"
+#include "utils.h"
+#include "glmmResample.h"
+
+// the Rcpp export is a thin shim that converts to and from R - the standalone build only has resamplePLGlmmCore
+#ifndef MILOR_STANDALONE
+using namespace Rcpp;
+
+//' Resampling p-values for a GLMM fixed effect
+//'
+//' Compute the empirical null distribution of the t-score of a single fixed effect by refitting the
+//' NB-GLMM to resampled data, with the replicates distributed across OpenMP threads.
+//'
+//' @param X mat - matrix that maps fixed effect variables to observations
+//' @param Z sp_mat - sparse matrix (dgCMatrix) that maps random effect variable levels to
+//' observations
+//' @param y vec - vector of observed counts
+//' @param offsets vec vector of model offsets
+//' @param u_indices List a List, each element contains the indices of Z relevant
+//' to each RE and all its levels
+//' @param beta vec vector of initial fixed effect parameter estimates
+//' @param u vec vector of initial random effect parameter estimates
+//' @param sigma vec vector of initial variance component estimates
+//' @param disp double Dispersion parameter estimate
+//' @param test_coef int - the 1-based column of \code{X} to test
+//' @param method string - either parametric (parametric bootstrap from the null model) or permutation
+//' @param strata ivec - integer stratum labels, 1 per observation, within which the tested variable is permuted.
+//' An empty vector permutes across all observations
+//' @param B int number of resamples
+//' @param time_limit double - no new resamples are started after this many seconds, \code{Inf} for no limit
+//' @param seed int - seed of the random number streams, 1 stream per resample
+//' @param theta_conv double Convergence tolerance for paramter estimates
+//' @param REML bool - use REML for variance component estimation
+//' @param maxit int maximum number of iterations if theta_conv is FALSE
+//' @param solver string which solver to use - either HE (Haseman-Elston regression), HE-NNLS, Fisher scoring
+//' or Fisher-Hutchinson (Fisher scoring with stochastic trace estimates)
+//' @param nthreads int number of OpenMP threads to use, i.e. the number of resamples fit concurrently
+//' @param nprobes int number of Rademacher probe vectors used to estimate the traces when \code{solver="Fisher-Hutchinson"}
+//' @param accelerate bool - use Anderson acceleration of the outer pseudo-likelihood iterations, as in \code{fitPLGlmm}
+//' @param precision string - double or mixed, as in \code{fitPLGlmm}
+//'
+//' @details The observed model is first refit from the initial estimates. With \code{method="parametric"} the
+//' model without the tested fixed effect is also fit, and each resample draws new random effects from N(0, G) and
+//' NB counts given these from this null model fit. With \code{method="permutation"} each resample permutes the
+//' tested column of \code{X} within each stratum, which is only a valid null when the tested variable is
+//' exchangeable within strata. Every resample is refit with the full model, warm started from the observed fit.
+//' Each resample draws from its own random number stream, such that the results are the same for any number of
+//' threads. Resamples that fail to fit are counted but don't halt the others, and warnings are re-issued once each
+//' with the number of resamples affected.
+//'
+//' @return A \code{list} containing the following elements (note: return types are dictated by Rcpp, so the R
+//' types are described here):
+//' \describe{
+//' \item{\code{t}:}{\code{numeric} t-score of the tested fixed effect in the observed data.}
+//' \item{\code{NullT}:}{\code{numeric} vector of the t-score of each resample, \code{NA} for failed resamples and
+//' those not started within \code{time_limit}.}
+//' \item{\code{PValue}:}{\code{numeric} 2-sided resampling p-value, (1 + the number of resamples with |t| at least
+//' the observed |t|)/(1 + the number of successful resamples).}
+//' \item{\code{Completed}:}{\code{integer} number of resamples started within \code{time_limit}.}
+//' \item{\code{Failed}:}{\code{integer} number of those resamples that failed to fit.}
+//' }
+//'
+//' @author Mike Morgan
+//'
+//' @examples
+//' NULL
+//'
+//' @name resamplePLGlmm
+// [[Rcpp::export]]
+List resamplePLGlmm(const arma::mat& X, const arma::sp_mat& Z, const arma::vec& y, const arma::vec& offsets,
+                    List u_indices, const arma::vec& beta, const arma::vec& u, const arma::vec& sigma,
+                    double disp, const int& test_coef, std::string method, const arma::ivec& strata,
+                    const int& B, double time_limit, const int& seed, double theta_conv, const bool& REML,
+                    const int& maxit, std::string solver, const int& nthreads, const int& nprobes,
+                    const bool& accelerate, std::string precision){
+
+    PLGlmmResample fit;
+    try{
+        bool mixed = useMixedPrecision(precision);
+        fit = resamplePLGlmmCore(X, Z, y, offsets, uvecListFromR(u_indices), beta, u, sigma, disp, test_coef, method,
+                                 strata, B, time_limit, static_cast<unsigned int>(seed), theta_conv, REML, maxit,
+                                 solver, nthreads, nprobes, accelerate, mixed);
+    } catch(std::exception& e){
+        stop(e.what());
+    }
+
+    // re-issue the collected warnings on the main thread, once per unique message
+    for(const auto& w : fit.warnings){
+        Rcpp::warning(w.first + " (" + std::to_string(w.second) + " resamples)");
+    }
+
+    return List::create(_["t"]=fit.observed_t, _["NullT"]=NumericVector(fit.null_t.begin(), fit.null_t.end()), _["PValue"]=fit.pvalue,
+                        _["Completed"]=fit.n_completed, _["Failed"]=fit.n_failed);
+}
+#endif
+
+namespace {
+PLGlmmFit refitPLGlmm(const arma::mat& X, const arma::sp_mat& Z, const arma::vec& y, const arma::vec& offsets,
+                      const std::vector<arma::uvec>& u_indices, const arma::vec& beta, const arma::vec& u,
+                      const arma::vec& sigma, double disp, double theta_conv, bool REML, int maxit,
+                      const std::string& solver, int nprobes, bool accelerate, bool mixed, GlmmWorkspace* ws){
+    // only the summary of each refit is needed
+    arma::vec muvec = arma::exp(offsets + X * beta + Z * u);
+    if(!muvec.is_finite()){
+        throw std::runtime_error("Non-finite initial estimates - reconsider model");
+    }
+
+    return fitPLGlmmCore(Z, X, muvec, offsets, beta, arma::join_cols(beta, u), u, sigma, y, u_indices, theta_conv,
+                         disp, REML, maxit, solver, "NB", nprobes, accelerate, "summary", mixed, false, arma::mat(),
+                         arma::mat(), 0, ws);
+}
+
+
+arma::vec simulateNB(const arma::vec& mu, double size, std::mt19937_64& rng){
+    // gamma-Poisson mixture, such that Var(y) = mu + mu^2/size as in computeVmuNB
+    arma::vec ysim(mu.n_elem);
+    for(arma::uword i=0; i < mu.n_elem; i++){
+        std::gamma_distribution<double> _gamma(size, mu[i]/size);
+        double _lambda = _gamma(rng);
+        if(_lambda > 0){
+            std::poisson_distribution<long long> _pois(_lambda);
+            ysim[i] = _pois(rng);
+        } else{
+            ysim[i] = 0;
+        }
+    }
+
+    return ysim;
+}
+
+
+std::vector<arma::uvec> strataIndices(const arma::ivec& strata, arma::uword n){
+    // 0-based observations in each stratum - all observations are exchangeable without strata
+    if(strata.n_elem == 0){
+        return std::vector<arma::uvec>(1, arma::regspace<arma::uvec>(0, n - 1));
+    }
+
+    std::vector<arma::uvec> groups;
+    arma::ivec levels = arma::unique(strata);
+    for(arma::uword k=0; k < levels.n_elem; k++){
+        groups.push_back(arma::find(strata == levels[k]));
+    }
+
+    return groups;
+}
+}
+
+
+PLGlmmResample resamplePLGlmmCore(const arma::mat& X, const arma::sp_mat& Z, const arma::vec& y,
+                                  const arma::vec& offsets, const std::vector<arma::uvec>& u_indices,
+                                  const arma::vec& beta, const arma::vec& u, const arma::vec& sigma, double disp,
+                                  int test_coef, const std::string& method, const arma::ivec& strata, int B,
+                                  double time_limit, unsigned int seed, double theta_conv, bool REML, int maxit,
+                                  const std::string& solver, int nthreads, int nprobes, bool accelerate, bool mixed){
+    // this must not call into R inside the parallel region, so that it can also be driven from outside of R
+    const int n = X.n_rows;
+    const int m = X.n_cols;
+    const int c = u_indices.size();
+    const bool parametric = method == "parametric";
+
+    if(!parametric && method != "permutation"){
+        throw std::runtime_error("Resampling method " + method + " not recognised - must be parametric or permutation");
+    }
+
+    if(test_coef < 1 || test_coef > m){
+        throw std::runtime_error("Tested coefficient must be between 1 and " + std::to_string(m));
+    }
+
+    if(parametric && m < 2){
+        throw std::runtime_error("The parametric bootstrap needs at least 1 fixed effect in the null model");
+    }
+
+    if(strata.n_elem > 0 && static_cast<int>(strata.n_elem) != n){
+        throw std::runtime_error("Strata must have length " + std::to_string(n));
+    }
+
+    if(B < 0){
+        throw std::runtime_error("The number of resamples must be non-negative");
+    }
+
+    const int tcol = test_coef - 1;
+    GlmmWorkspace main_ws;
+
+    // the observed fit, with the same settings as the refits so that the t-scores are comparable
+    PLGlmmFit observed = refitPLGlmm(X, Z, y, offsets, u_indices, beta, u, sigma, disp, theta_conv, REML, maxit,
+                                     solver, nprobes, accelerate, mixed, &main_ws);
+
+    // the parametric bootstrap simulates from the model fit without the tested fixed effect
+    arma::mat X0;
+    PLGlmmFit null_fit;
+    if(parametric){
+        X0 = X;
+        X0.shed_col(tcol);
+        arma::vec _beta0(observed.beta);
+        _beta0.shed_row(tcol);
+        null_fit = refitPLGlmm(X0, Z, y, offsets, u_indices, _beta0, observed.u, observed.sigma, observed.disp,
+                               theta_conv, REML, maxit, solver, nprobes, accelerate, mixed, &main_ws);
+    }
+    arma::vec eta0 = parametric ? arma::vec(offsets + X0 * null_fit.beta) : arma::vec();
+
+    const std::vector<arma::uvec> groups = strataIndices(strata, n);
+    const bool limited = std::isfinite(time_limit);
+
+    arma::vec null_t(B);
+    null_t.fill(glmmNAReal());
+    std::vector<int> completed(B, 0);
+    std::vector<int> failed(B, 0);
+    std::vector< std::vector<std::string> > warnings(B);
+    // num_threads must be positive, so anything less runs the replicates serially
+    nthreads = std::max(nthreads, 1);
+    std::vector<GlmmWorkspace> workspaces(nthreads);
+
+    // the replicates are spread across the OpenMP threads, so the BLAS within each refit is single threaded
+    ThreadBudget budget(0, nthreads > 1 ? 1 : 0);
+    const auto t_start = std::chrono::steady_clock::now();
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+#endif
+    for(int b=0; b < B; b++){
+        // replicates that haven't started when the time budget runs out are skipped
+        const double _elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+        if(limited && _elapsed >= time_limit){
+            continue;
+        }
+
+        completed[b] = 1;
+        setGlmmWarningSink(&warnings[b]);
+#ifdef _OPENMP
+        GlmmWorkspace& _ws = workspaces[omp_get_thread_num()];
+#else
+        GlmmWorkspace& _ws = workspaces[0];
+#endif
+
+        try{
+            std::seed_seq _seeds{seed, static_cast<unsigned int>(b)};
+            std::mt19937_64 rng(_seeds);
+            PLGlmmFit _fit;
+
+            if(parametric){
+                // new random effects from N(0, G) and counts from the NB given these
+                std::normal_distribution<double> _norm(0.0, 1.0);
+                arma::vec _u(Z.n_cols);
+                for(int k=0; k < c; k++){
+                    const double _sd = std::sqrt(null_fit.sigma[k]);
+                    for(arma::uword j : u_indices[k]){
+                        _u[j - 1] = _sd * _norm(rng);
+                    }
+                }
+
+                arma::vec _y = simulateNB(arma::exp(eta0 + Z * _u), null_fit.disp, rng);
+                _fit = refitPLGlmm(X, Z, _y, offsets, u_indices, observed.beta, observed.u, observed.sigma,
+                                   observed.disp, theta_conv, REML, maxit, solver, nprobes, accelerate, mixed, &_ws);
+            } else{
+                // exchange the tested variable between observations of the same stratum
+                arma::vec _col(X.col(tcol));
+                for(const arma::uvec& _g : groups){
+                    arma::vec _vals = _col.elem(_g);
+                    std::shuffle(_vals.begin(), _vals.end(), rng);
+                    _col.elem(_g) = _vals;
+                }
+                arma::mat _X(X);
+                _X.col(tcol) = _col;
+
+                _fit = refitPLGlmm(_X, Z, y, offsets, u_indices, observed.beta, observed.u, observed.sigma,
+                                   observed.disp, theta_conv, REML, maxit, solver, nprobes, accelerate, mixed, &_ws);
+            }
+
+            null_t[b] = _fit.tscores[tcol];
+            if(!std::isfinite(null_t[b])){
+                null_t[b] = glmmNAReal();
+                failed[b] = 1;
+            }
+        } catch(...){
+            failed[b] = 1;
+        }
+
+        setGlmmWarningSink(nullptr);
+    }
+
+    PLGlmmResample out;
+    for(int b=0; b < B; b++){
+        std::set<std::string> _rep_warn(warnings[b].begin(), warnings[b].end());
+        for(const std::string& w : _rep_warn){
+            out.warnings[w]++;
+        }
+    }
+
+    out.observed_t = observed.tscores[tcol];
+    out.n_completed = std::count(completed.begin(), completed.end(), 1);
+    out.n_failed = std::count(failed.begin(), failed.end(), 1);
+
+    // the observed data counts as 1 draw from the null, so the p-value is never 0
+    arma::vec _valid = null_t.elem(arma::find_finite(null_t));
+    const double _extreme = arma::accu(arma::abs(_valid) >= std::abs(out.observed_t));
+    out.pvalue = (1 + _extreme)/(1 + _valid.n_elem);
+    out.null_t = std::move(null_t);
+
+    return out;
+}
@@ -0,0 +1,34 @@
+#ifndef GLMMRESAMPLE_H
+#define GLMMRESAMPLE_H
+
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+#include<map>
+#include<string>
+#include<vector>
+
+// the empirical null distribution of the t-score of one fixed effect, from refits of the PL-GLMM to resampled data
+struct PLGlmmResample {
+    double observed_t;
+    arma::vec null_t; // 1 per replicate, NA for failed refits and for replicates skipped by the time budget
+    int n_completed; // replicates that were refit before the time budget ran out
+    int n_failed; // completed replicates that threw an error
+    double pvalue; // (1 + #{|t_b| >= |t_obs|})/(1 + #successful refits)
+    std::map<std::string, int> warnings; // each unique warning and the number of replicates that raised it
+};
+
+// method is parametric (simulate counts from the fitted null model, i.e. without the tested column of X) or
+// permutation (permute the tested column of X within the strata, 1 integer label per observation, or across all
+// observations if empty). Each replicate b draws from its own RNG stream, seeded by (seed, b), so the results do
+// not depend on the number of threads. beta, u, sigma and disp are the initial estimates of the observed model fit,
+// which also warm start every refit. No new replicates are started after time_limit seconds, unless it is not
+// finite. Errors in the arguments or the observed/null model fits are thrown as std::runtime_error, errors in each
+// replicate are counted as failures
+PLGlmmResample resamplePLGlmmCore(const arma::mat& X, const arma::sp_mat& Z, const arma::vec& y,
+                                  const arma::vec& offsets, const std::vector<arma::uvec>& u_indices,
+                                  const arma::vec& beta, const arma::vec& u, const arma::vec& sigma, double disp,
+                                  int test_coef, const std::string& method, const arma::ivec& strata, int B,
+                                  double time_limit, unsigned int seed, double theta_conv, bool REML, int maxit,
+                                  const std::string& solver, int nthreads, int nprobes, bool accelerate, bool mixed);
+
+#endif
@@ -0,0 +1,113 @@
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+#include<cmath>
+#include "computeMatrices.h"
+#include "symmetricFactor.h"
+#include "glmmScan.h"
+
+namespace {
+// P is applied to this many variants at a time - large enough for BLAS-3 products, small enough that the
+// n X block temporaries stay modest for large n
+const arma::uword scan_block = 256;
+// variants whose residual sum of squares on X is below this fraction of their sum of squares are monomorphic
+const double mono_tol = 1e-8;
+}
+
+
+void nullWorkingModel(const arma::mat& X, const arma::sp_mat& Z, const arma::vec& beta, const arma::vec& u,
+                      const arma::vec& y, const arma::vec& offsets, double disp, const std::string& vardist,
+                      arma::vec& ystar, arma::vec& Winv){
+    // as the first step of each PL-GLMM iteration, but for the final estimates
+    arma::vec eta;
+    arma::vec Dinv(1/arma::exp(offsets + X * beta + Z * u));
+    computeYStar(X, beta, Z, Dinv, u, y, offsets, eta, ystar);
+    // the offsets are fixed, so they are not part of the tested linear predictor
+    ystar -= offsets;
+
+    arma::vec W;
+    computeW(disp, Dinv, vardist, W);
+    Winv = 1/W;
+}
+
+
+ScoreScan scoreScan(const VstarInverse& Vinv, const arma::mat& X, const arma::vec& ystar,
+                    const arma::mat& genotypes, int n_calibrate){
+    // score test of each variant g as an additional fixed effect: U = g^T P y*, Var(U) = g^T P g, with P the REML
+    // projection of the null model. The null fit is shared by every variant, so each only needs inner products
+    // with P y* and, for the exact variances, P g - the variants are processed in blocks such that P is applied
+    // to n X block matrices rather than 1 variant at a time
+    const arma::uword n = X.n_rows;
+    const arma::uword v = genotypes.n_cols;
+
+    if(genotypes.n_rows != n){
+        throw std::runtime_error("Genotype matrix must have 1 row per observation: " +
+                                 std::to_string(genotypes.n_rows) + " vs. " + std::to_string(n));
+    }
+
+    if(n_calibrate < 0){
+        throw std::runtime_error("The number of calibration variants must be non-negative");
+    }
+
+    // the projection is always the REML form, as the fixed effects are estimated under the null
+    POperator P(Vinv, X, true);
+    arma::vec Py(P.apply(ystar));
+
+    // residual sums of squares of the variants on X, O(n m) per variant
+    SymmetricFactor XtX(X.t() * X);
+    arma::vec rss(v);
+    arma::vec ss(v);
+    for(arma::uword b=0; b < v; b += scan_block){
+        const arma::uword _end = std::min(v, b + scan_block) - 1;
+        arma::mat _xtg(X.t() * genotypes.cols(b, _end));
+        ss.subvec(b, _end) = arma::sum(arma::square(genotypes.cols(b, _end)), 0).t();
+        rss.subvec(b, _end) = ss.subvec(b, _end) - arma::sum(_xtg % XtX.solve(_xtg), 0).t();
+    }
+
+    arma::uvec polymorphic = arma::find(rss > mono_tol * ss);
+
+    ScoreScan out;
+    out.score = genotypes.t() * Py;
+    out.variance.set_size(v);
+    out.variance.fill(glmmNAReal());
+    out.gamma = glmmNAReal();
+
+    const bool approximate = n_calibrate > 0 && polymorphic.n_elem > static_cast<arma::uword>(n_calibrate);
+    if(approximate){
+        // GRAMMAR-gamma: g^T P g/g~^T g~ is nearly constant across variants, so it is estimated once from a subset
+        arma::uvec _pick = arma::conv_to<arma::uvec>::from(arma::round(arma::linspace(0, polymorphic.n_elem - 1,
+                                                                                      n_calibrate)));
+        arma::uvec _calib = polymorphic.elem(_pick);
+        arma::mat _g = genotypes.cols(_calib);
+        arma::vec _gpg = arma::sum(_g % P.apply(_g), 0).t();
+        out.gamma = arma::mean(_gpg/rss.elem(_calib));
+
+        out.variance.elem(polymorphic) = out.gamma * rss.elem(polymorphic);
+    } else{
+        for(arma::uword b=0; b < polymorphic.n_elem; b += scan_block){
+            arma::uvec _idx = polymorphic.subvec(b, std::min(polymorphic.n_elem, b + scan_block) - 1);
+            arma::mat _g = genotypes.cols(_idx);
+            out.variance.elem(_idx) = arma::sum(_g % P.apply(_g), 0).t();
+        }
+    }
+
+    out.score.elem(arma::find_nonfinite(out.variance)).fill(glmmNAReal());
+    out.beta = out.score/out.variance;
+    out.se = 1/arma::sqrt(out.variance);
+    out.chisq = arma::square(out.score)/out.variance;
+    out.pvals.set_size(v);
+    for(arma::uword i=0; i < v; i++){
+        // 2-sided normal p-value of the score z = U/sqrt(Var(U))
+        out.pvals[i] = std::isfinite(out.chisq[i]) ? std::erfc(std::sqrt(out.chisq[i]/2)) : glmmNAReal();
+    }
+
+    return out;
+}
+
+
+#ifndef MILOR_STANDALONE
+Rcpp::List scanToR(const ScoreScan& scan){
+    return Rcpp::List::create(Rcpp::_["Score"]=scan.score, Rcpp::_["Variance"]=scan.variance,
+                              Rcpp::_["Beta"]=scan.beta, Rcpp::_["SE"]=scan.se, Rcpp::_["Chisq"]=scan.chisq,
+                              Rcpp::_["PVALS"]=scan.pvals, Rcpp::_["Gamma"]=scan.gamma);
+}
+#endif
@@ -0,0 +1,35 @@
+#ifndef GLMMSCAN_H
+#define GLMMSCAN_H
+
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+#include "invertPseudoVar.h"
+
+// score tests of each column of a genotype matrix against the fitted null NB-GLMM, 1 element per variant.
+// Monomorphic variants, i.e. constant or collinear with X, are NA
+struct ScoreScan {
+    arma::vec score; // g^T P y*
+    arma::vec variance; // g^T P g, or its GRAMMAR-gamma approximation
+    arma::vec beta; // 1-step approximate Wald estimate, score/variance
+    arma::vec se;
+    arma::vec chisq;
+    arma::vec pvals;
+    double gamma; // NA unless the variances are approximated
+};
+
+// the working response, centred on the offsets, and the inverse weights of the NB-GLMM at the null estimates
+void nullWorkingModel(const arma::mat& X, const arma::sp_mat& Z, const arma::vec& beta, const arma::vec& u,
+                      const arma::vec& y, const arma::vec& offsets, double disp, const std::string& vardist,
+                      arma::vec& ystar, arma::vec& Winv);
+
+// with n_calibrate = 0 every g^T P g is computed exactly, in blocks of variants. Otherwise P is only applied to
+// n_calibrate evenly spaced variants to estimate gamma = g^T P g/g~^T g~, with g~ the residual of g on X, and
+// g^T P g ~ gamma * g~^T g~ for all other variants (GRAMMAR-gamma), which is O(n m) per variant
+ScoreScan scoreScan(const VstarInverse& Vinv, const arma::mat& X, const arma::vec& ystar,
+                    const arma::mat& genotypes, int n_calibrate);
+
+#ifndef MILOR_STANDALONE
+Rcpp::List scanToR(const ScoreScan& scan);
+#endif
+
+#endif
@@ -0,0 +1,49 @@
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+#include "glmmTimer.h"
+
+GlmmTimer::GlmmTimer(bool enabled) : on(enabled){
+    for(int i=0; i < N_PHASES; i++){
+        seconds[i] = 0.0;
+    }
+
+    for(int i=0; i < N_COUNTERS; i++){
+        counts[i] = 0.0;
+    }
+}
+
+
+void GlmmTimer::countFactor(const SymmetricFactor& factor){
+    if(!on){
+        return;
+    }
+
+    if(factor.reused()){
+        counts[FACTOR_REUSES] += 1.0;
+    }
+
+    if(factor.pivoted()){
+        counts[PIVOTED_FALLBACKS] += 1.0;
+    }
+}
+
+
+arma::vec GlmmTimer::totals() const{
+    arma::vec out(N_PHASES + N_COUNTERS);
+    for(int i=0; i < N_PHASES; i++){
+        out[i] = seconds[i];
+    }
+
+    for(int i=0; i < N_COUNTERS; i++){
+        out[N_PHASES + i] = counts[i];
+    }
+
+    return out;
+}
+
+
+std::vector<std::string> GlmmTimer::names(){
+    // must follow the order of Phase then Counter
+    return {"WD", "VstarInv", "PREML", "PZList", "SigmaSolve", "Dispersion", "MME", "Loglihood", "Inference",
+            "SolverSwitches", "PivotedFallbacks", "FactorReuses"};
+}
@@ -0,0 +1,46 @@
+#ifndef GLMMTIMER_H
+#define GLMMTIMER_H
+
+#include "milorArma.h"
+#include<chrono>
+#include<string>
+#include<vector>
+// [[Rcpp::depends(RcppArmadillo)]]
+#include "symmetricFactor.h"
+
+// wall clock totals for each phase of a PL-GLMM fit, plus counts of solver switches and factorisation fallbacks
+// when disabled every call is a single branch, so the calls can stay in the fitting loop
+class GlmmTimer {
+public:
+    enum Phase {WD, VSTARINV, PREML, PZLIST, SIGMA, DISPERSION, MME, LOGLIHOOD, INFERENCE, N_PHASES};
+    enum Counter {SOLVER_SWITCHES, PIVOTED_FALLBACKS, FACTOR_REUSES, N_COUNTERS};
+
+    explicit GlmmTimer(bool enabled=false);
+    bool enabled() const {return on;}
+    void start(Phase p){
+        if(on){
+            started[p] = std::chrono::steady_clock::now();
+        }
+    }
+    void stop(Phase p){
+        if(on){
+            seconds[p] += std::chrono::duration<double>(std::chrono::steady_clock::now() - started[p]).count();
+        }
+    }
+    void count(Counter k){
+        if(on){
+            counts[k] += 1.0;
+        }
+    }
+    void countFactor(const SymmetricFactor& factor); // a re-used or pivoted factorisation
+    arma::vec totals() const; // the phase times in seconds, followed by the counts
+    static std::vector<std::string> names();
+
+private:
+    bool on;
+    std::chrono::steady_clock::time_point started[N_PHASES];
+    double seconds[N_PHASES];
+    double counts[N_COUNTERS];
+};
+
+#endif
@@ -0,0 +1,37 @@
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+#include "glmmWorkspace.h"
+
+void GlmmWorkspace::prepare(const arma::mat& X, const arma::sp_mat& Z, const std::vector<arma::uvec>& u_indices){
+    // set_size is a no-op when the dimensions already match
+    const unsigned int n = X.n_rows;
+    const unsigned int m = X.n_cols;
+    const unsigned int stot = Z.n_cols;
+    const unsigned int c = u_indices.size();
+
+    eta.set_size(n);
+    Dinv.set_size(n);
+    y_star.set_size(n);
+    Vmu.set_size(n);
+    W.set_size(n);
+    Winv.set_size(n);
+
+    xTwinv.set_size(m, n);
+    coeff_mat.set_size(m + stot, m + stot);
+
+    // P * Z and the partials are only sized on first use, as not every solver needs them - empty partials
+    // mark that they were never computed, e.g. for the Fisher-Hutchinson solver
+    if(precomp_list.size() != c || PZ.n_rows != n || PZ.n_cols != stot){
+        PZ.reset();
+        VstarZ.reset();
+        ZtPZ.reset();
+        ZtVZ.reset();
+        precomp_list.assign(c, arma::mat());
+    }
+
+    // the same Z is shared by every nhood in a batch
+    if(last_Z != &Z || Zdense.n_rows != Z.n_rows || Zdense.n_cols != Z.n_cols){
+        Zdense = arma::mat(Z);
+        last_Z = &Z;
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef GLMMWORKSPACE_H
+#define GLMMWORKSPACE_H
+
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+
+// the per-iteration buffers of a PL-GLMM fit, sized once and then written in place by the helpers that take an
+// output argument. Armadillo keeps the memory of a matrix that is re-assigned with the same number of elements, so
+// after the first iteration these are not re-allocated. A workspace can be re-used for any number of fits, e.g. one
+// per thread across all of the nhoods in a batch, and is only re-sized when the model dimensions change
+struct GlmmWorkspace {
+    // diagonal n-vectors
+    arma::vec eta;
+    arma::vec Dinv;
+    arma::vec y_star;
+    arma::vec Vmu;
+    arma::vec W;
+    arma::vec Winv;
+
+    arma::mat Zdense; // n X stot dense copy of Z, the right hand side of P * Z
+    arma::mat xTwinv; // m X n
+    arma::mat PZ; // n X stot, sized on first use
+    arma::mat VstarZ; // n X stot, sized on first use
+    arma::mat ZtPZ; // stot X stot Z^T * P * Z, from which the REML traces are taken
+    arma::mat ZtVZ; // stot X stot Z^T * V*^-1 * Z, for the ML traces
+    std::vector<arma::mat> precomp_list; // P * Z(j), n X q_j - only kept for the full return level
+    arma::mat coeff_mat; // (m + stot) X (m + stot)
+
+    void prepare(const arma::mat& X, const arma::sp_mat& Z, const std::vector<arma::uvec>& u_indices);
+
+private:
+    const arma::sp_mat* last_Z = nullptr; // Zdense is only re-computed for a new Z
+};
+
+#endif
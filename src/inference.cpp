@@ -1,47 +1,61 @@
 #include "inference.h"
-#include<RcppArmadillo.h>
+#include "utils.h"
+#include "pseudovarPartial.h"
+#include "milorArma.h"
 // [[Rcpp::depends(RcppArmadillo)]]
 // using namespace Rcpp;
 
-// All functions used for inference
-arma::vec computeSE(const int& m, const int& c, const arma::mat& coeff_mat) {
-    // compute the fixed effect standard errors from the MME coefficient matrix
+namespace {
+arma::mat satterthwaiteJacobian(const arma::mat& A, const arma::vec& sigma, const StructuredG& G,
+                                const std::vector<arma::uvec>& u_indices){
+    // jac(i, k) = d a_i^T C a_i/d sigma_k for each column a_i of the fixed effect combinations, where A holds the
+    // random effect rows of C^-1 a_i. G^-1 is block diagonal over the variance components, so
+    // sigma_k * (G^-1 A)_k = M_k A_k
+    const int c = sigma.size();
+    arma::mat AGA = A % G.solve(A);
+
+    arma::mat jac(A.n_cols, c);
+    for(int k=0; k < c; k++){
+        arma::uvec _cols = u_indices[k] - 1;
+        jac.col(k) = arma::sum(AGA.rows(_cols), 0).t()/sigma[k];
+    }
 
-    const int& l = coeff_mat.n_cols; // this should be m + c
-    const int& p = coeff_mat.n_rows; // this should be m + c
+    return jac;
+}
 
-    const int& scol = m + c;
-    const int& srow = m + c;
-    if(l != scol){
-        Rcpp::Rcout << scol << std::endl;
-        Rcpp::Rcout << l << std::endl;
-        Rcpp::Rcout << p << std::endl;
-        Rcpp::stop("N cols and input dimensions m + c are not equal");
+
+arma::vec satterthwaiteDF(const arma::mat& jac, const arma::vec& variance, const arma::mat& V_a){
+    arma::vec df(variance.n_elem);
+    for(unsigned int i=0; i < variance.n_elem; i++){
+        arma::vec g(jac.row(i).t());
+        double denom = arma::as_scalar(g.t() * V_a * g);
+        df[i] = (2 * variance[i])/denom;
     }
 
+    return df;
+}
+}
+
+// All functions used for inference
+arma::vec computeSE(const int& m, const int& c, const SymmetricFactor& coeff_factor) {
+    // compute the fixed effect standard errors from the factorised MME coefficient matrix
+    // the inverse of the Schur complement (ul - ur * lr^-1 * ll)^-1 is the leading m X m block of the
+    // inverse coefficient matrix, so only m solves are needed
+    const int& p = coeff_factor.n_rows(); // this should be m + c
+
+    const int& srow = m + c;
     if(p != srow){
-        Rcpp::stop("N rows and input dimensions m + c are not equal");
+        throw std::runtime_error("N rows and input dimensions m + c are not equal: " + std::to_string(p) +
+                                 " vs. " + std::to_string(srow));
     }
 
-    arma::mat ul(coeff_mat.submat(0, 0, m-1, m-1)); // m X m
-    arma::mat ur(coeff_mat.submat(0, m, m-1, m+c-1)); // m X l
-    arma::mat ll(coeff_mat.submat(m, 0, m+c-1, m-1)); // p X m
-    arma::mat lr(coeff_mat.submat(m, m, m+c-1, m+c-1)); // p X l
-
-
-    arma::mat _se(ul - ur * lr.i() * ll); // m X m - (m X c X m) <- this should commute
-    arma::vec se(m+c);
-    // will need a check here for singular hessians...
-    double _rcond = arma::rcond(_se);
-    if(_rcond < 1e-12){
-        Rcpp::warning("Standard Error coefficient matrix is computationally singular - using pseudoinverse");
-        arma::mat _seInv = arma::pinv(_se);
-        se = arma::sqrt(_seInv.diag());
-    } else{
-        arma::mat _seInv = arma::inv(_se);
-        se = arma::sqrt(_seInv.diag());
+    if(coeff_factor.pivoted()){
+        glmmWarning("Standard Error coefficient matrix is computationally singular - using a pivoted Cholesky");
     }
 
+    arma::mat _seInv = coeff_factor.solve(arma::eye(p, m)).head_rows(m);
+    arma::vec se = arma::sqrt(_seInv.diag());
+
     return se;
 }
 
@@ -52,7 +66,7 @@ arma::vec computeTScore(const arma::vec& curr_beta, const arma::vec& SE){
     const int& selength = SE.size();
 
     if(m != selength){
-        Rcpp::stop("standard errors and beta estimate sizes differ");
+        throw std::runtime_error("standard errors and beta estimate sizes differ");
     }
 
     arma::vec tscore(m);
@@ -69,28 +83,73 @@ arma::vec computeTScore(const arma::vec& curr_beta, const arma::vec& SE){
 }
 
 
-arma::mat varCovar(const Rcpp::List& psvari, const int& c){
-    arma::mat Va(c, c);
-    // trace can be computed as sum of dot products of rows and columns
-
+arma::mat varCovar(const arma::mat& ZtPZ, const std::vector<arma::uvec>& u_indices, const int& c){
+    arma::mat traces(c, c);
+    // tr(P dV_i P dV_j) only needs the q_i X q_j blocks of the stot X stot Z^T P Z from the last iteration
     for(int i=0; i < c; i++){
-        arma::mat _ips = psvari[i]; // why isn't this
         for(int j=i; j < c; j++){
-            arma::mat _jps = psvari(j);
-
-            // Compute trace directly
-            double trace = 0.0;
-            for(arma::uword k = 0; k < _ips.n_rows; ++k) {
-                trace += arma::dot(_ips.row(k), _jps.col(k));
-            }
-
-            Va(i, j) = 2 * (1/trace);
-            if(i != j){
-                Va(j, i) = 2 * (1/trace);
-            }
+            traces(i, j) = lowRankTrace(ZtPZ, u_indices, i, j);
+            traces(j, i) = traces(i, j);
         }
     }
 
-    return Va;
+    return varCovarTraces(traces);
+}
+
+
+arma::mat varCovarTraces(const arma::mat& traces){
+    // Va(i, j) = 2/tr(P dV_i P dV_j) from pre-computed (or estimated) traces
+    return 2 * (1/traces);
 }
 
+
+arma::vec computeSatterthwaiteDF(const arma::vec& sigma, const SymmetricFactor& coeff_factor, const int& m,
+                                 const arma::vec& SE, const arma::mat& V_a, const StructuredG& G,
+                                 const std::vector<arma::uvec>& u_indices){
+    // Satterthwaite degrees of freedom, as in Satterthwaite_df in R, but with the Jacobian of diag(C) w.r.t. the
+    // variance components computed analytically from the final coefficient matrix factorisation.
+    // With A = the random effect rows of the fixed effect columns of the inverse coefficient matrix, and
+    // G^-1 = sum_k (1/sigma_k) M_k, then dC/dsigma_k = -C dC^-1/dsigma_k C = (1/sigma_k^2) A_k^T M_k A_k,
+    // so each diagonal element only needs the columns of A weighted by G^-1 - no perturbed refits are needed
+    const int p = coeff_factor.n_rows();
+
+    arma::mat fixed_cols = coeff_factor.solve(arma::eye(p, m));
+    arma::mat jac = satterthwaiteJacobian(fixed_cols.tail_rows(p - m), sigma, G, u_indices);
+
+    return satterthwaiteDF(jac, SE % SE, V_a);
+}
+
+
+ContrastTests computeContrasts(const arma::mat& L, const arma::vec& beta, const arma::vec& sigma,
+                               const SymmetricFactor& coeff_factor, const arma::mat& V_a, const StructuredG& G,
+                               const std::vector<arma::uvec>& u_indices){
+    // the same Wald tests and Satterthwaite DFs as for each fixed effect, but for the columns l of L, which only
+    // needs 1 solve per contrast against the final factorisation: C^-1 [l; 0] gives both Var(l^T beta) = l^T C_bb l
+    // and the random effect rows for the Jacobian. Each fixed effect is the special case of a unit vector
+    const int m = beta.size();
+    const int p = coeff_factor.n_rows();
+
+    ContrastTests out;
+    if(L.n_cols == 0){
+        return out;
+    }
+
+    if(static_cast<int>(L.n_rows) != m){
+        throw std::runtime_error("Contrast matrix must have 1 row per fixed effect: " + std::to_string(L.n_rows) +
+                                 " vs. " + std::to_string(m));
+    }
+
+    arma::mat rhs(p, L.n_cols, arma::fill::zeros);
+    rhs.head_rows(m) = L;
+    arma::mat CL = coeff_factor.solve(rhs);
+
+    arma::vec variance = arma::sum(L % CL.head_rows(m), 0).t();
+    arma::mat jac = satterthwaiteJacobian(CL.tail_rows(p - m), sigma, G, u_indices);
+
+    out.estimate = L.t() * beta;
+    out.se = arma::sqrt(variance);
+    out.t = computeTScore(out.estimate, out.se);
+    out.df = satterthwaiteDF(jac, variance, V_a);
+
+    return out;
+}
@@ -1,11 +1,29 @@
 #ifndef INFERENCE_H
 #define INFERENCE_H
 
-#include<RcppArmadillo.h>
+#include "milorArma.h"
 // [[Rcpp::depends(RcppArmadillo)]]
+#include "structuredG.h"
+#include "symmetricFactor.h"
 
-arma::vec computeSE(const int& m, const int& c, const arma::mat& coeff_mat);
+arma::vec computeSE(const int& m, const int& c, const SymmetricFactor& coeff_factor);
 arma::vec computeTScore(const arma::vec& curr_beta, const arma::vec& SE);
-arma::mat varCovar(const Rcpp::List& psvari, const int& c);
+arma::mat varCovar(const arma::mat& ZtPZ, const std::vector<arma::uvec>& u_indices, const int& c);
+arma::mat varCovarTraces(const arma::mat& traces);
+arma::vec computeSatterthwaiteDF(const arma::vec& sigma, const SymmetricFactor& coeff_factor, const int& m,
+                                 const arma::vec& SE, const arma::mat& V_a, const StructuredG& G,
+                                 const std::vector<arma::uvec>& u_indices);
+
+// Wald tests of the linear combinations L^T beta of the fixed effects, 1 per column of L
+struct ContrastTests {
+    arma::vec estimate;
+    arma::vec se;
+    arma::vec t;
+    arma::vec df; // Satterthwaite DFs
+};
+
+ContrastTests computeContrasts(const arma::mat& L, const arma::vec& beta, const arma::vec& sigma,
+                               const SymmetricFactor& coeff_factor, const arma::mat& V_a, const StructuredG& G,
+                               const std::vector<arma::uvec>& u_indices);
 
 #endif
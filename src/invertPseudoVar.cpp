@@ -1,86 +1,257 @@
-#include<RcppArmadillo.h>
+#include "milorArma.h"
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 // [[Rcpp::depends(RcppArmadillo)]]
 #include "invertPseudoVar.h"
-using namespace Rcpp;
-
-arma::mat invertPseudoVar(const arma::mat& A, const arma::mat& B, const arma::mat& Z,
-                          const arma::mat& ZtA){
-    int c = B.n_cols;
-    int n = A.n_cols;
-
-    arma::mat omt(n, n);
-    arma::mat mid(c, c);
-    arma::mat ZB(n, c);
-
-    // test some openmp parallelisation - saves ~2s on n=1000 with ~50 threads
-    #pragma omp parallel sections
-    {
-        #pragma omp section
-        {
-            ZB = Z * B;
+#include "utils.h"
+#include "mixedPrecision.h"
+
+VstarInvOperator::VstarInvOperator(const arma::vec& Winv, const StructuredG& G, const arma::sp_mat& Z,
+                                   const arma::sp_mat& ZtWinv, bool single, const SymmetricFactor* previous) :
+    A(Winv), Z(Z), ZtA(ZtWinv){
+    // Z and Z^T * W^-1 are sparse so forming the stot X stot system scales with nnz(Z)
+    arma::mat M(ZtA * Z);
+    G.addInverse(M, 1.0);
+
+    if(previous != nullptr){
+        Mfactor = SymmetricFactor(M, *previous, factor_reuse_tol, single);
+    } else{
+        Mfactor = SymmetricFactor(M, single);
+    }
+    if(Mfactor.pivoted()){
+        glmmWarning("Pseudovariance component matrix is computationally singular");
+    }
+}
+
+
+arma::mat VstarInvOperator::apply(const arma::mat& x) const{
+    arma::mat out;
+    applyTo(x, out);
+
+    return out;
+}
+
+
+void VstarInvOperator::applyTo(const arma::mat& x, arma::mat& out) const{
+    // W^-1 (x - Z M^-1 Z^T W^-1 x) - only the stot X k solve is a temporary, the n X k parts are formed in out
+    out = Z * Mfactor.solve(ZtA * x);
+    out = x - out;
+    out.each_col() %= A;
+}
+
+
+const SymmetricFactor& VstarInvOperator::factor() const{
+    return Mfactor;
+}
+
+
+arma::mat VstarInverse::apply(const arma::sp_mat& x) const{
+    return apply(arma::mat(x));
+}
+
+
+void VstarInverse::applyTo(const arma::mat& x, arma::mat& out) const{
+    out = apply(x);
+}
+
+
+arma::mat VstarInvOperator::materialise() const{
+    // the full n X n inverse - only for returning to R
+    arma::mat AZ = arma::mat(ZtA).t();
+    arma::mat omt = -AZ * Mfactor.solve(arma::mat(ZtA));
+    omt.diag() += A;
+
+    return omt;
+}
+
+
+SpectralVstarInvOperator::SpectralVstarInvOperator(const arma::vec& Winv, double sigma, const arma::mat& Kvectors,
+                                                   const arma::vec& Kvalues, const arma::fmat* Kvectors_single) :
+    W(1/Winv), U(Kvectors), Uf(Kvectors_single){
+    sigmaS = sigma * arma::clamp(Kvalues, 0.0, arma::datum::inf);
+    precond = 1/(sigmaS + arma::mean(W));
+}
+
+
+arma::mat SpectralVstarInvOperator::multiply(const arma::mat& x) const{
+    // V* x = W x + U (sigma * S) U^T x
+    arma::mat Utx = U.t() * x;
+    arma::mat out = U * (Utx.each_col() % sigmaS);
+    out += x.each_col() % W;
+
+    return out;
+}
+
+
+template<typename eT>
+arma::Mat<eT> pcgSolve(const arma::Mat<eT>& b, const arma::Mat<eT>& U, const arma::Col<eT>& sigmaS,
+                       const arma::Col<eT>& precond, const arma::Col<eT>& W, double tol, bool& converged){
+    // block preconditioned conjugate gradients, one independent system per column of b
+    // all of the products go through gemm, so the float version uses the single precision BLAS
+    const int maxit = b.n_rows;
+    const int k = b.n_cols;
+
+    arma::Mat<eT> x(arma::size(b), arma::fill::zeros);
+    arma::Mat<eT> r(b);
+    arma::Mat<eT> Utr = gemm(U, r, true);
+    arma::Mat<eT> z = gemm(U, arma::Mat<eT>(Utr.each_col() % precond), false);
+    arma::Mat<eT> p(z);
+    arma::Row<eT> rz = arma::sum(r % z, 0);
+    arma::Row<eT> bnorm = arma::sqrt(arma::sum(arma::square(b), 0));
+    arma::urowvec active = bnorm > 0.0;
+
+    int iter = 0;
+    while(arma::any(active) && iter < maxit){
+        arma::Mat<eT> Utp = gemm(U, p, true);
+        arma::Mat<eT> Vp = gemm(U, arma::Mat<eT>(Utp.each_col() % sigmaS), false);
+        Vp += p.each_col() % W;
+        arma::Row<eT> pVp = arma::sum(p % Vp, 0);
+        arma::Row<eT> alpha(k, arma::fill::zeros);
+        for(int j=0; j < k; j++){
+            if(active[j]){
+                alpha[j] = rz[j]/pVp[j];
+            }
         }
 
-        #pragma omp section
-        {
-            mid = arma::eye<arma::mat>(c, c) + ZtA * ZB;
+        x += p.each_row() % alpha;
+        r -= Vp.each_row() % alpha;
+
+        arma::Row<eT> rnorm = arma::sqrt(arma::sum(arma::square(r), 0));
+        for(int j=0; j < k; j++){
+            if(rnorm[j] <= tol * bnorm[j]){
+                active[j] = 0;
+            }
         }
+
+        Utr = gemm(U, r, true);
+        z = gemm(U, arma::Mat<eT>(Utr.each_col() % precond), false);
+        arma::Row<eT> rz_new = arma::sum(r % z, 0);
+        arma::Row<eT> beta(k, arma::fill::zeros);
+        for(int j=0; j < k; j++){
+            if(active[j]){
+                beta[j] = rz_new[j]/rz[j];
+            }
+        }
+
+        p = z + p.each_row() % beta;
+        rz = rz_new;
+        iter++;
     }
 
-    double _rcond = arma::rcond(mid);
-    if (_rcond < 1e-12) {
-        Rcpp::warning("Pseudovariance component matrix is computationally singular");
-        arma::mat midinv = arma::pinv(mid); // no guarantee on PD - use pseudoinverse
-        omt = A - A * ZB * (midinv * ZtA); // stack multiplications like this appear to be slow
-    } else{
-        arma::mat midinv = arma::inv(mid); // no guarantee on PD.
-        // this is hard to speed up - main bottleneck
-        omt = A - A * ZB * (midinv * ZtA);
+    converged = !arma::any(active);
+
+    return x;
+}
+
+
+arma::mat SpectralVstarInvOperator::apply(const arma::mat& b) const{
+    const double tol = 1e-10;
+    bool converged = true;
+
+    if(Uf == nullptr){
+        arma::mat x = pcgSolve(b, U, sigmaS, precond, W, tol, converged);
+        if(!converged){
+            glmmWarning("Conjugate gradients did not converge for the pseudovariance inverse");
+        }
+
+        return x;
     }
 
-    return omt;
+    // mixed precision: each float CG solve gains ~5 digits on the double precision residual b - V* x
+    const int maxrefine = 10;
+    const double single_tol = 1e-5;
+    arma::fvec sigmaS_f = arma::conv_to<arma::fvec>::from(sigmaS);
+    arma::fvec precond_f = arma::conv_to<arma::fvec>::from(precond);
+    arma::fvec W_f = arma::conv_to<arma::fvec>::from(W);
+    arma::rowvec bnorm = arma::sqrt(arma::sum(arma::square(b), 0));
+
+    arma::mat x(arma::size(b), arma::fill::zeros);
+    arma::mat r(b);
+    for(int i=0; i <= maxrefine; i++){
+        arma::rowvec rnorm = arma::sqrt(arma::sum(arma::square(r), 0));
+        if(arma::all(rnorm <= tol * bnorm)){
+            return x;
+        }
+
+        if(i < maxrefine){
+            bool _inner_conv = true;
+            x += toDouble(pcgSolve(toSingle(r), *Uf, sigmaS_f, precond_f, W_f, single_tol, _inner_conv));
+            r = b - multiply(x);
+        }
+    }
+
+    glmmWarning("Mixed precision conjugate gradients did not converge for the pseudovariance inverse");
+
+    return x;
 }
 
 
-arma::mat kRankOneUpdates(const arma::mat& Vinv, const arma::mat& B){
-    // use the sum of k-rank one updates to compute the inverse of
-    // the pseudo-covariance matrix, given we have the inverse from
-    // iteration i-1 - done by k successive updates to the rows of Vinv
-    // the vector u=column vector of zeros, except 1 in the entry for
-    // the kth position for k in {1, 2, ..., n}
-    // the vector v^T = the kth row of the matrix B containing the updates
-    // from the parameter estimation
+arma::mat SpectralVstarInvOperator::materialise() const{
+    // the full n X n inverse - only for returning to R
+    return apply(arma::mat(arma::eye(W.n_elem, W.n_elem)));
+}
+
+
+arma::mat spectralInverse(const arma::mat& Kvectors, const arma::vec& Kvalues){
+    // K^-1 = U S^-1 U^T, dropping the (numerically) null eigenvalues - a pseudoinverse for a singular kinship
+    double tol = Kvalues.max() * Kvalues.n_elem * arma::datum::eps;
+    arma::vec inv_vals(Kvalues.n_elem, arma::fill::zeros);
+    arma::uvec pos_vals = arma::find(Kvalues > tol);
+    inv_vals.elem(pos_vals) = 1/Kvalues.elem(pos_vals);
+
+    arma::mat SinvUt = Kvectors.t();
+    SinvUt.each_col() %= inv_vals;
+
+    return Kvectors * SinvUt;
+}
+
 
-    const int n = B.n_rows;
-    arma::mat vupdate = Vinv;
-    arma::mat _vup(n, n, arma::fill::zeros);
+POperator::POperator(const VstarInverse& Vinv, const arma::mat& X, bool reml) : Vinv(Vinv), reml(reml), n(X.n_rows){
+    if(reml){
+        VinvX = Vinv.apply(X);
+        XtVinvX = SymmetricFactor(X.t() * VinvX);
+    }
+}
 
-    for(int k=0; k < n; k++){
-        // select the kth row of B
-        arma::drowvec vt_k = B.row(k); // automatically a row vector, i.e. v^T
-        arma::uvec u = arma::zeros<arma::uvec>(n);
-        u[k] = 1;
 
-        _vup = rankOneUp(Vinv, u, vt_k);
-        vupdate.row(k) = _vup.row(k);
+arma::mat POperator::apply(const arma::mat& x) const{
+    if(!reml){
+        return x;
     }
 
-    return vupdate;
+    arma::mat out = Vinv.apply(x);
+    out -= VinvX * XtVinvX.solve(VinvX.t() * x);
+
+    return out;
 }
 
 
-arma::mat rankOneUp(const arma::mat& A, const arma::uvec& u, const arma::drowvec& v){
-    // compute the update inverse for A, u, v^T
+arma::mat POperator::apply(const arma::sp_mat& x) const{
+    return apply(arma::mat(x));
+}
 
-    arma::dvec Au = A*u;
-    arma::drowvec vA = v * A;
 
-    // error in here
-    return A - (((Au * vA))/arma::as_scalar(1 + vA*u));
+void POperator::applyTo(const arma::mat& x, arma::mat& out) const{
+    if(!reml){
+        out = x;
+        return;
+    }
 
+    Vinv.applyTo(x, out);
+    out -= VinvX * XtVinvX.solve(VinvX.t() * x);
 }
 
 
+arma::mat POperator::materialise() const{
+    // the full n X n projection - the solvers only apply P to thin matrices, so this is only formed for the
+    // "full" return level
+    if(!reml){
+        return arma::eye(n, n);
+    }
+
+    arma::mat P = Vinv.materialise();
+    P -= VinvX * XtVinvX.solve(VinvX.t());
 
+    return P;
+}
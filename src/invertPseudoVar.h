@@ -1,11 +1,79 @@
 #ifndef INVERTPSEUDOVAR_H
 #define INVERTPSEUDOVAR_H
 
-#include<RcppArmadillo.h>
+#include "milorArma.h"
 // [[Rcpp::depends(RcppArmadillo)]]
+#include "structuredG.h"
+#include "symmetricFactor.h"
 
-arma::mat invertPseudoVar(const arma::mat& A, const arma::mat& B, const arma::mat& Z,
-                          const arma::mat& ZtA);
-arma::mat kRankOneUpdates(const arma::mat& Vinv, const arma::mat& B);
-arma::mat rankOneUp(const arma::mat& A, const arma::uvec& u, const arma::drowvec& v);
+// anything that can apply V*^-1 to a thin matrix
+class VstarInverse {
+public:
+    virtual ~VstarInverse() {}
+    virtual arma::mat apply(const arma::mat& x) const = 0;
+    arma::mat apply(const arma::sp_mat& x) const;
+    // as apply, but written into out so that a per-fit buffer can be re-used (see GlmmWorkspace) - x must not be out
+    virtual void applyTo(const arma::mat& x, arma::mat& out) const;
+    virtual arma::mat materialise() const = 0;
+};
+
+// V*^-1 = W^-1 - W^-1 Z (G^-1 + Z^T W^-1 Z)^-1 Z^T W^-1 applied through the Woodbury identity
+// only the stot X stot factor is stored - Z is held by reference so must outlive the operator. Given the factor from
+// the previous iteration, it is re-used when G^-1 + Z^T W^-1 Z has changed little (see SymmetricFactor)
+class VstarInvOperator : public VstarInverse {
+public:
+    VstarInvOperator(const arma::vec& Winv, const StructuredG& G, const arma::sp_mat& Z,
+                     const arma::sp_mat& ZtWinv, bool single=false, const SymmetricFactor* previous=nullptr);
+    using VstarInverse::apply;
+    arma::mat apply(const arma::mat& x) const;
+    void applyTo(const arma::mat& x, arma::mat& out) const;
+    arma::mat materialise() const;
+    const SymmetricFactor& factor() const;
+
+private:
+    arma::vec A; // diagonal of W^-1
+    const arma::sp_mat& Z;
+    arma::sp_mat ZtA;
+    SymmetricFactor Mfactor; // G^-1 + Z^T W^-1 Z
+};
+
+// V* = sigma * K + W for a kinship-only model (Z = I), solved by conjugate gradients preconditioned in the
+// eigenbasis of K = U S U^T - the preconditioner U (sigma * S + mean(W) I)^-1 U^T is exact when W is constant,
+// so each apply is a few O(n^2 k) products rather than an O(n^3) factorisation. U and S must outlive the operator.
+// If a single precision copy of U is given, the CG iterations run in float and are refined against V* in double
+class SpectralVstarInvOperator : public VstarInverse {
+public:
+    SpectralVstarInvOperator(const arma::vec& Winv, double sigma, const arma::mat& Kvectors,
+                             const arma::vec& Kvalues, const arma::fmat* Kvectors_single=nullptr);
+    using VstarInverse::apply;
+    arma::mat apply(const arma::mat& x) const;
+    arma::mat materialise() const;
+
+private:
+    arma::vec W; // diagonal of W
+    const arma::mat& U;
+    arma::vec sigmaS; // sigma * eigenvalues of K, truncated at 0
+    arma::vec precond; // 1/(sigma * S + mean(W))
+    const arma::fmat* Uf;
+    arma::mat multiply(const arma::mat& x) const;
+};
+
+// REML projection P = V*^-1 - V*^-1 X (X^T V*^-1 X)^-1 X^T V*^-1, or the identity for ML
+class POperator {
+public:
+    POperator(const VstarInverse& Vinv, const arma::mat& X, bool reml);
+    arma::mat apply(const arma::mat& x) const;
+    arma::mat apply(const arma::sp_mat& x) const;
+    void applyTo(const arma::mat& x, arma::mat& out) const;
+    arma::mat materialise() const;
+
+private:
+    const VstarInverse& Vinv;
+    bool reml;
+    int n;
+    arma::mat VinvX; // n X m
+    SymmetricFactor XtVinvX; // m X m
+};
+
+arma::mat spectralInverse(const arma::mat& Kvectors, const arma::vec& Kvalues);
 #endif
@@ -0,0 +1,24 @@
+#ifndef MILORARMA_H
+#define MILORARMA_H
+
+// the GLMM core only needs armadillo and the C++ standard library, so it can be compiled outside of R with
+// -DMILOR_STANDALONE, e.g. for the command line driver in inst/standalone. Everything that needs R is either in an
+// Rcpp export or guarded by MILOR_STANDALONE
+#ifdef MILOR_STANDALONE
+#include <armadillo>
+#include <limits>
+#else
+#include<RcppArmadillo.h>
+// [[Rcpp::depends(RcppArmadillo)]]
+#endif
+
+// missing values for the estimates of failed fits - these are R's NA when built within R
+#ifdef MILOR_STANDALONE
+inline double glmmNAReal(){ return std::numeric_limits<double>::quiet_NaN(); }
+inline int glmmNAInt(){ return std::numeric_limits<int>::min(); }
+#else
+inline double glmmNAReal(){ return NA_REAL; }
+inline int glmmNAInt(){ return NA_INTEGER; }
+#endif
+
+#endif
@@ -0,0 +1,92 @@
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+#include "mixedPrecision.h"
+
+// [[Rcpp::export]]
+bool mixedPrecisionAvailable(){
+#ifdef MILOR_MIXED_PRECISION
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+bool useMixedPrecision(const std::string& precision){
+    if(precision != "double" && precision != "mixed"){
+        throw std::runtime_error("precision must be one of double or mixed");
+    }
+
+    if(precision == "mixed" && !mixedPrecisionAvailable()){
+        throw std::runtime_error("Mixed precision needs miloR to be compiled with -DMILOR_MIXED_PRECISION against a BLAS/LAPACK "
+                                 "with single precision routines");
+    }
+
+    return precision == "mixed";
+}
+
+
+arma::fmat toSingle(const arma::mat& A){
+    return arma::conv_to<arma::fmat>::from(A);
+}
+
+
+arma::mat toDouble(const arma::fmat& A){
+    return arma::conv_to<arma::mat>::from(A);
+}
+
+
+arma::mat gemm(const arma::mat& A, const arma::mat& B, bool transA){
+    if(transA){
+        return A.t() * B;
+    }
+
+    return A * B;
+}
+
+
+#ifdef MILOR_MIXED_PRECISION
+arma::fmat gemm(const arma::fmat& A, const arma::fmat& B, bool transA){
+    if(transA){
+        return A.t() * B;
+    }
+
+    return A * B;
+}
+
+
+arma::mat singleProduct(const arma::mat& A, const arma::fmat& Bf){
+    return toDouble(toSingle(A) * Bf);
+}
+
+
+bool singleCholesky(arma::fmat& Rf, const arma::mat& A){
+    return arma::chol(Rf, toSingle(A));
+}
+
+
+arma::mat singleCholSolve(const arma::fmat& Rf, const arma::mat& b){
+    // A^-1 b = R^-1 R^-T b
+    arma::fmat _tmp = arma::solve(arma::trimatl(Rf.t()), toSingle(b));
+    return toDouble(arma::solve(arma::trimatu(Rf), _tmp));
+}
+#else
+arma::fmat gemm(const arma::fmat& A, const arma::fmat& B, bool transA){
+    throw std::runtime_error("miloR was compiled without mixed precision support");
+}
+
+
+arma::mat singleProduct(const arma::mat& A, const arma::fmat& Bf){
+    throw std::runtime_error("miloR was compiled without mixed precision support");
+}
+
+
+bool singleCholesky(arma::fmat& Rf, const arma::mat& A){
+    throw std::runtime_error("miloR was compiled without mixed precision support");
+}
+
+
+arma::mat singleCholSolve(const arma::fmat& Rf, const arma::mat& b){
+    throw std::runtime_error("miloR was compiled without mixed precision support");
+}
+#endif
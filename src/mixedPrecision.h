@@ -0,0 +1,19 @@
+#ifndef MIXEDPRECISION_H
+#define MIXEDPRECISION_H
+
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+
+// single precision kernels for precision = "mixed". R's reference BLAS/LAPACK only has the double precision
+// routines, so these are only compiled with -DMILOR_MIXED_PRECISION, i.e. when R is linked against a full
+// BLAS/LAPACK such as OpenBLAS or MKL. Otherwise mixedPrecisionAvailable() is false and they throw
+bool mixedPrecisionAvailable();
+bool useMixedPrecision(const std::string& precision);
+arma::fmat toSingle(const arma::mat& A);
+arma::mat toDouble(const arma::fmat& A);
+arma::mat gemm(const arma::mat& A, const arma::mat& B, bool transA);
+arma::fmat gemm(const arma::fmat& A, const arma::fmat& B, bool transA);
+arma::mat singleProduct(const arma::mat& A, const arma::fmat& Bf); // A * B, with B held in single precision
+bool singleCholesky(arma::fmat& Rf, const arma::mat& A);
+arma::mat singleCholSolve(const arma::fmat& Rf, const arma::mat& b);
+#endif
@@ -2,12 +2,14 @@
 #include "paramEst.h"
 #include "computeMatrices.h"
 #include "utils.h"
-#include "solveQP.h"
-#include<RcppArmadillo.h>
+#include "invertPseudoVar.h"
+#include "pseudovarPartial.h"
+#include "milorArma.h"
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 #include<cmath>
+#include<random>
 
 // [[Rcpp::depends(RcppArmadillo)]]
 // [[Rcpp::plugins(openmp)]]
@@ -15,102 +17,121 @@
 
 // All functions used in parameter estimation
 
-arma::vec sigmaScoreREML_arma (const Rcpp::List& pvstar_i, const arma::vec& ystar,
-                               const arma::mat& P, const arma::vec& curr_beta,
-                               const arma::mat& X, const arma::mat& Vstarinv,
-                               const Rcpp::List& remldiffV){
-    // Armadillo implementation
-    // sparsifying doesn't speed up - overhead is too high
-    const int& c = pvstar_i.size();
-    const int& n = X.n_rows;
-    arma::vec reml_score(c);
-    arma::vec ystarminx(n);
-    ystarminx = ystar - (X * curr_beta);
+namespace {
+arma::vec lowRankScore(const arma::mat& ZtB, const arma::vec& Btr, const arma::vec& ZtVsy,
+                       const std::vector<arma::uvec>& u_indices){
+    // with A dV_i = B_i Z_i^T: tr(A dV_i) = tr(Z_i^T B_i), a diagonal block of Z^T B, and the quadratic form
+    // r^T V*^-1 dV_i A r = (Z_i^T V*^-1 r)^T (B_i^T r) - so each score only needs q_i X q_i and q_i elements
+    const int c = u_indices.size();
+    arma::vec score(c);
 
     for(int i=0; i < c; i++){
-        const arma::mat& P_pvi = pvstar_i(i); // this is Vstar_inv * partial derivative
-        const arma::mat& Pdifi = remldiffV(i);
-        double lhs = -0.5 * arma::trace(Pdifi);
-        arma::mat mid1(1, 1);
-        mid1 = arma::trans(ystarminx) * P_pvi * Vstarinv * ystarminx;
-        double rhs = 0.5 * mid1[0, 0];
-
-        reml_score[i] = lhs + rhs;
+        const arma::uvec _u_idx = u_indices[i] - 1;
+        double lhs = -0.5 * arma::trace(ZtB.submat(_u_idx, _u_idx));
+        double rhs = 0.5 * arma::dot(Btr.elem(_u_idx), ZtVsy.elem(_u_idx));
+
+        score[i] = lhs + rhs;
     }
 
-    return reml_score;
+    return score;
 }
 
 
-arma::mat sigmaInfoREML_arma (const Rcpp::List& pvstari, const arma::mat& P){
-    // REML Fisher/expected information matrix
-    // sparsifying this is baaaad for performance
-    const int& c = pvstari.size();
+arma::mat lowRankInformation(const arma::mat& ZtB, const std::vector<arma::uvec>& u_indices){
+    // 0.5 * tr(A dV_i A dV_j), which is symmetric so only the upper triangle is computed
+    const int c = u_indices.size();
     arma::mat sinfo(c, c);
 
-    // this is a symmetric matrix so only need to fill the upper or
-    // lower triangle to make it O(n^2/2) rather than O(n^2)
     for(int i=0; i < c; i++){
-        const arma::mat& _ipP = pvstari[i]; // this is P * \d Var/ \dsigma
-
         for(int j=i; j < c; j++){
-            const arma::mat& P_jp = pvstari[j]; // this is P * \d Var/ \dsigma
+            sinfo(i, j) = 0.5 * lowRankTrace(ZtB, u_indices, i, j);
+            sinfo(j, i) = sinfo(i, j);
+        }
+    }
 
-            // Compute trace directly
-            double trace = 0.0;
-            for(arma::uword k = 0; k < _ipP.n_rows; ++k) {
-                trace += arma::dot(_ipP.row(k), P_jp.col(k));
-            }
+    return sinfo;
+}
+}
 
-            sinfo(i, j) = 0.5 * trace;
-            if(i != j){
-                sinfo(j, i) = 0.5 * trace;
-            }
 
+arma::vec sigmaScoreREML_arma (const arma::mat& ZtPZ, const arma::vec& Btr, const arma::vec& ZtVsy,
+                               const std::vector<arma::uvec>& u_indices){
+    // ZtPZ is Z^T * P * Z (the kinship block right multiplied by K), computed once per iteration, Btr is B^T r for
+    // the left factors B_i of the partials in the quadratic form and ZtVsy is Z^T V*^-1 r, with r = y* - X beta
+    return lowRankScore(ZtPZ, Btr, ZtVsy, u_indices);
+}
+
+
+arma::mat sigmaInfoREML_arma (const arma::mat& ZtPZ, const std::vector<arma::uvec>& u_indices){
+    // REML Fisher/expected information matrix
+    // tr(P dV_i P dV_j) = tr((Z_j^T P Z_i) (Z_i^T P Z_j)), i.e. from the (i, j) and (j, i) blocks of Z^T P Z
+    return lowRankInformation(ZtPZ, u_indices);
+}
+
+
+arma::vec sigmaScore (const arma::mat& ZtVZ, const arma::vec& Btr, const arma::vec& ZtVsy,
+                      const std::vector<arma::uvec>& u_indices){
+    // ML uses V*^-1 in place of P, so the left factors are V*^-1 Z_i and B_i^T r = Z_i^T V*^-1 r, with the
+    // kinship elements multiplied by K
+    return lowRankScore(ZtVZ, Btr, ZtVsy, u_indices);
+}
+
+
+arma::mat sigmaInformation (const arma::mat& ZtVZ, const std::vector<arma::uvec>& u_indices){
+    return lowRankInformation(ZtVZ, u_indices);
+}
+
+
+arma::mat rademacherProbes(const int& n, const int& k, const unsigned int& seed){
+    // n X k matrix of +/-1 probes for Hutchinson trace estimation - uses its own generator
+    // rather than R's so it can be called from any thread, and a fixed seed makes fits reproducible
+    std::mt19937 rng(seed);
+    std::bernoulli_distribution coin(0.5);
+    arma::mat probes(n, k);
+
+    for(int j=0; j < k; j++){
+        for(int i=0; i < n; i++){
+            probes(i, j) = coin(rng) ? 1.0 : -1.0;
         }
     }
 
-    return sinfo;
+    return probes;
 }
 
 
-arma::vec sigmaScore (arma::vec ystar, arma::vec beta, arma::mat X, Rcpp::List V_partial, arma::mat V_star_inv){
-
-    int c = V_partial.size();
-    int n = X.n_rows;
+arma::vec sigmaScoreHutchinson(const arma::mat& probes, const std::vector<arma::mat>& PdV_probes,
+                               const arma::vec& Vsy, const std::vector<arma::mat>& dV_Vsy){
+    // -0.5 * tr(P dV_i) + 0.5 * (y - Xb)^T V*^-1 dV_i V*^-1 (y - Xb)
+    // the trace is estimated as the mean of w^T P dV_i w over the probes w; the quadratic form is exact
+    // PdV_probes = P dV_i W, Vsy = V*^-1 (y - Xb) and dV_Vsy = dV_i V*^-1 (y - Xb)
+    const int c = PdV_probes.size();
+    const double k = probes.n_cols;
     arma::vec score(c);
-    arma::vec ystarminx(n);
-    ystarminx = ystar - (X * beta);
 
     for(int i=0; i < c; i++){
-        arma::mat _ip = V_partial[i];
-        double lhs = -0.5 * arma::trace(V_star_inv * _ip);
-        arma::mat rhs_mat(1, 1);
-
-        rhs_mat = ystarminx.t() * V_star_inv * _ip * V_star_inv * ystarminx;
-        score[i] = lhs + 0.5 * rhs_mat(0, 0);
+        double lhs = -0.5 * arma::accu(probes % PdV_probes[i])/k;
+        double rhs = 0.5 * arma::dot(Vsy, dV_Vsy[i]);
+        score[i] = lhs + rhs;
     }
 
     return score;
 }
 
 
-arma::mat sigmaInformation (arma::mat V_star_inv, Rcpp::List V_partial){
-    int c = V_partial.size();
-    int n = V_star_inv.n_cols;
-    arma::mat sinfo = arma::zeros(c, c);
+arma::mat sigmaInfoHutchinson(const std::vector<arma::mat>& PdV_probes, const std::vector<arma::mat>& dVP_probes){
+    // 0.5 * tr(P dV_i P dV_j) estimated from the same probes W for every pair of components:
+    // w^T dV_j P dV_i P w = (dV_j P w)^T (P dV_i w), with PdV_probes = P dV_i W and dVP_probes = dV_j P W
+    // the estimate isn't exactly symmetric so average the two orderings
+    const int c = PdV_probes.size();
+    const double k = PdV_probes[0].n_cols;
+    arma::mat sinfo(c, c);
 
     for(int i=0; i < c; i++){
-        arma::mat _ip = V_partial(i);
-        for(int j=0; j < c; j++){
-            arma::mat _jp = V_partial(j);
-
-            arma::mat _inmat(n, n);
-            double _tr = 0.0;
-            _inmat = V_star_inv * _ip * V_star_inv * _jp;
-            _tr = 0.5 * arma::trace(_inmat);
-
-            sinfo(i, j) = _tr;
+        for(int j=i; j < c; j++){
+            double trace_ij = arma::accu(PdV_probes[i] % dVP_probes[j]);
+            double trace_ji = arma::accu(PdV_probes[j] % dVP_probes[i]);
+            sinfo(i, j) = 0.25 * (trace_ij + trace_ji)/k;
+            sinfo(j, i) = sinfo(i, j);
         }
     }
 
@@ -124,340 +145,288 @@ arma::vec fisherScore (const arma::mat& hess, const arma::vec& score_vec, const
     // this needs to be in a direction of descent towards a minimum
     int m = theta_hat.size();
     arma::vec theta(m, arma::fill::zeros);
-    arma::mat hessinv(hess.n_rows, hess.n_cols);
 
-    // will need a check here for singular hessians...
-    double _rcond = arma::rcond(hess);
-    if(_rcond < 1e-9){
-        Rcpp::warning("Variance Component Hessian is computationally singular");
-        hessinv = arma::pinv(hess);
-    } else{
-        hessinv = arma::inv(hess); // always use pinv? solve() and inv() are most sensitive than R versions
+    // a singular information matrix falls back to a pivoted Cholesky
+    SymmetricFactor hess_factor(hess);
+    if(hess_factor.pivoted()){
+        glmmWarning("Variance Component Hessian is computationally singular");
     }
-    theta = theta_hat + (hessinv * score_vec);
+    theta = theta_hat + hess_factor.solve(score_vec);
 
     return theta;
 }
 
 
-arma::mat coeffMatrix(const arma::mat& X, const arma::mat& XtWinv, const arma::mat& ZtWinv,
-                      const arma::mat& Z, const arma::mat& Ginv){
+void coeffMatrix(const arma::mat& X, const arma::mat& XtWinv, const arma::sp_mat& ZtWinv,
+                 const arma::sp_mat& Z, const StructuredG& G, arma::mat& lhs){
     // compute the components of the coefficient matrix for the MMEs
     // sparsification _does_ help here, despite the added overhead
-    // unsparsify
+    // lhs is filled in place, so the same buffer is used for every iteration
     int c = Z.n_cols;
     int m = X.n_cols;
-    arma::mat lhs(m+c, m+c);
+    lhs.set_size(m+c, m+c);
+    arma::mat ztwz(ZtWinv * Z);
+    G.addInverse(ztwz, 1.0); // G^-1 only touches the diagonal and any kinship block
 
     lhs(arma::span(0, m-1), arma::span(0, m-1)) = XtWinv * X;
     lhs(arma::span(0, m-1), arma::span(m, m+c-1)) = XtWinv * Z;
     lhs(arma::span(m, m+c-1), arma::span(0, m-1)) = ZtWinv * X;
-    lhs(arma::span(m, m+c-1), arma::span(m, m+c-1)) = ZtWinv * Z + Ginv;
-
-    return lhs;
+    lhs(arma::span(m, m+c-1), arma::span(m, m+c-1)) = ztwz;
 }
 
 
-arma::vec solveEquations (const int& c, const int& m, const arma::mat& ZtWinv, const arma::mat& XtWinv,
-                          const arma::mat& coeffmat, const arma::vec& beta, const arma::vec& u, const arma::vec& ystar){
-    // solve the mixed model equations
+arma::vec solveEquations (const int& c, const int& m, const arma::sp_mat& ZtWinv, const arma::mat& XtWinv,
+                          const SymmetricFactor& coeff_factor, const arma::vec& beta, const arma::vec& u,
+                          const arma::vec& ystar){
+    // solve the mixed model equations with the factorised coefficient matrix
+    // the same factorisation is re-used for the standard errors
     arma::vec rhs_beta(m);
     arma::vec rhs_u(c);
     arma::mat rhs(m+c, 1);
 
     arma::vec theta_up(m+c, arma::fill::zeros);
-    arma::mat I = arma::eye(arma::size(coeffmat));
-    arma::mat lm_eye = arma::eye(arma::size(coeffmat));
-    arma::mat _coeff = coeffmat;
-    double lambda = 1e-1;
-    double lambda_step = 10;
-    double _illcond_eps = 1e-6;
-    double _lcond_target = 1e-5;
 
     rhs_beta.col(0) = XtWinv * ystar;
-    rhs_u.col(0) = ZtWinv * ystar;
+    rhs_u = ZtWinv * ystar;
 
     rhs = arma::join_cols(rhs_beta, rhs_u);
 
-    // need a check for singular hessian here
-    double _rcond = arma::rcond(coeffmat);
-
-    try{
-        if(_rcond < 1e-9){
-            Rcpp::warning("Coefficients Hessian is computationally singular - trying pseudoinverse");
-            // poorly conditioned system - switch to regularisation to find a solution?
-            // add a small diagonal element to coeffmat
-            theta_up = arma::solve(_coeff, rhs, arma::solve_opts::no_approx);
-        } else{
-            // can we just use solve here instead?
-            // if the coefficient matrix is singular then do we resort to pinv?
-            theta_up = arma::solve(coeffmat, rhs, arma::solve_opts::fast);
-        }
-    } catch(std::exception const& ex){
-        forward_exception_to_r(ex);
-    } catch(...){
-        Rf_error("c++ exception (unknown reason)");
+    if(coeff_factor.pivoted()){
+        glmmWarning("Coefficients Hessian is computationally singular - using a pivoted Cholesky");
     }
+
+    theta_up = coeff_factor.solve(rhs);
     return theta_up;
 }
 
 
-arma::mat computeZstar(const arma::mat& Z, const arma::vec& curr_sigma, const Rcpp::List& u_indices){
-    // use the A = LL^T, ZL = Z* trick similar to lme4 - described in more detail
-    // in https://onlinelibrary.wiley.com/doi/epdf/10.1046/j.1439-0388.2002.00327.x
-    // this assumes that G is PSD - it will fail if it is not
-
-    // compute the Cholesky of G
-    int stot = Z.n_cols;
-    int n = Z.n_rows;
-    arma::mat G(stot, stot);
-    G = initialiseG(u_indices, curr_sigma);
-
-    arma::mat cholG(stot, stot);
-    try{
-        cholG = arma::chol(G, "lower");
-    } catch(std::exception &ex){
-        Rcpp::stop("G is not positive (semi) definite - Cholesky failed");
-        // forward_exception_to_r(ex);
-    } catch(...){
-        Rf_error("c++ exception (unknown reason)");
-    }
+std::vector<arma::mat> heFactors(const arma::mat& PZ, const std::vector<arma::uvec>& u_indices, const bool& genetic){
+    // the n X q_k factors B_k = P * Z_k, such that each HE covariate is M_k = B_k * B_k^T
+    // the kinship component is used directly, so its factor is left empty
+    unsigned int c = u_indices.size();
+    std::vector<arma::mat> B(c);
 
-    // construct Z*=ZL
-    arma::mat Zstar(n, stot);
-    Zstar = Z * cholG;
+    for(unsigned int i=0; i < c; i++){
+        if(genetic && i == c - 1){
+            continue;
+        }
+        B[i] = PZ.cols(u_indices[i] - 1);
+    }
 
-    return Zstar;
+    return B;
 }
 
 
-arma::vec estHasemanElstonGenetic(const arma::mat& Z, const arma::mat& PREML, const arma::mat& PZ,
-                                  const Rcpp::List& u_indices, const arma::vec& ystar, const arma::mat& Kin){
-    // use HasemanElston regression to estimate variance components
-    // vectorize everything
-    // we will also estimate a "residual" variance parameter
-    unsigned int n = ystar.size();
-    unsigned int c = u_indices.size(); // number of variance components
-    unsigned long nsq = (n * (n + 1)/2); //size of vectorised components using just upper or lower triangle of covariance matrix, no diag
-    unsigned int i, j;      // Declare loop variables i and j for OpenMP
-    double _ycovij; // Declare temp_value
+arma::mat heNormalMatrix(const std::vector<arma::mat>& B, const arma::mat& Kin){
+    // the HE design V has a column for the vectorised lower triangle (inc. the diagonal) of each of
+    // I, M_1, ..., M_c - it is never formed. For symmetric M_k and M_l the normal equations are
+    // (V^T V)_kl = 0.5 * (tr(M_k M_l) + diag(M_k)^T diag(M_l)), and tr(M_k M_l) = ||B_k^T B_l||_F^2
+    // if Kin is not empty it replaces the last M_k
+    const int c = B.size();
+    const bool genetic = !Kin.is_empty();
+    const int n = genetic ? Kin.n_rows : B[0].n_rows;
+
+    std::vector<arma::vec> mdiag(c+1);
+    mdiag[0] = arma::ones(n);
+    for(int k=0; k < c; k++){
+        if(genetic && k == c - 1){
+            mdiag[k+1] = Kin.diag();
+        } else{
+            mdiag[k+1] = arma::sum(arma::square(B[k]), 1);
+        }
+    }
 
-    // direct computation of Ycovar with OpenMP?
-    arma::mat lycovar = PREML * ystar; // n * n
-    arma::mat rycovar = ystar.t() * PREML.t(); // n * n
-    arma::mat Ycovar = lycovar * rycovar;
+    arma::mat vtv(c+1, c+1);
+    for(int i=0; i <= c; i++){
+        for(int j=i; j <= c; j++){
+            double trace;
+            if(i == 0){
+                trace = arma::accu(mdiag[j]); // tr(I M_j)
+            } else if(genetic && i == c){
+                trace = arma::accu(arma::square(Kin));
+            } else if(genetic && j == c){
+                trace = arma::accu(B[i-1] % (Kin * B[i-1]));
+            } else{
+                trace = arma::accu(arma::square(B[i-1].t() * B[j-1]));
+            }
 
-    // select the upper triangular elements, including the diagonal
-    arma::uvec lower_indices = trimatl_ind(arma::size(Ycovar));
-    arma::vec Ybig = Ycovar(lower_indices);
+            vtv(i, j) = 0.5 * (trace + arma::dot(mdiag[i], mdiag[j]));
+            vtv(j, i) = vtv(i, j);
+        }
+    }
+
+    return vtv;
+}
 
-    // sequentially vectorise ZZ^T - this automatically adds a vectorised identity matrix
-    // for the "residual" variance
-    arma::mat vecZ = vectoriseZGenetic(Z, u_indices, PREML, PZ, Kin); // projection already applied
 
-    // solve by linear least squares
-    arma::vec he_update(c+1);
+arma::vec heNormalRHS(const std::vector<arma::mat>& B, const arma::mat& Kin, const arma::vec& q){
+    // V^T vec(q q^T) without forming q q^T: 0.5 * (q^T M_k q + diag(M_k)^T (q % q))
+    const int c = B.size();
+    const bool genetic = !Kin.is_empty();
+    arma::vec qsq = arma::square(q);
+    arma::vec vty(c+1);
+    vty[0] = arma::accu(qsq);
 
-    // use OSL here for starters
-    he_update = arma::solve(vecZ, Ybig, arma::solve_opts::fast);
+    for(int k=0; k < c; k++){
+        if(genetic && k == c - 1){
+            vty[k+1] = 0.5 * (arma::dot(q, Kin * q) + arma::dot(Kin.diag(), qsq));
+        } else{
+            arma::vec Btq = B[k].t() * q;
+            arma::vec bdiag = arma::sum(arma::square(B[k]), 1);
+            vty[k+1] = 0.5 * (arma::dot(Btq, Btq) + arma::dot(bdiag, qsq));
+        }
+    }
 
-    return he_update.tail(c);
+    return vty;
 }
 
 
-arma::vec estHasemanElston(const arma::mat& Z, const arma::mat& PREML,
-                           const Rcpp::List& u_indices, const arma::vec& ystar,
-                           const arma::mat& PZ){
+arma::vec estHasemanElstonGenetic(const arma::mat& PZ, const std::vector<arma::uvec>& u_indices,
+                                  const arma::vec& Pystar, const arma::mat& Kin){
     // use HasemanElston regression to estimate variance components
-    // vectorize everything
+    // regress the lower triangle of P*y*y^T*P on those of P*Z_k*Z_k^T*P and the kinship through the
+    // (c+1) X (c+1) normal equations, rather than vectorising the n(n+1)/2 elements
     // we will also estimate a "residual" variance parameter
-    unsigned int n = ystar.size();
-    unsigned int c = u_indices.size(); // number of variance components
-    unsigned long nsq = (n * (n + 1)/2); //size of vectorised components using just upper or lower triangle of covariance matrix
-    unsigned int i, j;      // Declare loop variables i and j for OpenMP
-    double _ycovij; // Declare temp_value
+    std::vector<arma::mat> B = heFactors(PZ, u_indices, true);
+    arma::mat vtv = heNormalMatrix(B, Kin);
+    arma::vec vty = heNormalRHS(B, Kin, Pystar);
 
+    // solve by linear least squares
+    arma::vec he_update = arma::solve(vtv, vty, arma::solve_opts::likely_sympd);
 
-    // direct computation of Ycovar with OpenMP?
-    arma::mat lycovar = PREML * ystar; // n * n
-    arma::mat rycovar = ystar.t() * PREML.t(); // n * n
-    arma::mat Ycovar = lycovar * rycovar;
+    return he_update.tail(u_indices.size());
+}
 
-    // select the upper triangular elements, including the diagonal
-    arma::uvec lower_indices = trimatl_ind(arma::size(Ycovar));
-    arma::vec Ybig = Ycovar(lower_indices);
 
-    // sequentially vectorise ZZ^T - this automatically adds a vectorised identity matrix
-    // for the "residual" variance
-    arma::mat vecZ = vectoriseZ(Z, u_indices, PREML, PZ); // projection already applied
+arma::vec estHasemanElston(const std::vector<arma::uvec>& u_indices, const arma::vec& Pystar,
+                           const arma::mat& PZ){
+    // use HasemanElston regression to estimate variance components
+    // regress the lower triangle of P*y*y^T*P on those of P*Z_k*Z_k^T*P through the
+    // (c+1) X (c+1) normal equations, rather than vectorising the n(n+1)/2 elements
+    // we will also estimate a "residual" variance parameter
+    std::vector<arma::mat> B = heFactors(PZ, u_indices, false);
+    arma::mat vtv = heNormalMatrix(B, arma::mat());
+    arma::vec vty = heNormalRHS(B, arma::mat(), Pystar);
 
     // solve by linear least squares
-    arma::vec he_update(c+1);
+    arma::vec he_update = arma::solve(vtv, vty, arma::solve_opts::likely_sympd);
 
-    he_update = arma::solve(vecZ, Ybig, arma::solve_opts::fast);
-
-    return he_update.tail(c);
+    return he_update.tail(u_indices.size());
 }
 
 
-arma::vec estHasemanElstonML(const arma::mat& Z, const Rcpp::List& u_indices, const arma::vec& ystar){
+arma::vec estHasemanElstonML(const arma::sp_mat& Z, const std::vector<arma::uvec>& u_indices, const arma::vec& ystar){
     // use HasemanElston regression to estimate variance components
-    // vectorize everything
+    // as estHasemanElston, but the factors are just Z_k
     // we will also estimate a "residual" variance parameter
-    unsigned int n = ystar.size();
-    unsigned int c = u_indices.size(); // number of variance components
-    unsigned long nsq = (n * (n + 1)/2); //size of vectorised components using just upper or lower triangle of covariance matrix
-
-    // sparsify just the multiplication steps.
-    arma::mat Ycovar(ystar * ystar.t());
-
-    // select the upper triangular elements, including the diagonal
-    arma::uvec lower_indices = trimatl_ind(arma::size(Ycovar));
-    arma::vec Ybig = Ycovar(lower_indices);
-
-    // sequentially vectorise ZZ^T - this automatically adds a vectorised identity matrix
-    // for the "residual" variance
-    arma::mat vecZ(nsq, c+1);
-    vecZ = vectoriseZML(Z, u_indices); // projection already applied
+    arma::mat Zd(Z);
+    std::vector<arma::mat> B = heFactors(Zd, u_indices, false);
+    arma::mat vtv = heNormalMatrix(B, arma::mat());
+    arma::vec vty = heNormalRHS(B, arma::mat(), ystar);
 
     // solve by linear least squares
-    arma::vec he_update(c+1);
-
-    // use OSL here for starters
-    he_update = arma::solve(vecZ, Ybig, arma::solve_opts::fast);
+    arma::vec he_update = arma::solve(vtv, vty, arma::solve_opts::likely_sympd);
 
-    return he_update.tail(c);
+    return he_update.tail(u_indices.size());
 }
 
 
-arma::vec estHasemanElstonConstrained(const arma::mat& Z, const arma::mat& PREML, const Rcpp::List& u_indices,
-                                      const arma::vec& ystar, arma::vec he_update, const int& Iters,
-                                      const arma::mat& PZ){
+arma::vec estHasemanElstonConstrained(const std::vector<arma::uvec>& u_indices, const arma::vec& Pystar,
+                                      arma::vec he_update, const int& Iters, const arma::mat& PZ){
     // use constrained HasemanElston regression to estimate variance components - using a NNLS estimator
-    // vectorize everything
     // we will also estimate a "residual" variance parameter
     // however, there is no reason this "residual" paramer has to be constrained...
-    unsigned int n = ystar.size();
-    unsigned int c = u_indices.size(); // number of variance components
-    unsigned long nsq = (n * (n + 1)/2); //size of vectorised components using just upper or lower triangle of covariance matrix
+    std::vector<arma::mat> B = heFactors(PZ, u_indices, false);
+    arma::mat vtv = heNormalMatrix(B, arma::mat());
+    arma::vec vty = heNormalRHS(B, arma::mat(), Pystar);
 
-    // is this more expensive than the for-loop approach?
-    arma::mat lycovar = PREML * ystar; // n * n
-    arma::mat rycovar = ystar.t() * PREML.t(); // n * n
-    arma::mat Ycovar = lycovar * rycovar;
-
-    // select the lower triangular elements, including the diagonal?
-    arma::uvec lower_indices = trimatl_ind(arma::size(Ycovar)); // -1 excludes diagonal
-    arma::vec Ybig = Ycovar(lower_indices);
-
-    // sequentially vectorise ZZ^T - this automatically adds a vectorised identity matrix
-    // for the "residual" variance
-    arma::mat vecZ = vectoriseZ(Z, u_indices, PREML, PZ); // projection already applied
-
-    // solve by linear least squares
-    arma::vec _he_update(c+1);
-
-    // use RcppML NNLS (needs casting Eigen <-> arma)
-    // _he_update = solveQP(vecZ, Ybig, _he_update);
-    _he_update = nnlsSolve(vecZ, Ybig, _he_update, Iters);
+    arma::vec _he_update(u_indices.size()+1, arma::fill::zeros);
+    _he_update = nnlsSolveNormal(vtv, vty, _he_update, Iters);
 
     return _he_update;
 }
 
 
-arma::vec estHasemanElstonConstrainedML(const arma::mat& Z, const Rcpp::List& u_indices,
+arma::vec estHasemanElstonConstrainedML(const arma::sp_mat& Z, const std::vector<arma::uvec>& u_indices,
                                         const arma::vec& ystar, arma::vec he_update, const int& Iters){
     // use constrained HasemanElston regression to estimate variance components - using a NNLS estimator
-    // vectorize everything
     // we will also estimate a "residual" variance parameter
     // however, there is no reason this "residual" paramer has to be constrained...
-    unsigned int n = ystar.size();
-    unsigned int c = u_indices.size(); // number of variance components
-    unsigned long nsq = (n * (n + 1)/2); //size of vectorised components using just upper or lower triangle of covariance matrix
-
-    // sparsify just the multiplication steps.
-    arma::mat Ycovar(ystar * ystar.t());
-
-    // select the upper triangular elements, including the diagonal
-    arma::uvec lower_indices = trimatl_ind(arma::size(Ycovar));
-    arma::vec Ybig = Ycovar(lower_indices);
+    arma::mat Zd(Z);
+    std::vector<arma::mat> B = heFactors(Zd, u_indices, false);
+    arma::mat vtv = heNormalMatrix(B, arma::mat());
+    arma::vec vty = heNormalRHS(B, arma::mat(), ystar);
 
-    // sequentially vectorise ZZ^T - this automatically adds a vectorised identity matrix
-    // for the "residual" variance
-    arma::mat vecZ(nsq, c+1);
-    vecZ = vectoriseZML(Z, u_indices); // projection already applied
-
-    // solve by linear least squares
-    arma::vec _he_update(c+1);
-    // _he_update = solveQP(vecZ, Ybig, _he_update);
-    _he_update = nnlsSolve(vecZ, Ybig, _he_update, Iters);
+    arma::vec _he_update(u_indices.size()+1, arma::fill::zeros);
+    _he_update = nnlsSolveNormal(vtv, vty, _he_update, Iters);
 
     return _he_update;
 }
 
 
-arma::vec estHasemanElstonConstrainedGenetic(const arma::mat& Z, const arma::mat& PREML,
-                                             const arma::mat& PZ,
-                                             const Rcpp::List& u_indices,
-                                             const arma::vec& ystar, const arma::mat& Kin,
+arma::vec estHasemanElstonConstrainedGenetic(const arma::mat& PZ, const std::vector<arma::uvec>& u_indices,
+                                             const arma::vec& Pystar, const arma::mat& Kin,
                                              arma::vec he_update, const int& Iters){
     // use constrained HasemanElston regression to estimate variance components - using a NNLS estimator
-    // vectorize everything
     // we will also estimate a "residual" variance parameter
-    unsigned int n = ystar.size();
-    unsigned int c = u_indices.size(); // number of variance components
-    unsigned long nsq = (n * (n + 1)/2); //size of vectorised components using just upper or lower triangle of covariance matrix
-    unsigned int i, j;      // Declare loop variables i and j for OpenMP
+    std::vector<arma::mat> B = heFactors(PZ, u_indices, true);
+    arma::mat vtv = heNormalMatrix(B, Kin);
+    arma::vec vty = heNormalRHS(B, Kin, Pystar);
 
-    // is this more expensive than the for-loop approach?
-    arma::mat lycovar = PREML * ystar; // n * n
-    arma::mat rycovar = ystar.t() * PREML.t(); // n * n
-    arma::mat Ycovar = lycovar * rycovar;
-
-    // select the upper triangular elements, including the diagonal
-    arma::uvec lower_indices = trimatl_ind(arma::size(Ycovar));
-    arma::vec Ybig = Ycovar(lower_indices);
-
-    // sequentially vectorise ZZ^T - this automatically adds a vectorised identity matrix
-    // for the "residual" variance
-    arma::mat vecZ = vectoriseZGenetic(Z, u_indices, PREML, PZ, Kin); // projection already applied
-
-    arma::vec _he_update(c+1);
-    // _he_update = solveQP(vecZ, Ybig, _he_update);
-    _he_update = nnlsSolve(vecZ, Ybig, _he_update, Iters);
+    arma::vec _he_update(u_indices.size()+1, arma::fill::zeros);
+    _he_update = nnlsSolveNormal(vtv, vty, _he_update, Iters);
 
     return _he_update;
 }
 
 
-arma::vec estHasemanElstonConstrainedGeneticML(const arma::mat& Z,
-                                               const Rcpp::List& u_indices,
+arma::vec estHasemanElstonConstrainedGeneticML(const arma::sp_mat& Z,
+                                               const std::vector<arma::uvec>& u_indices,
                                                const arma::vec& ystar, const arma::mat& Kin,
                                                arma::vec he_update, const int& Iters){
     // use constrained HasemanElston regression to estimate variance components - using a NNLS estimator
-    // vectorize everything
     // we will also estimate a "residual" variance parameter
-    unsigned int n = ystar.size();
-    unsigned int c = u_indices.size(); // number of variance components
-    unsigned long nsq = (n * (n + 1)/2); //size of vectorised components using just upper or lower triangle of covariance matrix
-    unsigned int i, j;      // Declare loop variables i and j for OpenMP
+    arma::mat Zd(Z);
+    std::vector<arma::mat> B = heFactors(Zd, u_indices, true);
+    arma::mat vtv = heNormalMatrix(B, Kin);
+    arma::vec vty = heNormalRHS(B, Kin, ystar);
+
+    arma::vec _he_update(u_indices.size()+1, arma::fill::zeros);
+    _he_update = nnlsSolveNormal(vtv, vty, _he_update, Iters);
 
-    // is this more expensive than the for-loop approach?
-    arma::mat Ycovar = ystar * ystar.t();
+    return _he_update;
+}
 
-    // select the upper triangular elements, including the diagonal
-    arma::uvec lower_indices = trimatl_ind(arma::size(Ycovar));
-    arma::vec Ybig = Ycovar(lower_indices);
 
-    // sequentially vectorise ZZ^T - this automatically adds a vectorised identity matrix
-    // for the "residual" variance
-    arma::mat vecZ = vectoriseZGeneticML(Z, u_indices, Kin); // projection already applied
+arma::vec nnlsSolveNormal(const arma::mat& vtv, const arma::vec& vty, arma::vec nnls_update, const int& Iters){
+    // NNLS from the normal equations alone: if V^T V = R^T R then ||V x - Y||^2 = ||R x - R^-T V^T Y||^2 + const,
+    // so the (c+1) X (c+1) problem has the same solution path in nnlsSolve as the full n(n+1)/2 one
+    arma::mat R;
+    arma::vec z;
 
-    arma::vec _he_update(c+1);
-    // _he_update = solveQP(vecZ, Ybig, _he_update);
-    _he_update = nnlsSolve(vecZ, Ybig, _he_update, Iters);
+    if(arma::chol(R, vtv)){
+        z = arma::solve(arma::trimatl(R.t()), vty);
+    } else{
+        // rank deficient - use the symmetric square root, dropping the null space
+        arma::vec eigval;
+        arma::mat eigvec;
+        arma::eig_sym(eigval, eigvec, vtv);
+        double tol = eigval.max() * vtv.n_rows * arma::datum::eps;
+        arma::vec sqrt_eig(eigval.n_elem, arma::fill::zeros);
+        arma::vec inv_sqrt_eig(eigval.n_elem, arma::fill::zeros);
+
+        for(unsigned int i=0; i < eigval.n_elem; i++){
+            if(eigval[i] > tol){
+                sqrt_eig[i] = std::sqrt(eigval[i]);
+                inv_sqrt_eig[i] = 1/sqrt_eig[i];
+            }
+        }
 
-    return _he_update;
+        R = arma::diagmat(sqrt_eig) * eigvec.t();
+        z = arma::diagmat(inv_sqrt_eig) * (eigvec.t() * vty);
+    }
+
+    return nnlsSolve(R, z, nnls_update, Iters);
 }
 
 
@@ -585,305 +554,121 @@ arma::vec nnlsSolve(const arma::mat& vecZ, const arma::vec& Y, arma::vec nnls_up
 }
 
 
-arma::vec fastNnlsSolve(const arma::mat& vecZ, const arma::vec& Y){
-    // This uses the Fast Approximate Solution Trajectory NNLS
-    // from https://stackoverflow.com/questions/58006606/rcpp-implementation-of-fast-nonnegative-least-squares
-
-    // assumes the problem is not ill-conditioned - how realistic is this?
-    // vecZ is almost _never_ square
-    int m = vecZ.n_rows;
-    arma::mat A(m, m);
-    A = vecZ * vecZ.t();
-    arma::vec nnls_update = arma::solve(A, Y,
-                                        arma::solve_opts::likely_sympd + arma::solve_opts::fast);
-
-    while(any(nnls_update < 0)){
-        // define the feasible set P as all estimates > 0
-        arma::uvec nonzero = find(nnls_update > 0);
-
-        // reset estimates
-        nnls_update.zeros();
-
-        // now solve the OLS problem for params in the feasible set
-        nnls_update(nonzero) = arma::solve(vecZ.submat(nonzero, nonzero), Y.elem(nonzero),
-                    arma::solve_opts::likely_sympd + arma::solve_opts::fast);
+double digammaAsymp(double x){
+    // recurrence up to x >= 6, then the asymptotic series
+    double psi = 0.0;
+    while(x < 6.0){
+        psi -= 1.0/x;
+        x += 1.0;
     }
-    return nnls_update;
+    double f = 1.0/(x*x);
+    psi += std::log(x) - 0.5/x - f*(1.0/12 - f*(1.0/120 - f*(1.0/252 - f*(1.0/240 - f/132))));
+    return psi;
 }
 
 
-arma::mat vectoriseZ(const arma::mat& Z, const Rcpp::List& u_indices, const arma::mat& P,
-                     const arma::mat& PZ){
-    // sequentially vectorise the columns ZZ^T that map to each random effect
-    // pre- and post- multiply by the REML projection matrix
-    // make use of pre-computed PZ
-    int c = u_indices.size();
-    int n = Z.n_rows;
-    unsigned long nsq = (n * (n + 1)/2);
-
-    // select the upper triangular elements, including the diagonal
-    arma::uvec lower_indices = arma::trimatl_ind(arma::size(P));
-
-    // do we need an intercept term?
-
-    arma::mat vecMat(nsq, c+1);
-    arma::mat bigI = arma::eye(arma::size(P));
-    vecMat.col(0) = bigI(lower_indices); // vector of 1s for the intercept?
-
-    for(int i=0; i < c; i++){
-        // extract the elements of u_indices
-        arma::uvec u_idx = u_indices(i);
-        arma::mat _pZZT = PZ.cols(u_idx - 1) * Z.cols(u_idx - 1).t() * P.t(); // this will be slow
-
-        arma::vec _vZ = _pZZT(lower_indices);
-        // vecMat.col(i) = _vZ;
-        vecMat.col(i+1) = _vZ;
+double trigammaAsymp(double x){
+    // recurrence up to x >= 6, then the asymptotic series
+    double psi1 = 0.0;
+    while(x < 6.0){
+        psi1 += 1.0/(x*x);
+        x += 1.0;
     }
-
-    return vecMat;
+    double f = 1.0/(x*x);
+    psi1 += 1.0/x + f/2.0 + (f/x)*(1.0/6 - f*(1.0/30 - f*(1.0/42 - f/30)));
+    return psi1;
 }
 
 
-arma::mat vectoriseZML(const arma::mat& Z, const Rcpp::List& u_indices){
-    // sequentially vectorise the columns ZZ^T that map to each random effect
-    // pre- and post- multiply by the REML projection matrix
-    int c = u_indices.size();
-    int n = Z.n_rows;
-    unsigned long nsq = (n * (n + 1)/2);
-
-    // select the upper triangular elements, including the diagonal
-    arma::uvec lower_indices = arma::trimatl_ind(arma::size(n, n));
-    arma::mat vecMat(nsq, c+1);
-    // arma::mat vecMat(nsq, c);
-    // vecMat.col(0) = arma::ones(nsq); // vector of 1s for the intercept?
-    arma::mat bigI = arma::eye(arma::size(n , n));
-    vecMat.col(0) = bigI(lower_indices); // vector of 1s for the intercept?
+double phiNewton(double disp, double lower, double upper, const arma::vec& mu, const arma::vec& y){
+    // maximise the NB log-likelihood of nbLogLik over [lower, upper], with Newton steps on its score
+    // the normal likelihood and lgamma(y+1) don't depend on phi, so each step is a single pass over mu and y:
+    // score = sum(-y/(mu+phi) + phi(2mu+phi)/(mu+phi)^2) - n digamma(phi)
+    // curvature = sum(y/(mu+phi)^2 + 2mu^2/(mu+phi)^3) - n trigamma(phi)
+    // steps that leave the bracket, or where the curvature isn't negative, fall back to bisection on the sign of the score
+    const double n = y.n_elem;
+    const double tol = 1e-8;
+    const int maxit = 100;
 
-    for(int i=0; i < c; i++){
-        // extract the elements of u_indices
-        arma::uvec u_idx = u_indices(i);
-        arma::mat _ZZT = (Z.cols(u_idx - 1) * Z.cols(u_idx - 1).t());
-
-        // vectorise
-        arma::vec _vecZ = _ZZT(lower_indices);
-        vecMat.col(i+1) = _vecZ;
-        // vecMat.col(i) = _vecZ;
+    if(upper <= lower){
+        return lower;
     }
 
-    return vecMat;
-}
+    auto score = [&](double phi) -> double {
+        arma::vec _inv = 1/(mu + phi);
+        return arma::accu(-y % _inv + phi * (2*mu + phi) % arma::square(_inv)) - n * digammaAsymp(phi);
+    };
 
-
-arma::mat vectoriseZGenetic(const arma::mat& Z, const Rcpp::List& u_indices,
-                            const arma::mat& P, const arma::mat& PZ,
-                            const arma::mat& Kin){
-    // sequentially vectorise the columns ZZ^T that map to each random effect
-    // pre- and post- multiply by the REML projection matrix
-    // this needs to use PZ
-    int c = u_indices.size();
-    int n = Z.n_rows;
-    // unsigned long nsq = pow(static_cast<float>(n), 2);
-    unsigned long nsq = (n * (n + 1)/2); // remove the n diagonal elements
-
-    // select the upper triangular elements, including the diagonal
-    arma::uvec lower_indices = arma::trimatl_ind(arma::size(P));
-    arma::mat vecMat(nsq, c+1);
-    // arma::mat vecMat(nsq, c);
-    // vecMat.col(0) = arma::ones(nsq); // vector of 1s for the intercept?
-    arma::mat bigI = arma::eye(arma::size(P));
-    vecMat.col(0) = bigI(lower_indices); // vector of 1s for the intercept?
-
-    for(int i=0; i < c; i++){
-        // extract the elements of u_indices
-        arma::uvec u_idx = u_indices(i);
-
-        // always set the last component to the genetic variance if there is a kinship matrix
-        if(i == c-1){
-            arma::vec _vecZ = Kin(lower_indices);
-            vecMat.col(i+1) = _vecZ;
-            // vecMat.col(i) = _vecZ;
-        } else{
-            // compute Z_i Z_i^T
-            arma::mat _ZZT = PZ.cols(u_idx - 1) * Z.cols(u_idx - 1).t() * P.t(); // REML projection
-
-            // vectorise
-            arma::vec _vecZ = _ZZT(lower_indices);
-            vecMat.col(i+1) = _vecZ;
-            // vecMat.col(i) = _vecZ;
-        }
+    // the maximum is on a boundary if the score doesn't change sign
+    if(score(lower) <= 0.0){
+        return lower;
     }
 
-    return vecMat;
-}
-
-arma::mat vectoriseZGeneticML(const arma::mat& Z, const Rcpp::List& u_indices,
-                              const arma::mat& Kin){
-    // sequentially vectorise the columns ZZ^T that map to each random effect
-    // pre- and post- multiply by the REML projection matrix
-    // this needs to use PZ
-    int c = u_indices.size();
-    int n = Z.n_rows;
-    // unsigned long nsq = pow(static_cast<float>(n), 2);
-    unsigned long nsq = (n * (n + 1)/2); // remove the n diagonal elements
-
-    // select the upper triangular elements, including the diagonal
-    arma::uvec lower_indices = arma::trimatl_ind(arma::size(Kin));
-    arma::mat vecMat(nsq, c+1);
-    // arma::mat vecMat(nsq, c);
-    // vecMat.col(0) = arma::ones(nsq); // vector of 1s for the intercept?
-    arma::mat bigI = arma::eye(arma::size(Kin));
-    vecMat.col(0) = bigI(lower_indices); // vector of 1s for the intercept?
-
-    for(int i=0; i < c; i++){
-        // extract the elements of u_indices
-        arma::uvec u_idx = u_indices(i);
-
-        // always set the last component to the genetic variance if there is a kinship matrix
-        if(i == c-1){
-            arma::vec _vecZ = Kin(lower_indices);
-            vecMat.col(i+1) = _vecZ;
-            // vecMat.col(i) = _vecZ;
-        } else{
-            // compute Z_i Z_i^T
-            arma::mat _ZZT = Z.cols(u_idx - 1) * Z.cols(u_idx - 1).t();
-
-            // vectorise
-            arma::vec _vecZ = _ZZT(lower_indices);
-            vecMat.col(i+1) = _vecZ;
-            // vecMat.col(i) = _vecZ;
-        }
+    if(score(upper) >= 0.0){
+        return upper;
     }
 
-    return vecMat;
-}
-
-
-double phiLineSearch(double disp, double lower, double upper, const int& c,
-                     const arma::vec& mu, const arma::mat& Ginv, double pi,
-                     const arma::vec& curr_u, const arma::vec& sigma,
-                     const arma::vec& y){
-    // perform a bisection search for dispersion
-    // evaluate the loglihood at each bound
-    arma::mat littleG(c, c, arma::fill::zeros);
-
-    for(int i=0; i<c; i++){
-        littleG(i, i) = sigma(i);
+    double phi = std::min(std::max(disp, lower), upper);
+    if(phi <= lower || phi >= upper){
+        phi = (lower + upper)/2.0;
     }
 
-    double normlihood = normLogLik(c, Ginv, littleG, curr_u, pi);
-    double half_logli = nbLogLik(mu, disp/2.0, y) - normlihood;
-    double up_logli = nbLogLik(mu, lower, y) - normlihood;
-    double lo_logli = nbLogLik(mu, upper, y) - normlihood;
-    double new_disp = 0.0;
-
-    bool comp_vals = false;
+    for(int i=0; i < maxit; i++){
+        arma::vec _inv = 1/(mu + phi);
+        arma::vec _inv2 = arma::square(_inv);
+        double _score = arma::accu(-y % _inv + phi * (2*mu + phi) % _inv2) - n * digammaAsymp(phi);
+        double _curv = arma::accu(y % _inv2 + 2 * arma::square(mu) % _inv2 % _inv) - n * trigammaAsymp(phi);
 
-    if(lo_logli < up_logli){
-        new_disp = lower;
-    } else{
-        new_disp = upper;
-    }
-
-    return new_disp;
-}
-
-
-double phiGoldenSearch(double disp, double lower, double upper, const int& c,
-                       const arma::vec& mu, const arma::mat& Ginv, double pi,
-                       const arma::vec& curr_u, const arma::vec& sigma,
-                       const arma::vec& y){
-
-    // perform a golden section search
-    // function inspired by https://drlvk.github.io/nm/section-golden-section.html
-    // this only requires a single call to this function
-
-    double tol = 1e-2; // tolerance for phi
-    double r = (3 - std::sqrt(5))/2.0;
-    double pc = lower + r*(upper - lower);
-    double pd = upper - r*(upper - lower);
-
-    // make non-broadcast G matrix
-    arma::mat littleG(c, c, arma::fill::zeros);
+        if(_score > 0.0){
+            lower = phi;
+        } else{
+            upper = phi;
+        }
 
-    for(int i=0; i<c; i++){
-        littleG(i, i) = sigma(i);
-    }
+        double phi_new = _curv < 0.0 ? phi - _score/_curv : lower - 1.0;
+        if(phi_new <= lower || phi_new >= upper){
+            phi_new = (lower + upper)/2.0;
+        }
 
-    // evaluate normal likelihood - should this be the pseudo-likelihood instead?
-    double normlihood = normLogLik(c, Ginv, littleG, curr_u, pi);
-
-    // evaluate NB liklihood
-    double c_logli = nbLogLik(mu, pc, y) - normlihood;
-    double d_logli = nbLogLik(mu, pd, y) - normlihood;
-
-    // iteratively choose either c or d and discard anything to the
-    // left or right, respectively.
-    while((upper - lower) >= tol){
-        if(c_logli > d_logli){
-            upper = pd;
-            pd = pc;
-            d_logli = c_logli;
-            pc = lower + r*(upper - lower);
-            c_logli =  nbLogLik(mu, pc, y) - normlihood;
-        } else{
-            lower = pc;
-            pc = pd;
-            c_logli = d_logli;
-            pd = upper - r*(upper - lower);
-            d_logli = nbLogLik(mu, pd, y) - normlihood;
+        bool _conv = std::abs(phi_new - phi) < tol * (1.0 + phi);
+        phi = phi_new;
+        if(_conv){
+            break;
         }
     }
 
-    // return the mid-point between [c, d]
-    double new_disp = (pc + pd)/2.0;
-    return new_disp;
+    return phi;
 }
 
 
-double phiMME(const arma::vec& y, const arma::vec& curr_sigma){
-    // use the pseudovariance and method of moments
-    double ps_bar = arma::var(y);
-    double y_bar = arma::mean(y);
-    double sigma_sum = arma::sum(y);
-    double denom = 1e-2;
-    double disp_mme = 1e-2;
-
-    denom = ps_bar - y_bar - sigma_sum;
-    // check for near zero denom that could blow
-    // up the estimate
-    if(denom < 1e-2){
-        disp_mme = 1e-2;
-    } else{
-        disp_mme = 1/denom;
-    }
-
-    return disp_mme;
+double nbLogLik(const arma::vec& mu, double phi, const arma::vec& y){
+    return nbLogLik(mu, phi, y, arma::accu(arma::lgamma(y+1)));
 }
 
 
-
-double nbLogLik(const arma::vec& mu, double phi, const arma::vec& y){
+double nbLogLik(const arma::vec& mu, double phi, const arma::vec& y, double lgamma_y1){
+    // lgamma_y1 is sum(lgamma(y + 1)), which is fixed for a given y
     double logli = 0.0;
     arma::vec logli_indiv(y.n_rows);
     arma::vec muphi(y.n_rows);
     muphi = mu/(mu + phi);
 
     // element wise multiplication of y and other equation elements
-    logli_indiv = y % arma::log(mu/(mu + phi)) + (phi * (1 - (mu/(mu+phi)))) + (arma::lgamma(y+1) - std::lgamma(phi));
+    logli_indiv = y % arma::log(muphi) + (phi * (1 - muphi)) - std::lgamma(phi);
 
-    logli = arma::sum(logli_indiv);
+    logli = arma::sum(logli_indiv) + lgamma_y1;
     return logli;
 }
 
 
-double normLogLik(const int& c, const arma::mat& Ginv, const arma::mat& G,
+double normLogLik(const int& c, const StructuredG& G, const arma::vec& sigma,
                   const arma::vec& curr_u, double pi){
+    // the determinant is of the non-broadcast c X c G, which is just the product of the sigmas - summed on the
+    // log scale so that it can't under- or overflow
     double cdouble = (double)c;
-    double detG = arma::det(G);
-    double logdet = std::log(detG);
+    double logdet = arma::accu(arma::log(sigma));
 
-    arma::vec normlog_indiv = ((cdouble/2.0) * std::log(2*pi)) - (0.5 * logdet) - (0.5 * (curr_u.t() * Ginv * curr_u));
-    double normlihood = arma::sum(normlog_indiv);
+    double normlihood = ((cdouble/2.0) * std::log(2*pi)) - (0.5 * logdet) - (0.5 * G.quadInv(curr_u));
 
     return normlihood;
 }
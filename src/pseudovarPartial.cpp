@@ -1,8 +1,14 @@
-#include<RcppArmadillo.h>
+#include "milorArma.h"
 // [[Rcpp::depends(RcppArmadillo)]]
 #include "pseudovarPartial.h"
+#include "computeMatrices.h"
+#include "mixedPrecision.h"
+#ifndef MILOR_STANDALONE
 using namespace Rcpp;
+#endif
 
+#ifndef MILOR_STANDALONE
+// the dense R list partials are only used from R
 List pseudovarPartial(arma::mat x, List rlevels, StringVector cnames){
     // this currently doesn't support sparse matrices - it's not super clear how to do
     // that concretely without defining some sparse matrix class somewhere along the line
@@ -23,74 +29,57 @@ List pseudovarPartial(arma::mat x, List rlevels, StringVector cnames){
 
     return outlist;
 }
+#endif
 
 
-List pseudovarPartial_C(arma::mat Z, List u_indices){
+std::vector<arma::mat> pseudovarPartial_C(const arma::sp_mat& Z, const std::vector<arma::uvec>& u_indices){
     // A Rcpp specific implementation that uses positional indexing rather than character indexes
     unsigned int items = u_indices.size();
-    List outlist(items);
+    std::vector<arma::mat> outlist(items);
 
     for(unsigned int i = 0; i < items; i++){
-        arma::uvec icols = u_indices[i];
-
-        arma::mat omat(Z.cols(icols - 1) * Z.cols(icols - 1).t());
-        outlist[i] = omat;
+        arma::sp_mat Zi = subsetSpCols(Z, u_indices[i] - 1);
+        outlist[i] = arma::mat(Zi * Zi.t());
     }
 
     return outlist;
 }
 
 
-List computePZList(const List& u_indices, const arma::mat& PZ, const arma::mat& P,
-                   const arma::mat& Z, const std::string& solver){
-    // compute the PZ(j) * Z(j)^T * P^T and intermediates
+void computePZList(const std::vector<arma::uvec>& u_indices, const arma::mat& PZ, std::vector<arma::mat>& pz_list){
+    // P * dV/dsigma_j = PZ(j) * Z(j)^T is never formed - keep just the n X q_j block PZ(j)
+    // pz_list is written in place, so its matrices keep their memory across iterations
     unsigned int c = u_indices.size();
-    List pzz_list(c);
-    List pzzp_list(c);
-
-    for(int i=0; i < c; i++){
-        arma::uvec u_idx = u_indices[i];
-        arma::mat _pzz = PZ.cols(u_idx-1) * Z.cols(u_idx-1).t(); // convert 1-based to 0-based
-        pzz_list[i] = _pzz;
-        if(solver == "HE" || solver == "HE-NNLS"){
-            pzzp_list[i] = _pzz * P.t();
-        }
-    }
+    pz_list.resize(c);
 
-    return List::create(Named("PZZt") = pzz_list,
-                        Named("PZZtP") = pzzp_list);
+    for(unsigned int i=0; i < c; i++){
+        const arma::uvec& u_idx = u_indices[i];
+        pz_list[i] = PZ.cols(u_idx-1); // convert 1-based to 0-based
+    }
 }
 
 
-List computePZList_G(const List& u_indices, const arma::mat& PZ, const arma::mat& P,
-                     const arma::mat& Z, const std::string& solver, const arma::mat& K){
-    // compute the PZ(j) * Z(j)^T * P^T and intermediates
+void computePZList_G(const std::vector<arma::uvec>& u_indices, const arma::mat& PZ,
+                     const arma::mat& K, const arma::fmat& Kf, std::vector<arma::mat>& pz_list){
+    // as computePZList, but the last component is PZ(j) * K so that P * dV/dsigma_j = PZ(j) * K * Z(j)^T
+    // Kf is a single precision copy of K for mixed precision, otherwise empty
     unsigned int c = u_indices.size();
-    unsigned int n = Z.n_rows;
-    List pzz_list(c);
-    List pzzp_list(c);
+    pz_list.resize(c);
 
-    for(int i=0; i < c; i++){
-        arma::uvec u_idx = u_indices[i];
-        arma::mat _pzz(n, n);
+    for(unsigned int i=0; i < c; i++){
+        const arma::uvec& u_idx = u_indices[i];
 
         if(i == c - 1){
-            _pzz = PZ.cols(u_idx-1) * K * Z.cols(u_idx-1).t(); // convert 1-based to 0-based
+            // convert 1-based to 0-based
+            pz_list[i] = Kf.is_empty() ? arma::mat(PZ.cols(u_idx-1) * K) : singleProduct(arma::mat(PZ.cols(u_idx-1)), Kf);
         } else{
-            _pzz = PZ.cols(u_idx-1) * Z.cols(u_idx-1).t(); // convert 1-based to 0-based
-        }
-
-        pzz_list[i] = _pzz;
-        if(solver == "HE" || solver == "HE-NNLS"){
-            pzzp_list[i] = _pzz * P.t();
+            pz_list[i] = PZ.cols(u_idx-1); // convert 1-based to 0-based
         }
     }
-
-    return List::create(Named("PZZt") = pzz_list,
-                        Named("PZZtP") = pzzp_list);
 }
 
 
+#ifndef MILOR_STANDALONE
 List pseudovarPartial_P(List V_partial, const arma::mat& P){
     // A Rcpp specific implementation that uses positional indexing rather than character indexes
     // don't be tempted to sparsify this - the overhead of casting is too expensive
@@ -123,73 +112,57 @@ List pseudovarPartial_P(List V_partial, const arma::mat& P){
     return outlist;
 
 }
+#endif
 
 
-List pseudovarPartial_V(const List& u_indices, const arma::mat& Z, const arma::mat& VstarZ){
-    // A Rcpp specific implementation that uses positional indexing rather than character indexes
-    // don't be tempted to sparsify this - the overhead of casting is too expensive
-    unsigned int items = u_indices.size();
-    List outlist(items);
+std::vector<arma::mat> pseudovarPartialApply(const arma::sp_mat& Z, const std::vector<arma::uvec>& u_indices,
+                                             const arma::mat& x){
+    // dV/dsigma_j * x = Z(j) * Z(j)^T * x for each component - n X k without forming the n X n partial
+    unsigned int c = u_indices.size();
+    std::vector<arma::mat> outlist(c);
 
-    for(unsigned int i = 0; i < items; i++){
-        // Need to output an S4 object - arma::sp_mat uses implicit interconversion for support dg Matrices
-        arma::uvec u_idx = u_indices[i];
-        arma::mat omat = VstarZ.cols(u_idx-1) * Z.cols(u_idx-1).t();
-        outlist[i] = omat;
+    for(unsigned int i=0; i < c; i++){
+        arma::sp_mat Zi = subsetSpCols(Z, u_indices[i] - 1);
+        outlist[i] = Zi * arma::mat(Zi.t() * x);
     }
 
     return outlist;
-
 }
 
 
-List pseudovarPartial_VG(const List& u_indices, const arma::mat& Z, const arma::mat& VstarZ,
-                         const arma::mat& K){
-    // A Rcpp specific implementation that uses positional indexing rather than character indexes
-    // don't be tempted to sparsify this - the overhead of casting is too expensive
+std::vector<arma::mat> pseudovarPartialApply_G(const arma::sp_mat& Z, const std::vector<arma::uvec>& u_indices,
+                                               const arma::mat& x, const arma::mat& K){
+    // as pseudovarPartialApply, but the last component is Z(j) * K * Z(j)^T * x
     unsigned int c = u_indices.size();
-    unsigned int n = Z.n_rows;
-    List outlist(c);
+    std::vector<arma::mat> outlist(c);
 
-    for(unsigned int i = 0; i < c; i++){
-        // Need to output an S4 object - arma::sp_mat uses implicit interconversion for support dg Matrices
-        arma::uvec u_idx = u_indices[i];
-        arma::mat omat(n , n);
+    for(unsigned int i=0; i < c; i++){
+        arma::sp_mat Zi = subsetSpCols(Z, u_indices[i] - 1);
 
         if(i == c - 1){
-            omat = VstarZ.cols(u_idx-1) * K * Z.cols(u_idx-1);
+            outlist[i] = Zi * (K * arma::mat(Zi.t() * x));
         } else{
-            omat = VstarZ.cols(u_idx-1) * Z.cols(u_idx-1);
+            outlist[i] = Zi * arma::mat(Zi.t() * x);
         }
-
-
-
-        outlist[i] = omat;
     }
 
     return outlist;
-
 }
 
 
-List pseudovarPartial_G(arma::mat Z, const arma::mat& K, List u_indices){
-    // A Rcpp specific implementation that uses positional indexing rather than character indexes
-    unsigned int items = u_indices.size();
-    List outlist(items);
+void kinshipBlock(const arma::uvec& u_idx, const arma::mat& K, const arma::fmat& Kf, arma::mat& ZtB){
+    // right multiply the kinship columns of Z^T * B by K, such that the block is Z^T * B_c with B_c = A * Z_c * K
+    // Kf is a single precision copy of K for mixed precision, otherwise empty
+    const arma::uvec _idx = u_idx - 1;
+    arma::mat _block = ZtB.cols(_idx);
+    ZtB.cols(_idx) = Kf.is_empty() ? arma::mat(_block * K) : singleProduct(_block, Kf);
+}
 
-    for(unsigned int i = 0; i < items; i++){
-        if(i == items - 1){
-            arma::uvec icols = u_indices[i];
-            arma::mat _omat(Z.cols(icols - 1) * K * Z.cols(icols - 1).t());
-            outlist[i] = _omat; // K is equivalent to ZZ^T
-        } else{
-            arma::uvec icols = u_indices[i];
-            // Need to output an S4 object - arma::sp_mat uses implicit interconversion for support dg Matrices
-            arma::mat _omat(Z.cols(icols - 1) * Z.cols(icols - 1).t());
-            outlist[i] = _omat;
-        }
-    }
 
-    return outlist;
+double lowRankTrace(const arma::mat& ZtB, const std::vector<arma::uvec>& u_indices, const int& i, const int& j){
+    // tr(B_i Z_i^T B_j Z_j^T) = tr((Z_j^T B_i) (Z_i^T B_j)) - the (j, i) and (i, j) blocks of the stot X stot Z^T B
+    const arma::uvec _i_idx = u_indices[i] - 1;
+    const arma::uvec _j_idx = u_indices[j] - 1;
 
+    return arma::accu(ZtB.submat(_j_idx, _i_idx) % ZtB.submat(_i_idx, _j_idx).t());
 }
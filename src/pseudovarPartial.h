@@ -1,18 +1,22 @@
 #ifndef PSEUDOVARPARTIAL_H
 #define PSEUDOVARPARTIAL_H
 
-#include<RcppArmadillo.h>
+#include "milorArma.h"
 // [[Rcpp::depends(RcppArmadillo)]]
 
+#ifndef MILOR_STANDALONE
 Rcpp::List pseudovarPartial(arma::mat x, Rcpp::List rlevels, Rcpp::StringVector cnames);
-Rcpp::List pseudovarPartial_C(arma::mat Z, Rcpp::List u_indices);
-Rcpp::List pseudovarPartial_G(arma::mat Z, const arma::mat& G, Rcpp::List u_indices);
 Rcpp::List pseudovarPartial_P(Rcpp::List V_partial, const arma::mat& P);
-Rcpp::List pseudovarPartial_V(const Rcpp::List& u_indices, const arma::mat& Z, const arma::mat& VstarZ);
-Rcpp::List pseudovarPartial_VG(const Rcpp::List& u_indices, const arma::mat& Z, const arma::mat& VstarZ,
-                               const arma::mat& K);
-Rcpp::List computePZList(const Rcpp::List& u_indices, const arma::mat& PZ, const arma::mat& P,
-                         const arma::mat& Z, const std::string& solver);
-Rcpp::List computePZList_G(const Rcpp::List& u_indices, const arma::mat& PZ, const arma::mat& P,
-                           const arma::mat& Z, const std::string& solver, const arma::mat& K);
+#endif
+std::vector<arma::mat> pseudovarPartial_C(const arma::sp_mat& Z, const std::vector<arma::uvec>& u_indices);
+// the n X q_j partials are written into the last argument, such that per-fit buffers are re-used
+void computePZList(const std::vector<arma::uvec>& u_indices, const arma::mat& PZ, std::vector<arma::mat>& pz_list);
+void computePZList_G(const std::vector<arma::uvec>& u_indices, const arma::mat& PZ,
+                     const arma::mat& K, const arma::fmat& Kf, std::vector<arma::mat>& pz_list);
+std::vector<arma::mat> pseudovarPartialApply(const arma::sp_mat& Z, const std::vector<arma::uvec>& u_indices,
+                                             const arma::mat& x);
+std::vector<arma::mat> pseudovarPartialApply_G(const arma::sp_mat& Z, const std::vector<arma::uvec>& u_indices,
+                                               const arma::mat& x, const arma::mat& K);
+void kinshipBlock(const arma::uvec& u_idx, const arma::mat& K, const arma::fmat& Kf, arma::mat& ZtB);
+double lowRankTrace(const arma::mat& ZtB, const std::vector<arma::uvec>& u_indices, const int& i, const int& j);
 #endif
@@ -0,0 +1,103 @@
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+#include "structuredG.h"
+
+StructuredG::StructuredG() : stot(0), kin_sigma(0.0), K(nullptr), Kinv(nullptr){
+}
+
+
+StructuredG::StructuredG(const std::vector<arma::uvec>& u_indices, const arma::vec& sigmas) :
+    kin_sigma(0.0), K(nullptr), Kinv(nullptr){
+    // all components are independent, so G is diagonal
+    fillLevels(u_indices, sigmas, u_indices.size());
+}
+
+
+StructuredG::StructuredG(const std::vector<arma::uvec>& u_indices, const arma::vec& sigmas,
+                         const arma::mat& Kin, const arma::mat& Kin_inv) : K(&Kin), Kinv(&Kin_inv){
+    // the "genetic" sigma is always last
+    const int c = u_indices.size();
+    fillLevels(u_indices, sigmas, c - 1);
+
+    kin_idx = u_indices[c-1] - 1;
+    kin_sigma = sigmas(c-1);
+
+    if(kin_idx.n_elem != Kin.n_cols){
+        throw std::runtime_error("RE indices and dimensions of covariance do not match");
+    }
+}
+
+
+void StructuredG::fillLevels(const std::vector<arma::uvec>& u_indices, const arma::vec& sigmas, int ndiag){
+    // broadcast the first ndiag sigmas to their levels - u_indices are 1-based
+    const int c = u_indices.size();
+    stot = 0;
+    for(int i=0; i < c; i++){
+        stot += u_indices[i].n_elem;
+    }
+
+    gdiag.zeros(stot);
+    ginvdiag.zeros(stot);
+    for(int i=0; i < ndiag; i++){
+        arma::uvec _idx = u_indices[i] - 1;
+        gdiag.elem(_idx).fill(sigmas(i));
+        ginvdiag.elem(_idx).fill(1/sigmas(i)); // doesn't handle 0's
+    }
+}
+
+
+arma::mat StructuredG::apply(const arma::mat& x) const{
+    arma::mat out = x.each_col() % gdiag;
+    if(!kin_idx.is_empty()){
+        out.rows(kin_idx) = kin_sigma * ((*K) * x.rows(kin_idx));
+    }
+
+    return out;
+}
+
+
+arma::mat StructuredG::solve(const arma::mat& x) const{
+    arma::mat out = x.each_col() % ginvdiag;
+    if(!kin_idx.is_empty()){
+        out.rows(kin_idx) = ((*Kinv) * x.rows(kin_idx))/kin_sigma;
+    }
+
+    return out;
+}
+
+
+double StructuredG::quadInv(const arma::vec& u) const{
+    return arma::dot(u, solve(u));
+}
+
+
+void StructuredG::addInverse(arma::mat& M, double scale) const{
+    // only touches the diagonal and the kinship block
+    M.diag() += scale * ginvdiag;
+    if(!kin_idx.is_empty()){
+        M.submat(kin_idx, kin_idx) += (scale/kin_sigma) * (*Kinv);
+    }
+}
+
+
+arma::mat StructuredG::dense() const{
+    arma::mat G(arma::diagmat(gdiag));
+    if(!kin_idx.is_empty()){
+        G.submat(kin_idx, kin_idx) = kin_sigma * (*K);
+    }
+
+    return G;
+}
+
+
+arma::mat StructuredG::denseInverse() const{
+    arma::mat Ginv(stot, stot, arma::fill::zeros);
+    addInverse(Ginv, 1.0);
+
+    return Ginv;
+}
+
+
+int StructuredG::n_levels() const{
+    return stot;
+}
@@ -0,0 +1,34 @@
+#ifndef STRUCTUREDG_H
+#define STRUCTUREDG_H
+
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+
+// G = diag(sigma_1 I_q1, ..., sigma_c I_qc), with an optional final sigma_c * K block for a kinship matrix
+// only the per-level variances are stored - K and K^-1 are held by pointer so must outlive the object
+class StructuredG {
+public:
+    StructuredG();
+    StructuredG(const std::vector<arma::uvec>& u_indices, const arma::vec& sigmas);
+    StructuredG(const std::vector<arma::uvec>& u_indices, const arma::vec& sigmas,
+                const arma::mat& Kin, const arma::mat& Kin_inv);
+    arma::mat apply(const arma::mat& x) const; // G * x
+    arma::mat solve(const arma::mat& x) const; // G^-1 * x
+    double quadInv(const arma::vec& u) const; // u^T * G^-1 * u
+    void addInverse(arma::mat& M, double scale) const; // M += scale * G^-1
+    arma::mat dense() const;
+    arma::mat denseInverse() const;
+    int n_levels() const;
+
+private:
+    int stot;
+    arma::vec gdiag; // variance of each level, 0 for the kinship levels
+    arma::vec ginvdiag; // 1/variance of each level, 0 for the kinship levels
+    arma::uvec kin_idx; // 0-based levels of the kinship block - empty without a kinship matrix
+    double kin_sigma;
+    const arma::mat* K;
+    const arma::mat* Kinv;
+    void fillLevels(const std::vector<arma::uvec>& u_indices, const arma::vec& sigmas, int ndiag);
+};
+
+#endif
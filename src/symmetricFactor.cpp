@@ -0,0 +1,208 @@
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+#include<cmath>
+#include "symmetricFactor.h"
+#include "mixedPrecision.h"
+
+SymmetricFactor::SymmetricFactor() : n(0), r(0), is_pivoted(false), is_single(false), sweeps(0){
+}
+
+
+SymmetricFactor::SymmetricFactor(const arma::mat& A, bool single) : n(A.n_rows), r(A.n_rows), is_pivoted(false),
+    is_single(false), sweeps(0){
+    // only the upper triangle is used, so tiny asymmetries from the products that form A don't matter
+    factorise(arma::symmatu(A), single);
+}
+
+
+SymmetricFactor::SymmetricFactor(const arma::mat& A, const SymmetricFactor& previous, double tol, bool single) :
+    n(A.n_rows), r(A.n_rows), is_pivoted(false), is_single(false), sweeps(0){
+    arma::mat _symA = arma::symmatu(A);
+    std::shared_ptr<const SymmetricFactor> _base = previous.fullFactor();
+
+    if(_base && _base->n_rows() == n && n > 0 && !_base->pivoted()){
+        // B^-1 A z - z = B^-1 (A - B) z, so 2 solves with the old factor give a lower bound on the contraction
+        // of the refinement - the refinement itself still checks for convergence and falls back if it stalls
+        arma::mat z(n, 2, arma::fill::ones);
+        for(int i=1; i < n; i += 2){
+            z(i, 1) = -1.0;
+        }
+
+        arma::mat _err = _base->solve(_symA * z) - z;
+        double contraction = arma::max(arma::sqrt(arma::sum(arma::square(_err), 0))/std::sqrt((double)n));
+        if(contraction <= tol){
+            // the error shrinks by the contraction each sweep, from O(1) to the double precision backward error
+            base = _base;
+            symA = _symA;
+            sweeps = contraction > 0 ? (int)std::ceil(std::log(arma::datum::eps)/std::log(contraction)) : 1;
+            return;
+        }
+    }
+
+    factorise(_symA, single);
+}
+
+
+void SymmetricFactor::factorise(const arma::mat& A, bool single){
+    if(single && singleCholesky(Rf, A)){
+        is_single = true;
+        symA = A;
+    } else{
+        doubleCholesky(A);
+    }
+}
+
+
+void SymmetricFactor::doubleCholesky(const arma::mat& A){
+    if(!arma::chol(R, A)){
+        pivotedCholesky(A);
+    }
+}
+
+
+void SymmetricFactor::pivotedCholesky(const arma::mat& A){
+    // outer product Cholesky that always eliminates the largest remaining diagonal element of the Schur complement,
+    // and stops once this is numerically 0 - the same pivoting rule and tolerance as LAPACK's dpstrf
+    is_pivoted = true;
+    piv = arma::regspace<arma::uvec>(0, n - 1);
+    R.zeros(n, n);
+    r = 0;
+
+    if(n == 0){
+        return;
+    }
+
+    arma::mat S(A); // the Schur complement of the eliminated pivots
+    const double tol = n * arma::datum::eps * std::max(S.diag().max(), 0.0);
+
+    for(int k=0; k < n; k++){
+        arma::uword j = k + S.diag().subvec(k, n - 1).index_max();
+        if(S(j, j) <= tol){
+            break;
+        }
+
+        if(j != (arma::uword)k){
+            S.swap_rows(k, j);
+            S.swap_cols(k, j);
+            R.swap_cols(k, j);
+            std::swap(piv[k], piv[j]);
+        }
+
+        double rkk = std::sqrt(S(k, k));
+        R(k, k) = rkk;
+        if(k < n - 1){
+            arma::rowvec rk = S(k, arma::span(k + 1, n - 1))/rkk;
+            R(k, arma::span(k + 1, n - 1)) = rk;
+            S(arma::span(k + 1, n - 1), arma::span(k + 1, n - 1)) -= rk.t() * rk;
+        }
+        r = k + 1;
+    }
+}
+
+
+std::shared_ptr<const SymmetricFactor> SymmetricFactor::fullFactor() const{
+    // the factorisation that a later matrix can re-use - never a chain of re-used factors
+    if(fallback){
+        return fallback;
+    }
+
+    if(base){
+        return base;
+    }
+
+    if(n == 0){
+        return nullptr;
+    }
+
+    return std::make_shared<SymmetricFactor>(*this);
+}
+
+
+arma::mat SymmetricFactor::refinedSolve(const arma::mat& b) const{
+    // x = B^-1 b from the float or re-used factor, then x += B^-1 (b - A x) with the residuals in double until the
+    // backward error is at the level of a double precision solve - the same test and iteration limit as dsposv
+    const int maxrefine = 30;
+    const double tol = std::sqrt((double)n) * arma::datum::eps * arma::norm(symA, "inf");
+
+    arma::mat x = is_single ? singleCholSolve(Rf, b) : base->solve(b);
+
+    for(int i=0; i <= maxrefine; i++){
+        arma::mat res = b - symA * x;
+        arma::rowvec _rnorm = arma::max(arma::abs(res), 0);
+        arma::rowvec _xnorm = arma::max(arma::abs(x), 0);
+        if(arma::all(_rnorm <= tol * _xnorm)){
+            return x;
+        }
+
+        if(i < maxrefine){
+            x += is_single ? singleCholSolve(Rf, res) : base->solve(res);
+        }
+    }
+
+    // A is too ill-conditioned for the float factor, or too far from the re-used factor, to converge
+    if(!fallback){
+        fallback = std::make_shared<SymmetricFactor>(symA);
+    }
+
+    return fallback->solve(b);
+}
+
+
+arma::mat SymmetricFactor::solve(const arma::mat& b) const{
+    if(fallback){
+        return fallback->solve(b);
+    }
+
+    if(base && b.n_cols * sweeps >= n/3.0){
+        // refining every column would cost more than factorising A itself
+        fallback = std::make_shared<SymmetricFactor>(symA);
+        return fallback->solve(b);
+    }
+
+    if(is_single || base){
+        return refinedSolve(b);
+    }
+
+    if(!is_pivoted){
+        arma::mat _tmp = arma::solve(arma::trimatl(R.t()), b);
+        return arma::solve(arma::trimatu(R), _tmp);
+    }
+
+    arma::mat x(n, b.n_cols, arma::fill::zeros);
+    if(r == 0){
+        return x;
+    }
+
+    // solve the leading r X r system in the pivoted order, the remaining elements stay at 0
+    arma::uvec _keep = piv.head(r);
+    arma::mat R11 = R.submat(0, 0, r - 1, r - 1);
+    arma::mat _tmp = arma::solve(arma::trimatl(R11.t()), arma::mat(b.rows(_keep)));
+    x.rows(_keep) = arma::solve(arma::trimatu(R11), _tmp);
+
+    return x;
+}
+
+
+arma::mat SymmetricFactor::inverse() const{
+    return solve(arma::eye(n, n));
+}
+
+
+bool SymmetricFactor::pivoted() const{
+    return fallback ? fallback->pivoted() : is_pivoted;
+}
+
+
+int SymmetricFactor::rank() const{
+    return fallback ? fallback->rank() : r;
+}
+
+
+int SymmetricFactor::n_rows() const{
+    return n;
+}
+
+
+bool SymmetricFactor::reused() const{
+    return base != nullptr && !fallback;
+}
@@ -0,0 +1,53 @@
+#ifndef SYMMETRICFACTOR_H
+#define SYMMETRICFACTOR_H
+
+#include "milorArma.h"
+#include<memory>
+// [[Rcpp::depends(RcppArmadillo)]]
+
+// a symmetric matrix factorised once and re-used for any number of solves: A = R^T R by Cholesky, or when that
+// fails a diagonally pivoted Cholesky A(p, p) = R^T R truncated at the numerical rank - rank-deficient systems
+// get a basic solution with the dropped pivots set to 0, rather than a pseudoinverse.
+// In single precision the Cholesky is computed in float and each solve is refined to double precision against A,
+// as LAPACK's dsposv - if the float factorisation fails, or the refinement stalls, a double factor is used instead.
+// A factor can also be re-used for a nearby matrix, e.g. from the previous iteration: if ||I - B^-1 A|| estimated from
+// 2 probes is below tol the solves are refined against A using the factor of B, otherwise A is factorised afresh.
+// Each refinement sweep costs O(n^2) per right-hand side, so a solve only uses the re-used factor while
+// k * sweeps < n/3 for k right-hand sides, i.e. while it is cheaper than the n^3/3 of a fresh Cholesky - solves with
+// many right-hand sides, e.g. P * Z, factorise A instead, and that factor is kept for the later solves
+// the largest estimated contraction at which the previous iteration's factor is re-used - each refinement step
+// then gains at least 1 digit
+const double factor_reuse_tol = 0.05;
+
+class SymmetricFactor {
+public:
+    SymmetricFactor();
+    explicit SymmetricFactor(const arma::mat& A, bool single=false);
+    SymmetricFactor(const arma::mat& A, const SymmetricFactor& previous, double tol, bool single=false);
+    arma::mat solve(const arma::mat& b) const; // A^-1 b
+    arma::mat inverse() const;
+    bool pivoted() const;
+    int rank() const;
+    int n_rows() const;
+    bool reused() const; // the solves have only used the factor of a nearby matrix
+
+private:
+    int n;
+    int r;
+    bool is_pivoted;
+    arma::mat R; // upper triangular, only the leading r X r block is used when pivoted
+    arma::uvec piv;
+    bool is_single;
+    arma::fmat Rf; // single precision upper triangular factor
+    std::shared_ptr<const SymmetricFactor> base; // the re-used factor of a nearby matrix
+    int sweeps; // the refinement sweeps expected to reach double precision from the re-used factor
+    arma::mat symA; // only kept for the refinement residuals
+    mutable std::shared_ptr<SymmetricFactor> fallback; // double factor of A, only formed if refining would stall or cost more
+    void factorise(const arma::mat& A, bool single);
+    void doubleCholesky(const arma::mat& A);
+    void pivotedCholesky(const arma::mat& A);
+    std::shared_ptr<const SymmetricFactor> fullFactor() const;
+    arma::mat refinedSolve(const arma::mat& b) const;
+};
+
+#endif
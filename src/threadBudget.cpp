@@ -0,0 +1,81 @@
+#include "milorArma.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifndef _WIN32
+#include <dlfcn.h>
+#endif
+// [[Rcpp::depends(RcppArmadillo)]]
+#include "threadBudget.h"
+
+// the BLAS that R is linked against is only known at run time, so its thread controls are looked up by name
+namespace {
+typedef void (*set_threads_fn)(int);
+typedef int (*get_threads_fn)(void);
+
+void* blasSymbol(const char* name){
+#ifndef _WIN32
+    return dlsym(RTLD_DEFAULT, name);
+#else
+    return nullptr;
+#endif
+}
+}
+
+
+int blasThreads(){
+    get_threads_fn _get = reinterpret_cast<get_threads_fn>(blasSymbol("openblas_get_num_threads"));
+    if(_get == nullptr){
+        _get = reinterpret_cast<get_threads_fn>(blasSymbol("MKL_Get_Max_Threads"));
+    }
+
+    return _get == nullptr ? 0 : _get();
+}
+
+
+bool setBlasThreads(int nthreads){
+    if(nthreads <= 0){
+        return false;
+    }
+
+    const char* setters[] = {"openblas_set_num_threads", "MKL_Set_Num_Threads"};
+    for(const char* name : setters){
+        set_threads_fn _set = reinterpret_cast<set_threads_fn>(blasSymbol(name));
+        if(_set != nullptr){
+            _set(nthreads);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+ThreadBudget::ThreadBudget(int omp_threads, int blas_threads) : prev_omp(0), prev_blas(0){
+#ifdef _OPENMP
+    if(omp_threads > 0){
+        prev_omp = omp_get_max_threads();
+        omp_set_num_threads(omp_threads);
+    }
+#endif
+
+    if(blas_threads > 0){
+        prev_blas = blasThreads();
+        if(!setBlasThreads(blas_threads)){
+            prev_blas = 0;
+        }
+    }
+}
+
+
+ThreadBudget::~ThreadBudget(){
+#ifdef _OPENMP
+    if(prev_omp > 0){
+        omp_set_num_threads(prev_omp);
+    }
+#endif
+
+    if(prev_blas > 0){
+        setBlasThreads(prev_blas);
+    }
+}
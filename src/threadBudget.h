@@ -0,0 +1,26 @@
+#ifndef THREADBUDGET_H
+#define THREADBUDGET_H
+
+#include "milorArma.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+
+// the number of OpenMP and BLAS threads used within a model fit. The BLAS thread count can only be set for
+// BLAS libraries that expose it at run time (OpenBLAS, MKL) - the reference BLAS is single threaded anyway
+int blasThreads(); // 0 if the BLAS thread count can't be queried
+bool setBlasThreads(int nthreads);
+
+// sets the OpenMP and BLAS thread counts for its lifetime and restores the previous counts on destruction, such that
+// errors thrown from a fit don't leave the process-wide settings changed. A count <= 0 leaves that setting as is
+class ThreadBudget {
+public:
+    ThreadBudget(int omp_threads, int blas_threads);
+    ~ThreadBudget();
+    ThreadBudget(const ThreadBudget&) = delete;
+    ThreadBudget& operator=(const ThreadBudget&) = delete;
+
+private:
+    int prev_omp;
+    int prev_blas;
+};
+
+#endif
@@ -1,9 +1,17 @@
-#include<RcppArmadillo.h>
-#include<Rcpp.h>
+#include "milorArma.h"
 // [[Rcpp::depends(RcppArmadillo)]]
 #include "utils.h"
+#ifdef MILOR_STANDALONE
+#include<cmath>
+#include<iostream>
+#endif
+
+// warnings raised inside the GLMM engine are either passed straight to R, or collected per-thread
+// when a fit is running off the main R thread, e.g. in the batched nhood fitter
+static thread_local std::vector<std::string>* glmm_warning_sink = nullptr;
 
 // utility functions
+#ifndef MILOR_STANDALONE
 Rcpp::LogicalVector check_na_arma_numeric(arma::vec X){
     // don't being function names with '_'
     // input is an arma::vec
@@ -87,8 +95,9 @@ Rcpp::LogicalVector check_tol_arma_numeric(arma::vec X, double tol){
 
     return _out;
 }
+#endif
 
-bool check_pd_matrix(arma::mat A){
+bool check_pd_matrix(const arma::mat& A){
     // check that A matrix is positive definite - i.e. all positive eigenvalues
     // A must be square
     unsigned int m = A.n_cols;
@@ -102,8 +111,7 @@ bool check_pd_matrix(arma::mat A){
     _is_sym = A.is_symmetric();
 
     if(!_is_sym){
-        Rcpp::stop("matrix A is not symmetric");
-        return false;
+        throw std::runtime_error("matrix A is not symmetric");
     }
 
     arma::vec eigenvals = arma::eig_sym(A);
@@ -111,3 +119,140 @@ bool check_pd_matrix(arma::mat A){
     alltrue = all(eigenvals > 0.0);
     return alltrue;
 }
+
+
+void glmmWarning(const std::string& msg){
+    // R API calls are not thread-safe, so only call back into R if no sink is registered
+    if(glmm_warning_sink != nullptr){
+        glmm_warning_sink->push_back(msg);
+    } else{
+#ifdef MILOR_STANDALONE
+        std::cerr << "Warning: " << msg << std::endl;
+#else
+        Rcpp::warning(msg);
+#endif
+    }
+}
+
+
+void setGlmmWarningSink(std::vector<std::string>* sink){
+    // register (or clear with nullptr) the warning collector for the calling thread
+    glmm_warning_sink = sink;
+}
+
+
+#ifndef MILOR_STANDALONE
+std::vector<arma::uvec> uvecListFromR(const Rcpp::List& u_indices){
+    // convert the R list of (1-based) Z column indices once, so the fitting
+    // loop doesn't need to touch R objects
+    unsigned int c = u_indices.size();
+    std::vector<arma::uvec> out(c);
+
+    for(unsigned int i=0; i < c; i++){
+        out[i] = Rcpp::as<arma::uvec>(u_indices[i]);
+    }
+
+    return out;
+}
+
+
+Rcpp::List matListToR(const std::vector<arma::mat>& mat_list){
+    unsigned int c = mat_list.size();
+    Rcpp::List out(c);
+
+    for(unsigned int i=0; i < c; i++){
+        out[i] = mat_list[i];
+    }
+
+    return out;
+}
+#endif
+
+
+#ifdef MILOR_STANDALONE
+namespace {
+double incompleteBetaFraction(double a, double b, double x){
+    // continued fraction for the regularised incomplete beta function, evaluated by the modified Lentz method
+    const double _tiny = 1e-300;
+    const double _eps = 1e-15;
+    double c = 1.0;
+    double d = 1.0 - (a + b) * x/(a + 1.0);
+    d = 1.0/(std::abs(d) < _tiny ? _tiny : d);
+    double h = d;
+
+    for(int k=1; k <= 1000; k++){
+        const int k2 = 2*k;
+        double aa = k * (b - k) * x/((a + k2 - 1.0) * (a + k2));
+        d = 1.0 + aa * d;
+        d = 1.0/(std::abs(d) < _tiny ? _tiny : d);
+        c = 1.0 + aa/c;
+        c = std::abs(c) < _tiny ? _tiny : c;
+        h *= d * c;
+
+        aa = -(a + k) * (a + b + k) * x/((a + k2) * (a + k2 + 1.0));
+        d = 1.0 + aa * d;
+        d = 1.0/(std::abs(d) < _tiny ? _tiny : d);
+        c = 1.0 + aa/c;
+        c = std::abs(c) < _tiny ? _tiny : c;
+        const double _del = d * c;
+        h *= _del;
+
+        if(std::abs(_del - 1.0) < _eps){
+            break;
+        }
+    }
+
+    return h;
+}
+
+
+double incompleteBeta(double a, double b, double x){
+    // regularised incomplete beta function I_x(a, b)
+    if(x <= 0.0){
+        return 0.0;
+    } else if(x >= 1.0){
+        return 1.0;
+    }
+
+    const double _front = std::exp(std::lgamma(a + b) - std::lgamma(a) - std::lgamma(b) +
+                                   a * std::log(x) + b * std::log1p(-x));
+
+    // the continued fraction converges quickly either side of the mean
+    if(x < (a + 1.0)/(a + b + 2.0)){
+        return _front * incompleteBetaFraction(a, b, x)/a;
+    } else{
+        return 1.0 - _front * incompleteBetaFraction(b, a, 1.0 - x)/b;
+    }
+}
+}
+#endif
+
+
+arma::vec computePvalues(const arma::vec& tscores, const arma::vec& df){
+    // 2-sided t-test p-values, as computePvalue in R
+    const int m = tscores.size();
+    arma::vec pvals(m);
+
+    for(int i=0; i < m; i++){
+#ifdef MILOR_STANDALONE
+        // P(|T| > t) = I_{df/(df + t^2)}(df/2, 1/2) without R's distribution functions
+        const double _t2 = tscores[i] * tscores[i];
+        pvals[i] = std::isnan(_t2) || std::isnan(df[i]) ? glmmNAReal() : incompleteBeta(df[i]/2, 0.5, df[i]/(df[i] + _t2));
+#else
+        pvals[i] = 2 * R::pt(std::abs(tscores[i]), df[i], 0, 0);
+#endif
+    }
+
+    return pvals;
+}
+
+
+#ifndef MILOR_STANDALONE
+Rcpp::NumericVector namedVector(const arma::vec& x, const std::vector<std::string>& names){
+    // a plain named R vector, rather than the 1 column matrix that wrapping an arma::vec gives
+    Rcpp::NumericVector out(x.begin(), x.end());
+    out.attr("names") = Rcpp::wrap(names);
+
+    return out;
+}
+#endif
@@ -1,13 +1,23 @@
 #ifndef UTILS_H
 #define UTILS_H
 
-#include<RcppArmadillo.h>
+#include "milorArma.h"
 // [[Rcpp::depends(RcppArmadillo)]]
 
+bool check_pd_matrix(const arma::mat& A);
+void glmmWarning(const std::string& msg); // to R, or stderr in the standalone build, unless a sink is registered
+void setGlmmWarningSink(std::vector<std::string>* sink);
+arma::vec computePvalues(const arma::vec& tscores, const arma::vec& df);
+
+// conversions at the R boundary
+#ifndef MILOR_STANDALONE
 Rcpp::LogicalVector check_na_arma_numeric(arma::vec x);
 Rcpp::LogicalVector check_inf_arma_numeric(arma::vec X);
 Rcpp::LogicalVector check_zero_arma_numeric(arma::vec X);
 Rcpp::LogicalVector check_zero_arma_complex(arma::cx_vec X);
 Rcpp::LogicalVector check_tol_arma_numeric(arma::vec X, double tol);
-bool check_pd_matrix(arma::mat A);
+std::vector<arma::uvec> uvecListFromR(const Rcpp::List& u_indices);
+Rcpp::List matListToR(const std::vector<arma::mat>& mat_list);
+Rcpp::NumericVector namedVector(const arma::vec& x, const std::vector<std::string>& names);
+#endif
 #endif